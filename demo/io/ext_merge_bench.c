@@ -0,0 +1,112 @@
+#include "ac_allocator.h"
+#include "ac_in.h"
+#include "ac_timer.h"
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compares the loser tree merge in ac_in_ext with the binary heap merge.  Each
+   test merges k sorted streams of 8 byte keys and reports the time and number
+   of compare calls per record. */
+
+static size_t num_compares = 0;
+
+static int compare_keys(const ac_io_record_t *a, const ac_io_record_t *b,
+                        void *arg) {
+  num_compares++;
+  uint64_t x = *(uint64_t *)a->record;
+  uint64_t y = *(uint64_t *)b->record;
+  return (x != y) ? (x < y) ? -1 : 1 : 0;
+}
+
+static bool count_reducer(ac_io_record_t *res, const ac_io_record_t *r,
+                          size_t num_r, ac_buffer_t *bh, void *arg) {
+  *res = r[0];
+  return true;
+}
+
+static ac_in_t *merge_init(uint64_t *keys, ac_io_record_t *records,
+                           size_t num_streams, size_t per_stream,
+                           bool use_heap, bool reduce) {
+  ac_in_t *in = ac_in_ext_init(compare_keys, NULL, NULL);
+  if (use_heap)
+    ac_in_ext_use_heap(in);
+  if (reduce)
+    ac_in_ext_reducer(in, count_reducer, NULL);
+  for (size_t i = 0; i < num_streams; i++) {
+    ac_io_record_t *r = records + (i * per_stream);
+    uint64_t *k = keys + (i * per_stream);
+    for (size_t j = 0; j < per_stream; j++) {
+      r[j].record = (char *)(k + j);
+      r[j].length = sizeof(uint64_t);
+      r[j].tag = 0;
+    }
+    ac_in_ext_add(in, ac_in_records_init(r, per_stream, NULL), i);
+  }
+  return in;
+}
+
+static void run_test(uint64_t *keys, ac_io_record_t *records,
+                     size_t num_streams, size_t per_stream, bool reduce) {
+  double per_record[2];
+  size_t compares[2];
+  size_t num_records[2];
+  for (int engine = 0; engine < 2; engine++) {
+    ac_in_t *in = merge_init(keys, records, num_streams, per_stream,
+                             engine == 1, reduce);
+    num_compares = 0;
+    size_t num = 0;
+    ac_timer_t *t = ac_timer_init(1);
+    ac_timer_start(t);
+    while (ac_in_advance(in))
+      num++;
+    ac_timer_stop(t);
+    num_records[engine] = num;
+    compares[engine] = num_compares;
+    per_record[engine] = num ? (ac_timer_ns(t) / num) : 0.0;
+    ac_timer_destroy(t);
+    ac_in_destroy(in);
+  }
+  if (num_records[0] != num_records[1])
+    abort();
+
+  printf("%s k=%'5lu records=%'10lu  tree %6.2f cmp %6.1f ns  heap %6.2f cmp "
+         "%6.1f ns\n",
+         reduce ? "reduce" : "merge ", num_streams, num_records[0],
+         compares[0] / (double)num_records[0], per_record[0],
+         compares[1] / (double)num_records[1], per_record[1]);
+}
+
+int main(int argc, char *argv[]) {
+  setlocale(LC_NUMERIC, "");
+  size_t total = 4000000;
+  if (argc > 1)
+    total = atol(argv[1]);
+
+  uint64_t *keys = (uint64_t *)ac_malloc(sizeof(uint64_t) * total);
+  ac_io_record_t *records =
+      (ac_io_record_t *)ac_malloc(sizeof(ac_io_record_t) * total);
+
+  size_t streams[] = {2, 8, 32, 128, 512, 1024};
+  for (size_t s = 0; s < sizeof(streams) / sizeof(streams[0]); s++) {
+    size_t num_streams = streams[s];
+    size_t per_stream = total / num_streams;
+    srand(num_streams);
+    for (size_t i = 0; i < num_streams; i++) {
+      uint64_t *k = keys + (i * per_stream);
+      uint64_t v = 0;
+      for (size_t j = 0; j < per_stream; j++) {
+        v += 1 + (rand() % (num_streams * 2));
+        k[j] = v;
+      }
+    }
+    run_test(keys, records, num_streams, per_stream, false);
+    run_test(keys, records, num_streams, per_stream, true);
+  }
+
+  ac_free(records);
+  ac_free(keys);
+  return 0;
+}
@@ -20,8 +20,9 @@ bool file_ok(const char *filename, void *arg) {
 }
 
 int usage(const char *prog) {
-  printf("%s <path> <extensions>\n", prog);
+  printf("%s <path> <extensions> [limit]\n", prog);
   printf("extensions - a comma delimited list of valid extensions\n");
+  printf("limit - only display the limit most frequent tokens\n");
   printf("\n");
   return 0;
 }
@@ -100,6 +101,7 @@ int main(int argc, char *argv[]) {
 
   const char *path = argv[1];
   const char *ext = argv[2];
+  size_t limit = argc > 3 ? ac_uint64_t(argv[3], 0) : 0;
 
   char **extensions = ac_split(NULL, ',', ext);
 
@@ -126,6 +128,8 @@ int main(int argc, char *argv[]) {
   in = ac_out_in(out);
   ac_out_ext_options_compare(&out_ext_opts, compare_tokens_by_frequency, NULL);
   ac_out_ext_options_reducer(&out_ext_opts, NULL, NULL);
+  /* with a limit, only the most frequent tokens are kept while sorting */
+  ac_out_ext_options_limit(&out_ext_opts, limit);
   out = ac_out_ext_init("sorted_tokens_final", &out_opts, &out_ext_opts);
   ac_in_out(in, out);
   ac_in_destroy(in);
@@ -17,12 +17,18 @@ void ac_out_destroy(ac_out_t *out);
 
 typedef ac_io_record_t *(*ac_in_advance_f)(ac_in_t *h);
 typedef ac_io_record_t *(*ac_in_advance_unique_f)(ac_in_t *h, size_t *num_r);
+typedef size_t (*ac_in_advance_batch_f)(ac_in_t *h, ac_io_record_t *records,
+                                        size_t max);
 
 static const int AC_IN_NORMAL_TYPE = 0; // default (due to memset)
 static const int AC_IN_EXT_TYPE = 1;
 static const int AC_IN_RECORDS_TYPE = 2;
 static const int AC_IN_LIST_TYPE = 3;
 
+struct lz4_reader_s;
+typedef struct lz4_reader_s lz4_reader_t;
+static void lz4_reader_destroy(lz4_reader_t *r);
+
 size_t ac_in_count(ac_in_t *h) {
   size_t r = 0;
   while (ac_in_advance(h))
@@ -52,6 +58,9 @@ struct ac_in_list_s {
   ac_out_t *out;
   void (*destroy_out)(ac_out_t *out);
   ac_buffer_t *group_bh;
+  ac_in_advance_batch_f advance_batch;
+  ac_in_advance_f advance_batch_base;
+  ac_buffer_t *batch_bh;
 
   ac_io_file_info_t *file_list;
   ac_io_file_info_t *filep;
@@ -77,10 +86,20 @@ struct ac_in_s {
   ac_out_t *out;
   void (*destroy_out)(ac_out_t *out);
   ac_buffer_t *group_bh;
+  ac_in_advance_batch_f advance_batch;
+  ac_in_advance_f advance_batch_base;
+  ac_buffer_t *batch_bh;
 
   ac_in_advance_f sub_advance;
+  ac_in_advance_f range_advance;
+  uint64_t range_pos;
+  uint64_t range_end;
+  ac_in_advance_f key_advance;
+  bool key_started;
   ac_buffer_t *reducer_bh;
   ac_buffer_t *reducer_group_bh;
+  ac_buffer_t *reducer_next_bh;
+  bool reducer_next;
 
   ac_in_base_t *base;
 
@@ -88,12 +107,14 @@ struct ac_in_s {
   uint32_t fixed;
 
   ac_lz4_t *lz4;
+  lz4_reader_t *lz4_reader;
   ac_buffer_t *bh; // for overflow
   ac_in_buffer_t buf;
   uint32_t block_size;
   uint32_t block_header_size;
   char *zerop;
   char zero;
+  ac_in_batch_t batch;
 };
 
 ac_io_record_t *ac_in_advance_unique_single(ac_in_t *h, size_t *num_r) {
@@ -198,6 +219,68 @@ ac_io_record_t *ac_in_advance(ac_in_t *h) {
   return h->advance(h);
 }
 
+/* copy each record from advance into batch_bh, used when the records can't be
+   parsed in place (reset, limits, reducers, merges, ...) */
+static size_t advance_copy_batch(ac_in_t *h, ac_io_record_t *records,
+                                 size_t max) {
+  ac_buffer_t *bh = h->batch_bh;
+  ac_buffer_clear(bh);
+  size_t n = 0;
+  ac_io_record_t *r;
+  while (n < max && (r = h->advance(h)) != NULL) {
+    records[n] = *r;
+    ac_buffer_append(bh, r->record, r->length);
+    ac_buffer_appendc(bh, 0);
+    n++;
+  }
+  char *p = ac_buffer_data(bh);
+  for (size_t i = 0; i < n; i++) {
+    records[i].record = p;
+    p += records[i].length + 1;
+  }
+  return n;
+}
+
+bool ac_in_advance_batch_in_place(ac_in_t *h) {
+  return h && h->advance_batch && h->advance == h->advance_batch_base;
+}
+
+size_t ac_in_advance_batch(ac_in_t *h, ac_io_record_t *records, size_t max) {
+  if (!h || !max)
+    return 0;
+
+  if (!h->batch_bh)
+    h->batch_bh = ac_buffer_init(4096);
+  if (ac_in_advance_batch_in_place(h))
+    return h->advance_batch(h, records, max);
+  return advance_copy_batch(h, records, max);
+}
+
+static inline size_t finish_batch(ac_in_t *h, ac_io_record_t *records,
+                                  size_t n) {
+  if (!n) {
+    /* the next record isn't complete in the buffer */
+    ac_io_record_t *r = h->advance(h);
+    if (!r)
+      return 0;
+    records[0] = *r;
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++)
+    records[i].tag = h->rec.tag;
+  h->rec = records[n - 1];
+  h->current = &(h->rec);
+  h->num_current = 1;
+  return n;
+}
+
+static size_t _advance_batch(ac_in_t *h, ac_io_record_t *records,
+                             size_t max) {
+  size_t n = ac_in_base_read_batch(h->base, h->batch_bh, records, max,
+                                   h->options.format);
+  return finish_batch(h, records, n);
+}
+
 ac_io_record_t *_advance_prefix(ac_in_t *h) {
   h->num_current = 1;
   char *p = ac_in_base_read(h->base, 4);
@@ -273,6 +356,8 @@ char *ac_in_lz4_read(ac_in_t *h, uint32_t len);
 char *ac_in_lz4_readz(ac_in_t *h, int32_t *rlen, uint32_t len);
 char *ac_in_lz4_read_delimited(ac_in_t *h, int32_t *rlen, char delim,
                                bool required);
+static size_t _advance_batch_lz4(ac_in_t *h, ac_io_record_t *records,
+                                 size_t max);
 
 ac_io_record_t *_advance_prefix_lz4(ac_in_t *h) {
   char *p = ac_in_lz4_read(h, 4);
@@ -383,16 +468,30 @@ void ac_in_destroy(ac_in_t *h) {
   else if (h->type == AC_IN_LIST_TYPE)
     ac_in_destroy_from_list(h);
   else {
+    if (h->lz4_reader)
+      lz4_reader_destroy(h->lz4_reader);
     if (h->base)
       ac_in_base_destroy(h->base);
     if (h->lz4)
       ac_lz4_destroy(h->lz4);
+    ac_in_buffer_destroy_delimiters(&h->buf);
     if (h->out && h->destroy_out)
       h->destroy_out(h->out);
     if (h->group_bh)
       ac_buffer_destroy(h->group_bh);
+    if (h->batch_bh)
+      ac_buffer_destroy(h->batch_bh);
+    ac_in_batch_destroy(&h->batch);
+    if (h->reducer_bh) {
+      ac_buffer_destroy(h->reducer_bh);
+      ac_buffer_destroy(h->reducer_group_bh);
+      ac_buffer_destroy(h->reducer_next_bh);
+    }
 
-    ac_free(h);
+    if (h->lz4)
+      ac_io_buffer_free(h);
+    else
+      ac_free(h);
   }
 }
 
@@ -400,6 +499,7 @@ void reset_block(ac_in_buffer_t *b) {
   memmove(b->buffer, b->buffer + b->pos, b->used - b->pos);
   b->used -= b->pos;
   b->pos = 0;
+  ac_in_buffer_clear_delimiters(b);
 }
 
 static int read_lz4_block(ac_in_t *h, ac_in_buffer_t *dest) {
@@ -430,7 +530,226 @@ static int read_lz4_block(ac_in_t *h, ac_in_buffer_t *dest) {
   return n;
 }
 
+/*
+  lz4_reader_t decompresses the blocks of an lz4 input on num_threads threads
+  ahead of the consumer (the reverse of lz4_writer_t in ac_out.c).  A reader
+  thread copies the compressed blocks out of the base input in order, the
+  decompress threads decode them in any order (the blocks are compressed
+  independently), and the consumer copies them out in order.  The blocks form
+  a ring, so at most num_blocks blocks are read ahead.  Each decompress thread
+  has its own lz4 context since the context is not thread safe.
+*/
+typedef struct {
+  char *src;
+  uint32_t src_len;
+  bool compressed;
+  char *dest;
+  int dest_len;
+  uint32_t pos;
+  bool decompressed;
+} lz4_read_block_t;
+
+typedef struct {
+  lz4_reader_t *r;
+  ac_lz4_t *lz4;
+  pthread_t thread;
+} lz4_read_thread_t;
+
+struct lz4_reader_s {
+  ac_in_t *in;
+  lz4_read_thread_t *threads;
+  size_t num_threads;
+  lz4_read_block_t *blocks;
+  size_t num_blocks;
+  uint32_t block_size;
+  uint32_t src_size;
+
+  /* sequence numbers of the next block to fill, decompress and read */
+  size_t fill;
+  size_t decompress;
+  size_t read;
+  bool eof;
+  bool finished;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t reader;
+};
+
+/* copies the next compressed block into b, returns false at the end */
+static bool read_lz4_src(lz4_reader_t *r, lz4_read_block_t *b) {
+  ac_in_t *h = r->in;
+  uint32_t *s = (uint32_t *)ac_in_base_read(h->base, 4);
+  if (!s)
+    return false;
+
+  uint32_t length = *s;
+  b->compressed = true;
+  if (length & 0x80000000U) {
+    b->compressed = false;
+    length -= 0x80000000U;
+  }
+  if (!length)
+    return false;
+
+  length += h->block_header_size;
+  if (length > r->src_size)
+    return false;
+  char *p = ac_in_base_read(h->base, length);
+  if (!p)
+    return false;
+  memcpy(b->src, p, length);
+  b->src_len = length;
+  return true;
+}
+
+static void *lz4_read_thread(void *arg) {
+  lz4_reader_t *r = (lz4_reader_t *)arg;
+  pthread_mutex_lock(&r->mutex);
+  while (true) {
+    while (r->fill - r->read >= r->num_blocks && !r->finished)
+      pthread_cond_wait(&r->cond, &r->mutex);
+    if (r->finished)
+      break;
+    lz4_read_block_t *b = r->blocks + (r->fill % r->num_blocks);
+    pthread_mutex_unlock(&r->mutex);
+    bool ok = read_lz4_src(r, b);
+    pthread_mutex_lock(&r->mutex);
+    if (!ok) {
+      r->eof = true;
+      pthread_cond_broadcast(&r->cond);
+      break;
+    }
+    r->fill++;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+static void *lz4_decompress_thread(void *arg) {
+  lz4_read_thread_t *t = (lz4_read_thread_t *)arg;
+  lz4_reader_t *r = t->r;
+  pthread_mutex_lock(&r->mutex);
+  while (true) {
+    while (r->decompress == r->fill && !r->eof && !r->finished)
+      pthread_cond_wait(&r->cond, &r->mutex);
+    if (r->decompress == r->fill || r->finished)
+      break;
+    lz4_read_block_t *b = r->blocks + (r->decompress % r->num_blocks);
+    r->decompress++;
+    pthread_mutex_unlock(&r->mutex);
+    b->dest_len = ac_lz4_decompress(t->lz4, b->src, b->src_len, b->dest,
+                                    r->block_size, b->compressed);
+    pthread_mutex_lock(&r->mutex);
+    b->decompressed = true;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+static lz4_reader_t *lz4_reader_init(ac_in_t *h, const char *header,
+                                     size_t num_threads, size_t num_blocks) {
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_blocks < (num_threads * 2) + 2)
+    num_blocks = (num_threads * 2) + 2;
+  uint32_t block_size = h->block_size;
+  uint32_t src_size = ac_lz4_compressed_size(h->lz4) + h->block_header_size;
+  lz4_reader_t *r = (lz4_reader_t *)ac_io_buffer_alloc(
+      sizeof(lz4_reader_t) + (sizeof(lz4_read_thread_t) * num_threads) +
+      (sizeof(lz4_read_block_t) * num_blocks) +
+      ((size_t)(block_size + src_size) * num_blocks));
+  memset(r, 0, sizeof(lz4_reader_t) +
+                   (sizeof(lz4_read_thread_t) * num_threads) +
+                   (sizeof(lz4_read_block_t) * num_blocks));
+  r->in = h;
+  r->threads = (lz4_read_thread_t *)(r + 1);
+  r->blocks = (lz4_read_block_t *)(r->threads + num_threads);
+  char *p = (char *)(r->blocks + num_blocks);
+  for (size_t i = 0; i < num_blocks; i++) {
+    r->blocks[i].src = p;
+    p += src_size;
+    r->blocks[i].dest = p;
+    p += block_size;
+  }
+  r->num_blocks = num_blocks;
+  r->block_size = block_size;
+  r->src_size = src_size;
+  r->num_threads = num_threads;
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    lz4_read_thread_t *t = r->threads + i;
+    t->r = r;
+    t->lz4 = ac_lz4_init_decompress((void *)header, 7);
+    pthread_create(&t->thread, NULL, lz4_decompress_thread, t);
+  }
+  pthread_create(&r->reader, NULL, lz4_read_thread, r);
+  return r;
+}
+
+/* copies up to len bytes into dest, less only at the end of the input (or if
+   a block fails to decompress) */
+static size_t lz4_reader_read(lz4_reader_t *r, char *dest, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    pthread_mutex_lock(&r->mutex);
+    lz4_read_block_t *b = r->blocks + (r->read % r->num_blocks);
+    while ((r->read < r->fill && !b->decompressed) ||
+           (r->read == r->fill && !r->eof))
+      pthread_cond_wait(&r->cond, &r->mutex);
+    bool empty = (r->read == r->fill);
+    pthread_mutex_unlock(&r->mutex);
+    if (empty || b->dest_len <= 0)
+      break;
+
+    /* only the consumer touches the block until read is advanced */
+    size_t length = b->dest_len - b->pos;
+    if (length > len - n)
+      length = len - n;
+    memcpy(dest + n, b->dest + b->pos, length);
+    b->pos += length;
+    n += length;
+    if (b->pos == (uint32_t)b->dest_len) {
+      pthread_mutex_lock(&r->mutex);
+      b->pos = 0;
+      b->decompressed = false;
+      r->read++;
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->mutex);
+    }
+  }
+  return n;
+}
+
+static void lz4_reader_destroy(lz4_reader_t *r) {
+  pthread_mutex_lock(&r->mutex);
+  r->finished = true;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+  pthread_join(r->reader, NULL);
+  for (size_t i = 0; i < r->num_threads; i++) {
+    pthread_join(r->threads[i].thread, NULL);
+    ac_lz4_destroy(r->threads[i].lz4);
+  }
+  pthread_mutex_destroy(&r->mutex);
+  pthread_cond_destroy(&r->cond);
+  ac_io_buffer_free(r);
+}
+
 static void fill_blocks(ac_in_t *h, ac_in_buffer_t *dest) {
+  if (h->lz4_reader) {
+    if (dest->eof)
+      return;
+    size_t bytes = dest->size - dest->used;
+    size_t n = lz4_reader_read(h->lz4_reader, dest->buffer + dest->used, bytes);
+    dest->used += n;
+    if (n < bytes)
+      dest->eof = true;
+    return;
+  }
   while (1) {
     if (dest->used + h->block_size <= dest->size) {
       if (read_lz4_block(h, dest) <= 0) {
@@ -455,6 +774,128 @@ void _ac_in_empty(ac_in_t *h) {
   h->advance_tmp = h->advance;
 }
 
+/* The records which start in [range_start, range_end) are read, so the last
+   record may extend past range_end.  Fixed length records are found by
+   rounding the range up to the record length.  A delimited record starts at
+   range_start if the byte before it is a delimiter, so reading begins one byte
+   early (see start_record_range) and continues to the end of the input.
+   Prefix records can't be found from an offset. */
+static void align_record_range(const ac_in_options_t *o, uint64_t *start,
+                               uint64_t *end) {
+  if (o->format > 0) {
+    uint64_t length = o->format;
+    *start = ((*start + length - 1) / length) * length;
+    *end = ((*end + length - 1) / length) * length;
+  } else if (o->format < 0) {
+    if (*start)
+      (*start)--;
+    *end = 0;
+  } else
+    abort();
+}
+
+static ac_io_record_t *advance_in_range(ac_in_t *h) {
+  if (h->range_pos < h->range_end) {
+    ac_io_record_t *r = h->range_advance(h);
+    if (r) {
+      h->range_pos += r->length + 1;
+      return r;
+    }
+  }
+  _ac_in_empty(h);
+  return NULL;
+}
+
+static void start_record_range(ac_in_t *h) {
+  uint64_t pos = h->options.range_start;
+  if (pos) {
+    /* skip the end of the record which started before the range (this is
+       empty if the range starts on a record) */
+    ac_io_record_t *r = h->advance(h);
+    if (!r) {
+      _ac_in_empty(h);
+      return;
+    }
+    pos += r->length;
+    h->current = NULL;
+    h->num_current = 0;
+  }
+  if (h->options.range_end) {
+    h->range_pos = pos;
+    h->range_end = h->options.range_end;
+    h->range_advance = h->advance;
+    h->advance = advance_in_range;
+  }
+}
+
+/* Finds the last entry in filename.keys whose key is less than key_start.  The
+   first record which isn't less than key_start follows it. */
+static bool find_key_index(const char *filename, const ac_in_options_t *o,
+                           ac_out_key_index_entry_t *res) {
+  char *name = (char *)ac_malloc(strlen(filename) + 6);
+  sprintf(name, "%s.keys", filename);
+  size_t len = 0;
+  char *index = ac_io_read_file(&len, name);
+  ac_free(name);
+  if (!index)
+    return false;
+
+  ac_out_key_index_header_t *header = (ac_out_key_index_header_t *)index;
+  ac_out_key_index_entry_t *entries = (ac_out_key_index_entry_t *)(header + 1);
+  uint64_t size, modified;
+  bool valid = len >= sizeof(*header) &&
+               !memcmp(header->magic, AC_OUT_KEY_INDEX_MAGIC,
+                       sizeof(header->magic)) &&
+               header->num_keys <= (len - sizeof(*header)) / sizeof(*entries) &&
+               ac_io_file_stamp(filename, &size, &modified) &&
+               header->size == size && header->modified == modified;
+  size_t lo = 0;
+  if (valid) {
+    char *keys = (char *)(entries + header->num_keys);
+    size_t keys_length = len - (keys - index);
+    size_t hi = header->num_keys;
+    ac_io_record_t key;
+    key.tag = 0;
+    while (lo < hi) {
+      size_t mid = lo + ((hi - lo) >> 1);
+      ac_out_key_index_entry_t *e = entries + mid;
+      if (e->key + e->length >= keys_length) {
+        valid = false;
+        break;
+      }
+      key.record = keys + e->key;
+      key.length = e->length;
+      if (o->key_compare(&key, o->key_start, o->key_compare_arg) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  }
+  if (valid && lo)
+    *res = entries[lo - 1];
+  ac_free(index);
+  return valid && lo;
+}
+
+/* skips the records before key_start (if the input started at an indexed
+   record) and stops at the first record which isn't less than key_end */
+static ac_io_record_t *advance_in_keys(ac_in_t *h) {
+  ac_in_options_t *o = &(h->options);
+  ac_io_record_t *r;
+  while ((r = h->key_advance(h)) != NULL) {
+    if (!h->key_started) {
+      if (o->key_compare(r, o->key_start, o->key_compare_arg) < 0)
+        continue;
+      h->key_started = true;
+    }
+    if (o->key_end && o->key_compare(r, o->key_end, o->key_compare_arg) >= 0)
+      break;
+    return r;
+  }
+  _ac_in_empty(h);
+  return NULL;
+}
+
 ac_in_t *ac_in_empty() {
   ac_in_t *h = (ac_in_t *)ac_calloc(sizeof(ac_in_t));
   _ac_in_empty(h);
@@ -486,6 +927,24 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
     options->compressed_buffer_size = tmp;
   }
 
+  if (options->bloom_hash && filename &&
+      !ac_io_bloom_check(filename, options->bloom_hash,
+                         options->bloom_hash_arg, options->bloom_keys,
+                         options->num_bloom_keys)) {
+    if (fd != -1 && can_close)
+      close(fd);
+    if (buf && can_free)
+      ac_free(buf);
+    return ac_in_empty();
+  }
+
+  /* a key range starts from the key index if there is one */
+  ac_out_key_index_entry_t key;
+  memset(&key, 0, sizeof(key));
+  bool seek_key = options->key_compare && options->key_start && filename &&
+                  !buf && !options->range_start && !options->range_end &&
+                  find_key_index(filename, options, &key);
+
   ac_in_base_t *base = NULL;
   if (buf) {
     if (options->gz)
@@ -495,8 +954,13 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
   } else {
     if ((!filename && options->gz) || ac_io_extension(filename, "gz"))
       base = ac_in_base_init_gz(filename, fd, can_close, options->buffer_size);
-    else
-      base = ac_in_base_init(filename, fd, can_close, options->buffer_size);
+    else {
+      if (options->mmap && !is_lz4 && !options->range_end &&
+          !options->range_start && !seek_key)
+        base = ac_in_base_init_mmap(filename, fd, can_close);
+      if (!base)
+        base = ac_in_base_init(filename, fd, can_close, options->buffer_size);
+    }
   }
   ac_in_t *h = NULL;
   if (!base) {
@@ -518,6 +982,8 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
       _ac_in_empty(h);
       return h;
     }
+    char header[7];
+    memcpy(header, headerp, 7);
     ac_lz4_t *lz4 = ac_lz4_init_decompress(headerp, 7);
     if (!lz4) {
       ac_in_base_destroy(base);
@@ -535,11 +1001,17 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
       // printf("reinit\n");
       base = ac_in_base_reinit(base, compressed_size + block_header_size + 4);
     }
+    if (seek_key)
+      ac_in_base_range(base, key.block_offset, 0);
+    if (options->io_uring)
+      ac_in_base_io_uring(base, options->io_uring);
     buffer_size = options->compressed_buffer_size;
     if (buffer_size < (block_size * 2) + 100)
       buffer_size = (block_size * 2) + 100;
 
-    h = (ac_in_t *)ac_malloc(sizeof(ac_in_t) + buffer_size + 1);
+    /* the decompression buffer is large, so it comes from the io buffer pool
+       (which is how lz4 inputs are freed in ac_in_destroy) */
+    h = (ac_in_t *)ac_io_buffer_alloc(sizeof(ac_in_t) + buffer_size + 1);
     memset(h, 0, sizeof(*h));
     h->lz4 = lz4;
     h->buf.buffer = (char *)(h + 1);
@@ -558,10 +1030,33 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
       h->advance = _advance_fixed_lz4;
     } else
       h->advance = _advance_prefix_lz4;
+    h->advance_batch = _advance_batch_lz4;
+    h->advance_batch_base = h->advance;
+    if (options->lz4_threads || options->readahead)
+      h->lz4_reader = lz4_reader_init(h, header, options->lz4_threads,
+                                      options->readahead);
     // printf("%p filling\n", h);
     fill_blocks(h, &(h->buf));
     // printf("%p filled: %lu, %s\n", h, buffer_size, filename ? filename : "");
+    if (seek_key) {
+      if (key.block_pos <= h->buf.used)
+        h->buf.pos = key.block_pos;
+      else
+        _ac_in_empty(h);
+    }
   } else {
+    uint64_t start = options->range_start;
+    uint64_t end = options->range_end;
+    if (options->record_range)
+      align_record_range(options, &start, &end);
+    else if (seek_key)
+      start = key.offset;
+    if (start || end)
+      ac_in_base_range(base, start, end);
+    if (options->readahead)
+      ac_in_base_readahead(base, options->readahead);
+    if (options->io_uring)
+      ac_in_base_io_uring(base, options->io_uring);
     h = (ac_in_t *)ac_calloc(sizeof(ac_in_t));
     h->options = *options;
     h->base = base;
@@ -574,13 +1069,26 @@ ac_in_t *_ac_in_init(const char *filename, int fd, bool can_close, void *buf,
       h->advance = _advance_fixed;
     } else
       h->advance = _advance_prefix;
+    h->advance_batch = _advance_batch;
+    h->advance_batch_base = h->advance;
+    if (end && end <= start)
+      _ac_in_empty(h);
+    else if (options->record_range && options->format < 0)
+      start_record_range(h);
   }
   h->advance_unique = ac_in_advance_unique_single;
   h->advance_unique_tmp = h->advance_unique;
 
+  if (options->key_compare && (options->key_start || options->key_end)) {
+    h->key_started = !options->key_start;
+    h->key_advance = h->advance;
+    h->advance = advance_in_keys;
+  }
+
   if (options->reducer) {
     h->reducer_bh = ac_buffer_init(256);
     h->reducer_group_bh = ac_buffer_init(256);
+    h->reducer_next_bh = ac_buffer_init(256);
     h->sub_advance = h->advance;
     h->advance = advance_reduced;
   }
@@ -599,13 +1107,8 @@ ac_io_record_t *advance_file_list(ac_in_t *hp) {
   if (!r) {
     ac_in_destroy(h->cur_in);
     h->cur_in = NULL;
-    ac_in_options_t opts;
     while (!h->cur_in && h->filep < h->fileep) {
-      opts = h->options;
-      if (h->filep[0].size < opts.buffer_size)
-        opts.buffer_size = h->filep[0].size;
-      opts.tag = h->filep[0].tag;
-      h->cur_in = ac_in_init(h->filep[0].filename, &opts);
+      h->cur_in = ac_in_init_from_file_info(h->filep, &(h->options));
       h->filep++;
     }
     if (!h->cur_in) {
@@ -630,6 +1133,17 @@ ac_io_record_t *advance_unique_file_list(ac_in_t *hp, size_t *num_r) {
   return r;
 }
 
+ac_in_t *ac_in_init_from_file_info(ac_io_file_info_t *fi,
+                                   ac_in_options_t *options) {
+  ac_in_options_t opts = *options;
+  if (fi->size && fi->size < opts.buffer_size)
+    opts.buffer_size = fi->size;
+  opts.tag = fi->tag;
+  if (fi->end)
+    ac_in_options_record_range(&opts, fi->start, fi->end);
+  return ac_in_init(fi->filename, &opts);
+}
+
 ac_in_t *ac_in_init_from_list(ac_io_file_info_t *files, size_t num_files,
                               ac_in_options_t *options) {
   if (!num_files)
@@ -656,19 +1170,16 @@ ac_in_t *ac_in_init_from_list(ac_io_file_info_t *files, size_t num_files,
   }
   h->filep = h->file_list;
   h->fileep = fp;
-  ac_in_options_t opts;
   while (!h->cur_in && h->filep < h->fileep) {
-    opts = h->options;
-    if (h->filep[0].size < opts.buffer_size)
-      opts.buffer_size = h->filep[0].size;
-    opts.tag = h->filep[0].tag;
-    h->cur_in = ac_in_init(h->filep[0].filename, &opts);
+    h->cur_in = ac_in_init_from_file_info(h->filep, &(h->options));
     h->filep++;
   }
   h->advance = advance_file_list;
   h->advance_unique = advance_unique_file_list;
   h->advance_unique_tmp = h->advance_unique;
   h->advance_tmp = h->advance;
+  if (!h->cur_in)
+    _ac_in_empty((ac_in_t *)h);
   return (ac_in_t *)h;
 }
 
@@ -678,6 +1189,8 @@ void ac_in_destroy_from_list(ac_in_t *hp) {
     return;
   if (h->cur_in)
     ac_in_destroy(h->cur_in);
+  if (h->batch_bh)
+    ac_buffer_destroy(h->batch_bh);
   h->filep = h->file_list;
   while (h->filep < h->fileep) {
     ac_free(h->filep->filename);
@@ -701,40 +1214,49 @@ void ac_in_limit(ac_in_t *h, size_t limit) {
   h->advance = h->advance_tmp = count_and_advance;
 }
 
+static inline void append_reduced_record(ac_buffer_t *bh, ac_io_record_t *r) {
+  ac_buffer_append(bh, &(r->length), sizeof(r->length));
+  ac_buffer_append(bh, &(r->tag), sizeof(r->tag));
+  ac_buffer_append(bh, r->record, r->length);
+  ac_buffer_appendc(bh, 0);
+}
+
 ac_io_record_t *advance_reduced(ac_in_t *h) {
   ac_buffer_t *bh = h->reducer_group_bh;
   ac_io_compare_f compare = h->options.compare;
   void *arg = h->options.compare_arg;
-  ac_buffer_clear(bh);
   ac_io_record_t r1;
   ac_io_record_t *r;
   ac_io_record_t *res;
   size_t num_records;
   do {
-    if ((r = h->sub_advance(h)) == NULL) {
-      _ac_in_empty(h);
-      return NULL;
+    /* the first record of the group may have been read while finding the end
+       of the last group */
+    ac_buffer_clear(bh);
+    if (h->reducer_next) {
+      ac_buffer_set(bh, ac_buffer_data(h->reducer_next_bh),
+                    ac_buffer_length(h->reducer_next_bh));
+      h->reducer_next = false;
+    } else {
+      if ((r = h->sub_advance(h)) == NULL) {
+        _ac_in_empty(h);
+        return NULL;
+      }
+      append_reduced_record(bh, r);
     }
-
-    ac_buffer_set(bh, &(r->length), sizeof(r->length));
-    ac_buffer_append(bh, &(r->tag), sizeof(r->tag));
-    ac_buffer_append(bh, r->record, r->length);
-    ac_buffer_appendc(bh, 0);
     num_records = 1;
-    r1 = *r;
+    char *b = ac_buffer_data(bh);
+    r1.length = *(uint32_t *)b;
+    r1.tag = *(int32_t *)(b + sizeof(uint32_t));
     while ((r = h->sub_advance(h)) != NULL) {
-      char *b = ac_buffer_data(bh);
-      b += sizeof(r->length) + sizeof(r->tag);
-      r1.record = b;
-
+      r1.record = ac_buffer_data(bh) + sizeof(r->length) + sizeof(r->tag);
       if (compare(&r1, r, arg)) {
-        ac_in_reset(h);
+        ac_buffer_clear(h->reducer_next_bh);
+        append_reduced_record(h->reducer_next_bh, r);
+        h->reducer_next = true;
         break;
       }
-      ac_buffer_append(bh, &(r->length), sizeof(r->length));
-      ac_buffer_append(bh, &(r->tag), sizeof(r->tag));
-      ac_buffer_append(bh, r->record, r->length);
-      ac_buffer_appendc(bh, 0);
+      append_reduced_record(bh, r);
       num_records++;
     }
     size_t len = ac_buffer_length(bh);
@@ -797,6 +1319,16 @@ static inline void cleanup_last_read(ac_in_t *h) {
     (*h->zerop) = h->zero;
     h->zerop = NULL;
   }
+  if (h->batch.num_zeros)
+    ac_in_batch_restore(&h->batch);
+}
+
+static size_t _advance_batch_lz4(ac_in_t *h, ac_io_record_t *records,
+                                 size_t max) {
+  cleanup_last_read(h);
+  size_t n = ac_in_buffer_read_batch(&h->buf, &h->batch, h->batch_bh, records,
+                                     max, h->options.format);
+  return finish_batch(h, records, n);
 }
 
 char *ac_in_lz4_read_delimited(ac_in_t *h, int32_t *rlen, char delim,
@@ -810,18 +1342,16 @@ char *ac_in_lz4_read_delimited(ac_in_t *h, int32_t *rlen, char delim,
   char *sp = p;
   // 2. search for delimiter between pos/used
   char *ep = b->buffer + b->used;
-  while (p < ep) {
-    if (*p != delim)
-      p++;
-    else {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    }
+  p = ac_in_buffer_find_delimiter(b, delim);
+  if (p) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    h->zerop = p;
+    h->zero = *p;
+    *p = 0;
+    return sp;
   }
+  p = ep;
 
   // 3. if finished, there is no more data to read, return what is present
   if (b->eof) {
@@ -834,22 +1364,17 @@ char *ac_in_lz4_read_delimited(ac_in_t *h, int32_t *rlen, char delim,
   if (b->pos > 0) {
     reset_block(b);
     sp = b->buffer;
-    p = sp + b->used;
-    b->pos = b->used;
     fill_blocks(h, b);
-    char *ep = sp + b->used;
-    while (p < ep) {
-      if (*p != delim)
-        p++;
-      else {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      }
+    p = ac_in_buffer_find_delimiter(b, delim);
+    if (p) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      h->zerop = p;
+      h->zero = *p;
+      *p = 0;
+      return sp;
     }
+    p = sp + b->used;
     if (b->eof) {
       b->pos = b->used;
       return end_of_block(h, rlen, sp, p, required);
@@ -863,6 +1388,7 @@ char *ac_in_lz4_read_delimited(ac_in_t *h, int32_t *rlen, char delim,
     ac_buffer_append(h->bh, b->buffer, b->used);
     b->used = 0;
     b->pos = 0;
+    ac_in_buffer_clear_delimiters(b);
     fill_blocks(h, b);
     p = b->buffer;
     sp = p;
@@ -1084,11 +1610,58 @@ void ac_in_options_lz4(ac_in_options_t *h, size_t buffer_size) {
   h->compressed_buffer_size = buffer_size;
 }
 
+void ac_in_options_mmap(ac_in_options_t *h) { h->mmap = true; }
+
+void ac_in_options_readahead(ac_in_options_t *h, size_t num_blocks) {
+  h->readahead = num_blocks;
+}
+
+void ac_in_options_lz4_threads(ac_in_options_t *h, size_t num_threads) {
+  h->lz4_threads = num_threads;
+}
+
+void ac_in_options_io_uring(ac_in_options_t *h, size_t num_blocks) {
+  h->io_uring = num_blocks;
+}
+
+void ac_in_options_range(ac_in_options_t *h, uint64_t start, uint64_t end) {
+  h->range_start = start;
+  h->range_end = end;
+}
+
+void ac_in_options_record_range(ac_in_options_t *h, uint64_t start,
+                                uint64_t end) {
+  h->range_start = start;
+  h->range_end = end;
+  h->record_range = true;
+}
+
+bool ac_in_gz_index(const char *filename, size_t span) {
+  return ac_in_base_gz_index(filename, span);
+}
+
 void ac_in_options_compressed_buffer_size(ac_in_options_t *h,
                                           size_t buffer_size) {
   h->compressed_buffer_size = buffer_size;
 }
 
+void ac_in_options_key_range(ac_in_options_t *h, ac_io_compare_f compare,
+                             void *arg, const ac_io_record_t *start,
+                             const ac_io_record_t *end) {
+  h->key_compare = compare;
+  h->key_compare_arg = arg;
+  h->key_start = start;
+  h->key_end = end;
+}
+
+void ac_in_options_bloom_keys(ac_in_options_t *h, ac_io_hash_f hash, void *arg,
+                              const ac_io_record_t *keys, size_t num_keys) {
+  h->bloom_hash = hash;
+  h->bloom_hash_arg = arg;
+  h->bloom_keys = keys;
+  h->num_bloom_keys = num_keys;
+}
+
 void ac_in_options_reducer(ac_in_options_t *h, ac_io_compare_f compare,
                            void *compare_arg, ac_io_reducer_f reducer,
                            void *reducer_arg) {
@@ -1108,12 +1681,21 @@ void ac_in_options_reducer(ac_in_options_t *h, ac_io_compare_f compare,
 struct in_heap_s;
 typedef struct in_heap_s in_heap_t;
 
+/* if a key prefix function is set, the prefix of each input's current record
+   is kept with the input so most comparisons don't need the record */
+typedef struct {
+  uint64_t prefix;
+  ac_in_t *in;
+} in_heap_item_t;
+
 struct in_heap_s {
   ssize_t size;
   ssize_t max_size;
-  ac_in_t **heap;
+  in_heap_item_t *heap;
   ac_io_compare_f compare;
   void *compare_arg;
+  ac_io_key_prefix_f key_prefix;
+  void *key_prefix_arg;
 };
 
 static inline void in_heap_init(in_heap_t *h, ssize_t mx,
@@ -1122,9 +1704,11 @@ static inline void in_heap_init(in_heap_t *h, ssize_t mx,
   if (mx < 2)
     mx = 2;
   h->max_size = mx;
-  h->heap = (ac_in_t **)ac_malloc((mx + 1) * sizeof(ac_in_t *));
+  h->heap = (in_heap_item_t *)ac_malloc((mx + 1) * sizeof(in_heap_item_t));
   h->compare = compare;
   h->compare_arg = arg;
+  h->key_prefix = NULL;
+  h->key_prefix_arg = NULL;
 }
 
 static inline void in_heap_clear(in_heap_t *h) { h->size = 0; }
@@ -1137,46 +1721,35 @@ static inline void in_heap_destroy(in_heap_t *h) {
   ac_free(h->heap);
 }
 
-static inline ac_in_t **in_heap_base(in_heap_t *h) { return h->heap; }
-
 static inline size_t in_heap_size(in_heap_t *h) { return h->size; }
 
-static inline int in_heap_compare(in_heap_t *h, ac_in_t *a, ac_in_t *b) {
-  return h->compare(a->current, b->current, h->compare_arg);
+static inline int in_heap_compare(in_heap_t *h, in_heap_item_t *a,
+                                  in_heap_item_t *b) {
+  if (h->key_prefix && a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  return h->compare(a->in->current, b->in->current, h->compare_arg);
 }
 
-static inline int in_heap_compare2(in_heap_t *h, ac_io_record_t *a,
-                                   ac_in_t *b) {
-  return h->compare(a, b->current, h->compare_arg);
-}
-
-void test_heap(in_heap_t *h) {
-  for (size_t i = 1; i <= h->size; i++) {
-    if (h->heap[i] == NULL)
-      abort();
-  }
-}
-
-static inline void in_heap_push(in_heap_t *h, ac_in_t *item) {
+static inline void in_heap_push(in_heap_t *h, ac_in_t *in) {
   if (h->size >= h->max_size) {
     h->max_size = h->size * 2;
-    ac_in_t **heap =
-        (ac_in_t **)ac_malloc((h->max_size + 1) * sizeof(ac_in_t *));
-    memcpy(heap, h->heap, ((h->size + 1) * sizeof(ac_in_t *)));
+    in_heap_item_t *heap = (in_heap_item_t *)ac_malloc(
+        (h->max_size + 1) * sizeof(in_heap_item_t));
+    memcpy(heap, h->heap, ((h->size + 1) * sizeof(in_heap_item_t)));
     ac_free(h->heap);
     h->heap = heap;
   }
   h->size++;
   ssize_t num = h->size;
-  ac_in_t **heap = h->heap;
-  // ac_in_t *tmp = heap[num];
-  heap[num] = item;
-  // heap[0] = tmp;
+  in_heap_item_t *heap = h->heap;
+  heap[num].in = in;
+  if (h->key_prefix)
+    heap[num].prefix = h->key_prefix(in->current, h->key_prefix_arg);
   ssize_t i = num;
   ssize_t j = i >> 1;
-  ac_in_t *tmp;
+  in_heap_item_t tmp;
 
-  while (j > 0 && in_heap_compare(h, heap[i], heap[j]) < 0) {
+  while (j > 0 && in_heap_compare(h, heap + i, heap + j) < 0) {
     tmp = heap[i];
     heap[i] = heap[j];
     heap[j] = tmp;
@@ -1185,37 +1758,178 @@ static inline void in_heap_push(in_heap_t *h, ac_in_t *item) {
   }
 }
 
-static inline ac_in_t *in_heap_pop(in_heap_t *h) {
+static inline void in_heap_pop(in_heap_t *h, in_heap_item_t *r) {
   h->size--;
   ssize_t num = h->size;
-  ac_in_t **heap = h->heap;
-  ac_in_t *r = heap[1];
+  in_heap_item_t *heap = h->heap;
+  *r = heap[1];
   heap[1] = heap[num + 1];
 
   ssize_t i = 1;
   ssize_t j = i << 1;
   ssize_t k = j + 1;
 
-  if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
+  if (k <= num && in_heap_compare(h, heap + k, heap + j) < 0)
     j = k;
 
-  while (j <= num && in_heap_compare(h, heap[j], heap[i]) < 0) {
-    ac_in_t *tmp = heap[i];
+  while (j <= num && in_heap_compare(h, heap + j, heap + i) < 0) {
+    in_heap_item_t tmp = heap[i];
     heap[i] = heap[j];
     heap[j] = tmp;
 
     i = j;
     j = i << 1;
     k = j + 1;
-    if (k <= num && in_heap_compare(h, heap[k], heap[j]) < 0)
+    if (k <= num && in_heap_compare(h, heap + k, heap + j) < 0)
       j = k;
   }
-  return r;
+}
+
+/*
+  in_tree_t is a tournament (loser) tree over the ac_in_t objects.  Each leaf
+  holds an input (or NULL once the input is finished or while it is held
+  out of the tree) and each internal node holds the leaf which lost the match
+  at that node.  The overall winner is kept in node 0.  After the winning
+  input advances, only the matches on the path from its leaf to the root are
+  replayed which is about log2(k) comparisons per record (versus about
+  2*log2(k) for popping and pushing a binary heap).  The winner of each
+  internal node is also kept so that a leaf which is not the overall winner
+  (one held out by advance_unique) can be put back in with the same number of
+  comparisons.
+*/
+
+typedef struct {
+  size_t size;
+  size_t max_size;
+  in_heap_item_t *leaves;
+  uint32_t *nodes;
+  uint32_t *winners;
+  uint32_t *held;
+  bool needs_build;
+  ac_io_compare_f compare;
+  void *compare_arg;
+  ac_io_key_prefix_f key_prefix;
+  void *key_prefix_arg;
+} in_tree_t;
+
+static inline void in_tree_init(in_tree_t *h, ac_io_compare_f compare,
+                                void *arg) {
+  memset(h, 0, sizeof(*h));
+  h->compare = compare;
+  h->compare_arg = arg;
+}
+
+static inline void in_tree_destroy(in_tree_t *h) {
+  if (h->leaves)
+    ac_free(h->leaves);
+}
+
+static inline void in_tree_grow(in_tree_t *h) {
+  size_t max_size = h->max_size ? h->max_size * 2 : 16;
+  in_heap_item_t *leaves = (in_heap_item_t *)ac_malloc(
+      (sizeof(in_heap_item_t) + (sizeof(uint32_t) * 4)) * max_size);
+  if (h->size)
+    memcpy(leaves, h->leaves, sizeof(in_heap_item_t) * h->size);
+  uint32_t *nodes = (uint32_t *)(leaves + max_size);
+  uint32_t *held = nodes + (max_size * 3);
+  if (h->size)
+    memcpy(held, h->held, sizeof(uint32_t) * h->size);
+  if (h->leaves)
+    ac_free(h->leaves);
+  h->leaves = leaves;
+  h->nodes = nodes;
+  h->winners = nodes + max_size;
+  h->held = held;
+  h->max_size = max_size;
+}
+
+/* true if leaf a should come out of the tree before leaf b */
+static inline bool in_tree_beats(in_tree_t *h, uint32_t a, uint32_t b) {
+  in_heap_item_t *la = h->leaves + a;
+  in_heap_item_t *lb = h->leaves + b;
+  if (!la->in)
+    return false;
+  if (!lb->in)
+    return true;
+  if (h->key_prefix && la->prefix != lb->prefix)
+    return la->prefix < lb->prefix;
+  return h->compare(la->in->current, lb->in->current, h->compare_arg) <= 0;
+}
+
+static inline void in_tree_set(in_tree_t *h, uint32_t leaf, ac_in_t *in) {
+  h->leaves[leaf].in = in;
+  if (in && h->key_prefix)
+    h->leaves[leaf].prefix = h->key_prefix(in->current, h->key_prefix_arg);
+}
+
+static void in_tree_build(in_tree_t *h) {
+  size_t k = h->size;
+  uint32_t *nodes = h->nodes;
+  uint32_t *winners = h->winners;
+  for (size_t n = k - 1; n > 0; n--) {
+    size_t c = n << 1;
+    uint32_t a = c >= k ? c - k : winners[c];
+    c++;
+    uint32_t b = c >= k ? c - k : winners[c];
+    if (in_tree_beats(h, a, b)) {
+      winners[n] = a;
+      nodes[n] = b;
+    } else {
+      winners[n] = b;
+      nodes[n] = a;
+    }
+  }
+  nodes[0] = k > 1 ? winners[1] : 0;
+  h->needs_build = false;
+}
+
+/* replay the matches from leaf up to the root after the leaf changed, the
+   leaf must have been the overall winner */
+static inline void in_tree_replay(in_tree_t *h, uint32_t leaf) {
+  uint32_t *nodes = h->nodes;
+  uint32_t *winners = h->winners;
+  uint32_t winner = leaf;
+  for (size_t n = (leaf + h->size) >> 1; n > 0; n >>= 1) {
+    if (in_tree_beats(h, nodes[n], winner)) {
+      uint32_t tmp = nodes[n];
+      nodes[n] = winner;
+      winner = tmp;
+    }
+    winners[n] = winner;
+  }
+  nodes[0] = winner;
+}
+
+/* replay the matches from any leaf up to the root after the leaf changed */
+static inline void in_tree_update(in_tree_t *h, uint32_t leaf) {
+  uint32_t *nodes = h->nodes;
+  uint32_t *winners = h->winners;
+  size_t k = h->size;
+  uint32_t winner = leaf;
+  for (size_t p = leaf + k; p > 1; p >>= 1) {
+    size_t n = p >> 1;
+    size_t sibling = p ^ 1;
+    uint32_t other = sibling >= k ? sibling - k : winners[sibling];
+    if (in_tree_beats(h, winner, other))
+      nodes[n] = other;
+    else {
+      nodes[n] = winner;
+      winner = other;
+    }
+    winners[n] = winner;
+  }
+  nodes[0] = winner;
+}
+
+static inline in_heap_item_t *in_tree_winner(in_tree_t *h) {
+  if (h->needs_build)
+    in_tree_build(h);
+  return h->leaves + h->nodes[0];
 }
 
 /*
   The ac_in_ext_t structure needs to share the same members as ac_in_s up
-  through group_bh.
+  through batch_bh.
 */
 
 typedef struct {
@@ -1236,13 +1950,19 @@ typedef struct {
   ac_out_t *out;
   void (*destroy_out)(ac_out_t *out);
   ac_buffer_t *group_bh;
+  ac_in_advance_batch_f advance_batch;
+  ac_in_advance_f advance_batch_base;
+  ac_buffer_t *batch_bh;
 
   ac_in_t **active;
   size_t num_active;
   size_t active_size;
   ac_io_record_t *r;
 
+  bool use_heap;
   in_heap_t heap;
+  in_tree_t tree;
+  uint64_t current_prefix;
 
   ac_buffer_t *reducer_bh;
   ac_io_reducer_f reducer;
@@ -1266,34 +1986,70 @@ ac_in_t *ac_in_ext_init(ac_io_compare_f compare, void *arg,
   h->compare_arg = arg;
   h->options = *options;
   in_heap_init(&(h->heap), 0, compare, arg);
+  in_tree_init(&(h->tree), compare, arg);
 
   _ac_in_empty((ac_in_t *)h);
   return (ac_in_t *)h;
 }
 
+/* put the held inputs back into the tree, advancing them first if requested */
+static void move_active_to_tree(ac_in_ext_t *h, bool advance) {
+  in_tree_t *tree = &(h->tree);
+  for (size_t i = 0; i < h->num_active; i++) {
+    ac_in_t *in = h->active[i];
+    if (advance && !ac_in_advance(in)) {
+      ac_in_destroy(in);
+      in = NULL;
+    }
+    uint32_t leaf = tree->held[i];
+    bool held_out = tree->leaves[leaf].in == NULL;
+    in_tree_set(tree, leaf, in);
+    if (tree->needs_build)
+      continue;
+    if (held_out)
+      in_tree_update(tree, leaf);
+    else
+      in_tree_replay(tree, leaf);
+  }
+  h->num_active = 0;
+}
+
 void ac_in_ext_destroy(ac_in_t *hp) {
   ac_in_ext_t *h = (ac_in_ext_t *)hp;
   if (!h)
     return;
 
-  for (size_t i = 0; i < h->num_active; i++)
-    ac_in_destroy(h->active[i]);
+  in_heap_t *heap = &(h->heap);
+  in_tree_t *tree = &(h->tree);
+  if (h->use_heap) {
+    for (size_t i = 0; i < h->num_active; i++)
+      ac_in_destroy(h->active[i]);
+
+    in_heap_item_t item;
+    while (in_heap_size(heap)) {
+      in_heap_pop(heap, &item);
+      ac_in_destroy(item.in);
+    }
+  } else {
+    for (size_t i = 0; i < h->num_active; i++)
+      tree->leaves[tree->held[i]].in = h->active[i];
+    for (size_t i = 0; i < tree->size; i++)
+      ac_in_destroy(tree->leaves[i].in);
+  }
 
   if (h->active)
     ac_free(h->active);
 
-  in_heap_t *heap = &(h->heap);
-
-  while (in_heap_size(heap))
-    ac_in_destroy(in_heap_pop(heap));
-
   in_heap_destroy(heap);
+  in_tree_destroy(tree);
 
   if (h->reducer_bh)
     ac_buffer_destroy(h->reducer_bh);
 
   if (h->group_bh)
     ac_buffer_destroy(h->group_bh);
+  if (h->batch_bh)
+    ac_buffer_destroy(h->batch_bh);
 
   if (h->out)
     ac_out_destroy(h->out);
@@ -1327,10 +2083,12 @@ ac_io_record_t *ac_in_ext_advance(ac_in_t *hp) {
   move_active_to_heap(h, true);
   in_heap_t *heap = &(h->heap);
   if (in_heap_size(heap)) {
-    ac_in_t *in = in_heap_pop(heap);
-    h->active[0] = in;
+    in_heap_item_t item;
+    in_heap_pop(heap, &item);
+    h->active[0] = item.in;
     h->num_active = 1;
-    h->current = ac_in_current(in);
+    h->current_prefix = item.prefix;
+    h->current = ac_in_current(item.in);
     return h->current;
   }
   _ac_in_empty(hp);
@@ -1347,14 +2105,15 @@ ac_io_record_t *ac_in_ext_advance_unique(ac_in_t *hp, size_t *num_r) {
   ac_in_t **activep = h->active + 1;
   ac_io_record_t *rp = h->r;
   *rp++ = *first;
-  ac_in_t *in = NULL;
+  in_heap_item_t item;
   while (in_heap_size(heap)) {
-    in = in_heap_pop(heap);
-    if (!in_heap_compare2(heap, first, in)) {
-      *activep++ = in;
-      *rp++ = *ac_in_current(in);
+    in_heap_pop(heap, &item);
+    if ((!heap->key_prefix || item.prefix == h->current_prefix) &&
+        !h->compare(first, item.in->current, h->compare_arg)) {
+      *activep++ = item.in;
+      *rp++ = *ac_in_current(item.in);
     } else {
-      in_heap_push(heap, in);
+      in_heap_push(heap, item.in);
       break;
     }
   }
@@ -1365,11 +2124,68 @@ ac_io_record_t *ac_in_ext_advance_unique(ac_in_t *hp, size_t *num_r) {
   return h->current;
 }
 
+/* The winner stays in the tree (it is the active input) until the next call
+   when it is advanced and its path is replayed. */
+ac_io_record_t *ac_in_ext_tree_advance(ac_in_t *hp) {
+  if (!hp)
+    return NULL;
+
+  ac_in_ext_t *h = (ac_in_ext_t *)hp;
+  in_tree_t *tree = &(h->tree);
+  move_active_to_tree(h, true);
+  in_heap_item_t *winner = in_tree_winner(tree);
+  if (winner->in) {
+    tree->held[0] = tree->nodes[0];
+    h->active[0] = winner->in;
+    h->num_active = 1;
+    h->current = ac_in_current(winner->in);
+    return h->current;
+  }
+  _ac_in_empty(hp);
+  return NULL;
+}
+
+/* Equal records are found by holding each winner out of the tree (which
+   replays its path) and checking the next winner.  The held inputs are
+   advanced and put back on the next call. */
+ac_io_record_t *ac_in_ext_tree_advance_unique(ac_in_t *hp, size_t *num_r) {
+  ac_io_record_t *first = ac_in_ext_tree_advance(hp);
+  if (!first)
+    return NULL;
+
+  ac_in_ext_t *h = (ac_in_ext_t *)hp;
+  in_tree_t *tree = &(h->tree);
+  uint64_t first_prefix = tree->leaves[tree->held[0]].prefix;
+  ac_io_record_t *rp = h->r;
+  *rp++ = *first;
+  size_t num_active = 1;
+  while (true) {
+    uint32_t leaf = tree->held[num_active - 1];
+    tree->leaves[leaf].in = NULL;
+    in_tree_replay(tree, leaf);
+    in_heap_item_t *winner = tree->leaves + tree->nodes[0];
+    if (!winner->in || (tree->key_prefix && winner->prefix != first_prefix) ||
+        h->compare(first, winner->in->current, h->compare_arg))
+      break;
+    tree->held[num_active] = tree->nodes[0];
+    h->active[num_active] = winner->in;
+    *rp++ = *ac_in_current(winner->in);
+    num_active++;
+  }
+  h->num_active = num_active;
+  h->num_current = num_active;
+  h->current = h->r;
+  *num_r = h->num_current;
+  return h->current;
+}
+
 ac_io_record_t *ac_in_ext_advance_reduce(ac_in_t *hp) {
   ac_in_ext_t *h = (ac_in_ext_t *)hp;
   while (1) {
     size_t num_r = 0;
-    ac_io_record_t *r = ac_in_ext_advance_unique(hp, &num_r);
+    ac_io_record_t *r = h->use_heap
+                            ? ac_in_ext_advance_unique(hp, &num_r)
+                            : ac_in_ext_tree_advance_unique(hp, &num_r);
     if (!r)
       return NULL;
     if (h->reducer(&h->rec, r, num_r, h->reducer_bh, h->reducer_arg)) {
@@ -1396,14 +2212,27 @@ void ac_in_ext_add(ac_in_t *hp, ac_in_t *in, int tag) {
   }
   in->options.tag = tag;
 
-  in_heap_t *heap = &(h->heap);
-  move_active_to_heap(h, false);
-  in_heap_push(heap, in);
+  size_t num_inputs;
+  if (h->use_heap) {
+    in_heap_t *heap = &(h->heap);
+    move_active_to_heap(h, false);
+    in_heap_push(heap, in);
+    num_inputs = in_heap_max(heap);
+  } else {
+    in_tree_t *tree = &(h->tree);
+    move_active_to_tree(h, false);
+    if (tree->size == tree->max_size)
+      in_tree_grow(tree);
+    in_tree_set(tree, tree->size, in);
+    tree->size++;
+    tree->needs_build = true;
+    num_inputs = tree->max_size;
+  }
 
-  if (h->active_size < in_heap_size(heap)) {
+  if (h->active_size < num_inputs) {
     if (h->active)
       ac_free(h->active);
-    h->active_size = in_heap_max(heap);
+    h->active_size = num_inputs;
     h->active = (ac_in_t **)ac_malloc(
         (sizeof(ac_in_t *) + sizeof(ac_io_record_t)) * h->active_size);
     h->r = (ac_io_record_t *)(h->active + h->active_size);
@@ -1413,9 +2242,15 @@ void ac_in_ext_add(ac_in_t *hp, ac_in_t *in, int tag) {
   if (h->advance == empty_record) {
     if (h->reducer)
       h->advance = h->advance_tmp = ac_in_ext_advance_reduce;
-    else
+    else if (h->use_heap)
       h->advance = h->advance_tmp = ac_in_ext_advance;
-    h->advance_unique = h->advance_unique_tmp = ac_in_ext_advance_unique;
+    else
+      h->advance = h->advance_tmp = ac_in_ext_tree_advance;
+    if (h->use_heap)
+      h->advance_unique = h->advance_unique_tmp = ac_in_ext_advance_unique;
+    else
+      h->advance_unique = h->advance_unique_tmp =
+          ac_in_ext_tree_advance_unique;
   }
 }
 
@@ -1424,7 +2259,7 @@ void ac_in_ext_reducer(ac_in_t *hp, ac_io_reducer_f reducer, void *arg) {
   if (!h || h->type != AC_IN_EXT_TYPE)
     return;
 
-  if (h->advance == ac_in_ext_advance)
+  if (h->advance == ac_in_ext_advance || h->advance == ac_in_ext_tree_advance)
     h->advance = h->advance_tmp = ac_in_ext_advance_reduce;
 
   h->reducer = reducer;
@@ -1432,12 +2267,33 @@ void ac_in_ext_reducer(ac_in_t *hp, ac_io_reducer_f reducer, void *arg) {
   h->reducer_bh = ac_buffer_init(1024);
 }
 
+void ac_in_ext_key_prefix(ac_in_t *hp, ac_io_key_prefix_f key_prefix,
+                          void *arg) {
+  ac_in_ext_t *h = (ac_in_ext_t *)hp;
+  if (!h || h->type != AC_IN_EXT_TYPE || in_heap_size(&(h->heap)) ||
+      h->tree.size)
+    return;
+
+  h->heap.key_prefix = key_prefix;
+  h->heap.key_prefix_arg = arg;
+  h->tree.key_prefix = key_prefix;
+  h->tree.key_prefix_arg = arg;
+}
+
+void ac_in_ext_use_heap(ac_in_t *hp) {
+  ac_in_ext_t *h = (ac_in_ext_t *)hp;
+  if (!h || h->type != AC_IN_EXT_TYPE || h->tree.size)
+    return;
+
+  h->use_heap = true;
+}
+
 void ac_in_ext_keep_first(ac_in_t *hp) {
   ac_in_ext_t *h = (ac_in_ext_t *)hp;
   if (!h || h->type != AC_IN_EXT_TYPE)
     return;
 
-  if (h->advance == ac_in_ext_advance)
+  if (h->advance == ac_in_ext_advance || h->advance == ac_in_ext_tree_advance)
     h->advance = h->advance_tmp = ac_in_ext_advance_reduce;
 
   h->reducer = ac_io_keep_first;
@@ -1465,6 +2321,9 @@ typedef struct {
   ac_out_t *out;
   void (*destroy_out)(ac_out_t *out);
   ac_buffer_t *group_bh;
+  ac_in_advance_batch_f advance_batch;
+  ac_in_advance_f advance_batch_base;
+  ac_buffer_t *batch_bh;
 
   ac_io_record_t *records;
   size_t num_records;
@@ -1480,6 +2339,8 @@ void ac_in_records_destroy(ac_in_t *hp) {
     ac_buffer_destroy(h->reducer_bh);
   if (h->group_bh)
     ac_buffer_destroy(h->group_bh);
+  if (h->batch_bh)
+    ac_buffer_destroy(h->batch_bh);
   if (h->out)
     ac_out_destroy(h->out);
   ac_free(h);
@@ -1599,9 +2460,13 @@ ac_in_t *ac_in_transform(ac_in_t *in, ac_io_format_t format, size_t buffer_size,
 }
 
 void ac_in_out(ac_in_t *in, ac_out_t *out) {
-  ac_io_record_t *r;
-  while ((r = ac_in_advance(in)) != NULL)
-    ac_out_write_record(out, r->record, r->length);
+  ac_io_record_t records[64];
+  size_t num_records;
+  size_t max = sizeof(records) / sizeof(records[0]);
+  while ((num_records = ac_in_advance_batch(in, records, max)) > 0) {
+    for (size_t i = 0; i < num_records; i++)
+      ac_out_write_record(out, records[i].record, records[i].length);
+  }
 }
 
 void ac_in_out2(ac_in_t *in, ac_out_t *out, ac_out_t *out2) {
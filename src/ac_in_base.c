@@ -2,15 +2,30 @@
 
 #include "ac_allocator.h"
 #include "ac_buffer.h"
+#include "ac_io.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
+struct gz_range_s;
+typedef struct gz_range_s gz_range_t;
+static int gz_range_read(gz_range_t *r, char *buffer, size_t len);
+static void gz_range_destroy(gz_range_t *r);
+
+struct uring_reader_s;
+typedef struct uring_reader_s uring_reader_t;
+static size_t uring_reader_read(uring_reader_t *r, char *dest, size_t len);
+static void uring_reader_destroy(uring_reader_t *r);
+
 struct ac_in_base_s {
   ac_in_buffer_t buf;
+  size_t buffer_size;
   char *filename;
   int fd;
   gzFile gz;
@@ -18,30 +33,88 @@ struct ac_in_base_s {
   ac_buffer_t *bh;
   char *zerop;
   char zero;
+  ac_in_batch_t batch;
+
+  /* set if the file is memory mapped (the buffer points into the mapping) */
+  char *map;
+  size_t map_size;
+  size_t released;
+  size_t populated;
+  size_t num_reads;
+
+  /* set if the blocks are read on a helper thread (see ac_in_base_readahead) */
+  ac_in_readahead_t *readahead;
+
+  /* set if the blocks are read with io_uring (see ac_in_base_io_uring) */
+  uring_reader_t *uring;
+
+  /* set if only a range of the input is read (see ac_in_base_range) */
+  gz_range_t *range;
+  bool limited;
+  uint64_t remaining;
 };
 
+/* consumed pages of a mapped file are released in chunks of this size */
+static const size_t MMAP_RELEASE_SIZE = 4 * 1024 * 1024;
+
 static inline void reset_block(ac_in_buffer_t *b) {
   memmove(b->buffer, b->buffer + b->pos, b->used - b->pos);
   b->used -= b->pos;
   b->pos = 0;
+  ac_in_buffer_clear_delimiters(b);
 }
 
 static void fill_blocks(ac_in_base_t *h, ac_in_buffer_t *b) {
   if (b->eof)
     return;
 
+  /* take the next block from the readahead ring in place of the buffer, so
+     only the split record at the end of the buffer is copied */
+  if (h->readahead && b == &(h->buf) && !b->pos) {
+    size_t tail = b->used, used;
+    char *p = ac_in_readahead_swap(h->readahead, b->buffer, tail, &used);
+    if (p) {
+      if (h->limited) {
+        if (used - tail > h->remaining)
+          used = tail + h->remaining;
+        h->remaining -= used - tail;
+      }
+      b->buffer = p;
+      b->size = tail + h->buffer_size;
+      b->used = used;
+      ac_in_buffer_clear_delimiters(b);
+      if (h->limited && !h->remaining) {
+        b->eof = true;
+        b->size = b->used;
+      }
+      if (b->eof || b->used == b->size)
+        return;
+    }
+  }
+
   int bytes = b->size - b->used;
+  if (h->limited && (uint64_t)bytes > h->remaining)
+    bytes = h->remaining;
   int n;
-  if (h->fd != -1)
+  if (h->readahead)
+    n = ac_in_readahead_read(h->readahead, b->buffer + b->used, bytes);
+  else if (h->uring)
+    n = uring_reader_read(h->uring, b->buffer + b->used, bytes);
+  else if (h->range)
+    n = gz_range_read(h->range, b->buffer + b->used, bytes);
+  else if (h->fd != -1)
     n = read(h->fd, b->buffer + b->used, bytes);
   else if (h->gz)
     n = gzread(h->gz, b->buffer + b->used, bytes);
   else
     return;
 
-  if (n >= 0)
+  if (n >= 0) {
     b->used += n;
-  if (n < bytes) {
+    if (h->limited)
+      h->remaining -= n;
+  }
+  if (n < bytes || (h->limited && !h->remaining)) {
     b->eof = true;
     b->size = b->used;
   }
@@ -57,6 +130,814 @@ static inline void cleanup_last_read(ac_in_base_t *h) {
     (*h->zerop) = h->zero;
     h->zerop = NULL;
   }
+  if (h->batch.num_zeros)
+    ac_in_batch_restore(&h->batch);
+}
+
+/* Fault in the next chunk of a mapped file ahead of the reads, which is much
+   cheaper than faulting each page.  When records are smaller than a page,
+   nearly every page gets a zero written in it, so the pages are faulted in as
+   writable (private copies).  Otherwise, they are only mapped for reading.
+   This isn't supported by older kernels and is only a hint. */
+static inline void populate_ahead(ac_in_base_t *h) {
+#ifdef MADV_POPULATE_WRITE
+  size_t start = h->populated;
+  size_t end = h->buf.used;
+  if (start + MMAP_RELEASE_SIZE < end)
+    end = start + MMAP_RELEASE_SIZE;
+  if (end <= start)
+    return;
+  int advice = MADV_POPULATE_READ;
+  if (h->num_reads && h->buf.pos / h->num_reads < (size_t)sysconf(_SC_PAGESIZE))
+    advice = MADV_POPULATE_WRITE;
+  madvise(h->map + start, end - start, advice);
+  h->populated = end;
+#endif
+}
+
+/* give back the pages of a mapped file which are before the next record */
+static inline void release_consumed(ac_in_base_t *h) {
+  if (!h->map)
+    return;
+  size_t pos = h->buf.pos;
+  h->num_reads++;
+  if (pos + (MMAP_RELEASE_SIZE >> 1) > h->populated)
+    populate_ahead(h);
+  if (pos >= h->released + MMAP_RELEASE_SIZE) {
+    pos &= ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    madvise(h->map + h->released, pos - h->released, MADV_DONTNEED);
+    h->released = pos;
+  }
+}
+
+/* the number of delimiter offsets found at once */
+static const uint32_t DELIMITER_INDEX_SIZE = 4096;
+
+char *ac_in_buffer_find_delimiter(ac_in_buffer_t *b, char delim) {
+  while (true) {
+    while (b->next_delim < b->num_delims) {
+      size_t off = b->delims_start + b->delims[b->next_delim++];
+      if (off >= b->pos)
+        return b->buffer + off;
+    }
+    size_t start = b->delims_end > b->pos ? b->delims_end : b->pos;
+    if (start >= b->used)
+      return NULL;
+
+    size_t len = b->used - start;
+    if (len > 0x7FFFFFFF)
+      len = 0x7FFFFFFF;
+    if (!b->delims)
+      b->delims =
+          (uint32_t *)ac_malloc(sizeof(uint32_t) * DELIMITER_INDEX_SIZE);
+    size_t scanned;
+    b->num_delims =
+        ac_io_index_delimiters(b->delims, DELIMITER_INDEX_SIZE, &scanned,
+                               b->buffer + start, len, delim);
+    b->next_delim = 0;
+    b->delims_start = start;
+    b->delims_end = start + scanned;
+  }
+}
+
+void ac_in_buffer_clear_delimiters(ac_in_buffer_t *b) {
+  b->num_delims = b->next_delim = 0;
+  b->delims_start = b->delims_end = 0;
+}
+
+void ac_in_buffer_destroy_delimiters(ac_in_buffer_t *b) {
+  if (b->delims)
+    ac_free(b->delims);
+  b->delims = NULL;
+}
+
+static inline void batch_zero(ac_in_batch_t *z, char *p) {
+  ac_in_zero_t *zp = z->zeros + z->num_zeros;
+  z->num_zeros++;
+  zp->p = p;
+  zp->c = *p;
+  *p = 0;
+}
+
+static inline void batch_reserve(ac_in_batch_t *z, size_t max) {
+  if (max <= z->size)
+    return;
+  if (z->zeros)
+    ac_free(z->zeros);
+  z->size = max;
+  z->zeros = (ac_in_zero_t *)ac_malloc(sizeof(ac_in_zero_t) * max);
+}
+
+static size_t read_prefix_batch(ac_in_buffer_t *b, ac_in_batch_t *z,
+                                ac_io_record_t *records, size_t max) {
+  char *p = b->buffer + b->pos;
+  char *ep = b->buffer + b->used;
+  size_t n = 0;
+  while (n < max && ep - p >= 4) {
+    uint32_t length = (*(uint32_t *)p);
+    if ((size_t)(ep - p) - 4 < length)
+      break;
+    records[n].record = p + 4;
+    records[n].length = length;
+    p += length + 4;
+    n++;
+  }
+  /* the zeros are placed once all of the lengths are read, as each one
+     overwrites the first byte of the next length */
+  batch_reserve(z, n);
+  for (size_t i = 0; i < n; i++)
+    batch_zero(z, records[i].record + records[i].length);
+  b->pos = p - b->buffer;
+  return n;
+}
+
+static size_t read_delimited_batch(ac_in_buffer_t *b, ac_in_batch_t *z,
+                                   ac_io_record_t *records, size_t max,
+                                   char delim) {
+  batch_reserve(z, max);
+  char *sp = b->buffer + b->pos;
+  size_t n = 0;
+  char *p;
+  while (n < max && (p = ac_in_buffer_find_delimiter(b, delim)) != NULL) {
+    records[n].record = sp;
+    records[n].length = p - sp;
+    n++;
+    batch_zero(z, p);
+    sp = p + 1;
+    b->pos = sp - b->buffer;
+  }
+  return n;
+}
+
+static size_t read_fixed_batch(ac_in_buffer_t *b, ac_buffer_t *bh,
+                               ac_io_record_t *records, size_t max,
+                               uint32_t length) {
+  size_t n = (b->used - b->pos) / length;
+  if (n > max)
+    n = max;
+  if (!n)
+    return 0;
+  char *p = b->buffer + b->pos;
+  char *d = (char *)ac_buffer_resize(bh, n * (length + 1));
+  for (size_t i = 0; i < n; i++) {
+    memcpy(d, p, length);
+    d[length] = 0;
+    records[i].record = d;
+    records[i].length = length;
+    d += length + 1;
+    p += length;
+  }
+  b->pos = p - b->buffer;
+  return n;
+}
+
+size_t ac_in_buffer_read_batch(ac_in_buffer_t *b, ac_in_batch_t *z,
+                               ac_buffer_t *bh, ac_io_record_t *records,
+                               size_t max, int format) {
+  if (format < 0)
+    return read_delimited_batch(b, z, records, max, (-format) - 1);
+  else if (format > 0)
+    return read_fixed_batch(b, bh, records, max, format);
+  return read_prefix_batch(b, z, records, max);
+}
+
+void ac_in_batch_restore(ac_in_batch_t *z) {
+  ac_in_zero_t *zp = z->zeros;
+  ac_in_zero_t *ep = zp + z->num_zeros;
+  while (zp < ep) {
+    *(zp->p) = zp->c;
+    zp++;
+  }
+  z->num_zeros = 0;
+}
+
+void ac_in_batch_destroy(ac_in_batch_t *z) {
+  if (z->zeros)
+    ac_free(z->zeros);
+  z->zeros = NULL;
+  z->num_zeros = z->size = 0;
+}
+
+/*
+  ac_in_readahead_t is a ring of num_blocks blocks.  The helper thread fills
+  the block at fill % num_blocks while the consumer copies out of (or swaps
+  out) the block at read % num_blocks, so the read() (or decompression) of the
+  next blocks overlaps with the consumer's work on the current one.  Each
+  block has reserve bytes in front of it for the tail of the previous block,
+  and there is one more block than the ring holds (spare), which is the block
+  the consumer swapped out last.
+*/
+typedef struct {
+  char *data;
+  size_t used;
+  size_t pos;
+} readahead_block_t;
+
+struct ac_in_readahead_s {
+  ac_in_readahead_f fill_block;
+  void *arg;
+  readahead_block_t *blocks;
+  size_t num_blocks;
+  size_t block_size;
+  size_t reserve;
+  char *spare;
+
+  /* sequence numbers of the next block to fill and to read */
+  size_t fill;
+  size_t read;
+  bool eof;
+  bool finished;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+static void *readahead_thread(void *arg) {
+  ac_in_readahead_t *h = (ac_in_readahead_t *)arg;
+  pthread_mutex_lock(&h->mutex);
+  while (true) {
+    while (h->fill - h->read >= h->num_blocks && !h->finished)
+      pthread_cond_wait(&h->cond, &h->mutex);
+    if (h->finished)
+      break;
+    readahead_block_t *b = h->blocks + (h->fill % h->num_blocks);
+    pthread_mutex_unlock(&h->mutex);
+    int n = h->fill_block(h->arg, b->data, h->block_size);
+    pthread_mutex_lock(&h->mutex);
+    if (n <= 0) {
+      h->eof = true;
+      pthread_cond_broadcast(&h->cond);
+      break;
+    }
+    b->used = n;
+    b->pos = 0;
+    h->fill++;
+    pthread_cond_broadcast(&h->cond);
+  }
+  pthread_mutex_unlock(&h->mutex);
+  return NULL;
+}
+
+ac_in_readahead_t *ac_in_readahead_init(size_t num_blocks, size_t block_size,
+                                        ac_in_readahead_f fill, void *arg) {
+  if (num_blocks < 1)
+    num_blocks = 1;
+  /* the tail of a block is copied in front of the next when they are swapped,
+     and a block has a spare byte at the end for a zero terminator */
+  size_t reserve = block_size / 8;
+  size_t stride = reserve + block_size + 1;
+  ac_in_readahead_t *h = (ac_in_readahead_t *)ac_io_buffer_alloc(
+      sizeof(ac_in_readahead_t) + (sizeof(readahead_block_t) * num_blocks) +
+      (stride * (num_blocks + 1)));
+  memset(h, 0,
+         sizeof(ac_in_readahead_t) + (sizeof(readahead_block_t) * num_blocks));
+  h->fill_block = fill;
+  h->arg = arg;
+  h->blocks = (readahead_block_t *)(h + 1);
+  char *p = (char *)(h->blocks + num_blocks) + reserve;
+  for (size_t i = 0; i < num_blocks; i++) {
+    h->blocks[i].data = p;
+    p += stride;
+  }
+  h->spare = p;
+  h->num_blocks = num_blocks;
+  h->block_size = block_size;
+  h->reserve = reserve;
+  pthread_mutex_init(&h->mutex, NULL);
+  pthread_cond_init(&h->cond, NULL);
+  pthread_create(&h->thread, NULL, readahead_thread, h);
+  return h;
+}
+
+size_t ac_in_readahead_read(ac_in_readahead_t *h, char *dest, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    pthread_mutex_lock(&h->mutex);
+    while (h->read == h->fill && !h->eof)
+      pthread_cond_wait(&h->cond, &h->mutex);
+    bool empty = (h->read == h->fill);
+    pthread_mutex_unlock(&h->mutex);
+    if (empty)
+      break;
+
+    /* only the consumer touches the block until read is advanced */
+    readahead_block_t *b = h->blocks + (h->read % h->num_blocks);
+    size_t length = b->used - b->pos;
+    if (length > len - n)
+      length = len - n;
+    memcpy(dest + n, b->data + b->pos, length);
+    b->pos += length;
+    n += length;
+    if (b->pos == b->used) {
+      pthread_mutex_lock(&h->mutex);
+      h->read++;
+      pthread_cond_broadcast(&h->cond);
+      pthread_mutex_unlock(&h->mutex);
+    }
+  }
+  return n;
+}
+
+char *ac_in_readahead_swap(ac_in_readahead_t *h, const char *tail,
+                           size_t tail_len, size_t *used) {
+  pthread_mutex_lock(&h->mutex);
+  while (h->read == h->fill && !h->eof)
+    pthread_cond_wait(&h->cond, &h->mutex);
+  bool empty = (h->read == h->fill);
+  pthread_mutex_unlock(&h->mutex);
+
+  /* a block which was partially copied out is finished by copying */
+  readahead_block_t *b = h->blocks + (h->read % h->num_blocks);
+  if (empty || b->pos || tail_len > h->reserve)
+    return NULL;
+
+  char *p = b->data - tail_len;
+  if (tail_len)
+    memcpy(p, tail, tail_len);
+  *used = tail_len + b->used;
+
+  /* the previously swapped out block (which held the tail) is refilled */
+  b->data = h->spare;
+  h->spare = p + tail_len;
+  pthread_mutex_lock(&h->mutex);
+  h->read++;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+  return p;
+}
+
+void ac_in_readahead_destroy(ac_in_readahead_t *h) {
+  pthread_mutex_lock(&h->mutex);
+  h->finished = true;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+  pthread_join(h->thread, NULL);
+  pthread_mutex_destroy(&h->mutex);
+  pthread_cond_destroy(&h->cond);
+  ac_io_buffer_free(h);
+}
+
+static int read_block(void *arg, char *buffer, size_t size) {
+  ac_in_base_t *h = (ac_in_base_t *)arg;
+  if (h->range)
+    return gz_range_read(h->range, buffer, size);
+  if (h->fd != -1)
+    return read(h->fd, buffer, size);
+  return gzread(h->gz, buffer, size);
+}
+
+void ac_in_base_readahead(ac_in_base_t *h, size_t num_blocks) {
+  if (!num_blocks || h->readahead || h->uring || h->map || h->buf.eof ||
+      (h->fd == -1 && !h->gz && !h->range))
+    return;
+  h->readahead =
+      ac_in_readahead_init(num_blocks, h->buffer_size, read_block, h);
+}
+
+/*
+  uring_reader_t keeps reads of the next num_blocks blocks of the file queued
+  on an io_uring.  The reads are at explicit offsets (starting from the
+  file's position when it is created), so they may complete in any order,
+  and the blocks are copied into the input buffer in order as it is consumed.
+  Reads stop at the end of the file as of when the reader is created.
+*/
+typedef struct {
+  char *data;
+  size_t used;
+  size_t pos;
+  uint64_t offset;
+  bool pending;
+} uring_block_t;
+
+struct uring_reader_s {
+  ac_io_uring_t *ring;
+  int fd;
+  uring_block_t *blocks;
+  size_t num_blocks;
+  size_t block_size;
+  uint64_t offset;
+  uint64_t size;
+  bool error;
+
+  /* sequence numbers of the next block to queue and to read */
+  size_t fill;
+  size_t read;
+};
+
+static void uring_reader_queue(uring_reader_t *r) {
+  while (r->fill - r->read < r->num_blocks && r->offset < r->size) {
+    uring_block_t *b = r->blocks + (r->fill % r->num_blocks);
+    size_t length = r->block_size;
+    if (length > r->size - r->offset)
+      length = r->size - r->offset;
+    if (!ac_io_uring_read(r->ring, r->fd, b->data, length, r->offset, b))
+      break;
+    b->used = length;
+    b->pos = 0;
+    b->offset = r->offset;
+    b->pending = true;
+    r->offset += length;
+    r->fill++;
+  }
+  ac_io_uring_submit(r->ring);
+}
+
+/* A short read is finished with pread.  If the block still isn't full (the
+   file shrank) or the read failed, no more blocks are queued, so the input
+   ends after the blocks which are already queued. */
+static void uring_reader_complete(uring_reader_t *r, uring_block_t *b,
+                                  int res) {
+  b->pending = false;
+  size_t done = res > 0 ? res : 0;
+  while (res >= 0 && done < b->used) {
+    ssize_t n = pread(r->fd, b->data + done, b->used - done, b->offset + done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  if (done < b->used)
+    r->error = true;
+  b->used = done;
+}
+
+static size_t uring_reader_read(uring_reader_t *r, char *dest, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    if (r->read == r->fill) {
+      if (!r->error)
+        uring_reader_queue(r);
+      if (r->read == r->fill)
+        break;
+    }
+    uring_block_t *b = r->blocks + (r->read % r->num_blocks);
+    while (b->pending) {
+      int res;
+      uring_block_t *done = (uring_block_t *)ac_io_uring_wait(r->ring, &res);
+      uring_reader_complete(r, done, res);
+    }
+    size_t length = b->used - b->pos;
+    if (length > len - n)
+      length = len - n;
+    memcpy(dest + n, b->data + b->pos, length);
+    b->pos += length;
+    n += length;
+    if (b->pos == b->used) {
+      r->read++;
+      if (!r->error)
+        uring_reader_queue(r);
+    }
+  }
+  return n;
+}
+
+static void uring_reader_destroy(uring_reader_t *r) {
+  int res;
+  while (ac_io_uring_pending(r->ring))
+    ac_io_uring_wait(r->ring, &res);
+  ac_io_uring_destroy(r->ring);
+  ac_io_buffer_free(r);
+}
+
+void ac_in_base_io_uring(ac_in_base_t *h, size_t num_blocks) {
+  if (!num_blocks || h->readahead || h->uring || h->map || h->buf.eof ||
+      h->fd == -1 || h->gz || h->range || h->buf.size > 0x40000000)
+    return;
+  struct stat sb;
+  if (fstat(h->fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+    return;
+  off_t offset = lseek(h->fd, 0, SEEK_CUR);
+  if (offset == -1)
+    return;
+  ac_io_uring_t *ring = ac_io_uring_init(num_blocks);
+  if (!ring)
+    return;
+
+  size_t block_size = h->buf.size;
+  uring_reader_t *r = (uring_reader_t *)ac_io_buffer_alloc(
+      sizeof(uring_reader_t) + (sizeof(uring_block_t) * num_blocks) +
+      (block_size * num_blocks));
+  memset(r, 0, sizeof(uring_reader_t) + (sizeof(uring_block_t) * num_blocks));
+  r->ring = ring;
+  r->fd = h->fd;
+  r->blocks = (uring_block_t *)(r + 1);
+  char *p = (char *)(r->blocks + num_blocks);
+  for (size_t i = 0; i < num_blocks; i++) {
+    r->blocks[i].data = p;
+    p += block_size;
+  }
+  r->num_blocks = num_blocks;
+  r->block_size = block_size;
+  r->offset = offset;
+  r->size = sb.st_size;
+  h->uring = r;
+  uring_reader_queue(r);
+}
+
+/*
+  A gzip index (zran style) is a sidecar file (the gzip filename followed by
+  .idx) of inflate checkpoints.  A checkpoint is taken at the first deflate
+  block boundary after every span bytes of output.  Each checkpoint records
+  the uncompressed offset, the compressed offset (and the bits of the
+  previous byte which belong to the block), and the 32KB of output before it
+  (the window which the following blocks may refer to).  Inflating can start
+  at any checkpoint by priming a raw inflate with the bits and the window.
+
+  The file is a gz_index_header_t, the points, and then the windows (each
+  GZ_WINDOW_SIZE bytes).
+*/
+static const size_t GZ_WINDOW_SIZE = 32768;
+static const size_t GZ_CHUNK_SIZE = 65536;
+static const char GZ_INDEX_MAGIC[8] = {'a', 'c', 'g', 'z', 'i', 'd', 'x', '1'};
+
+typedef struct {
+  char magic[8];
+  uint64_t span;
+  uint64_t uncompressed_size;
+  uint64_t num_points;
+} gz_index_header_t;
+
+typedef struct {
+  uint64_t out;
+  uint64_t in;
+  uint32_t bits;
+  uint32_t window_length;
+} gz_point_t;
+
+struct gz_range_s {
+  int fd;
+  z_stream strm;
+  /* the current member is being inflated as raw deflate data */
+  bool raw;
+  /* bytes of a gzip trailer to skip before the next member */
+  uint32_t trailer;
+  bool done;
+  /* uncompressed bytes to discard before the range starts */
+  uint64_t skip;
+  unsigned char in[];
+};
+
+static char *gz_index_filename(const char *filename) {
+  char *r = (char *)ac_malloc(strlen(filename) + 5);
+  strcpy(r, filename);
+  strcat(r, ".idx");
+  return r;
+}
+
+bool ac_in_base_gz_index(const char *filename, size_t span) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 47) != Z_OK) {
+    close(fd);
+    return false;
+  }
+
+  ac_buffer_t *points = ac_buffer_init(sizeof(gz_point_t) * 64);
+  ac_buffer_t *windows = ac_buffer_init(GZ_WINDOW_SIZE * 4);
+  unsigned char *in = (unsigned char *)ac_malloc(GZ_CHUNK_SIZE);
+  unsigned char *window = (unsigned char *)ac_malloc(GZ_WINDOW_SIZE * 2);
+  uint64_t totin = 0, totout = 0, last = 0;
+  bool ok = true;
+  int ret = Z_OK;
+  while (ok) {
+    if (!strm.avail_in) {
+      ssize_t n = read(fd, in, GZ_CHUNK_SIZE);
+      if (n <= 0) {
+        /* the input must end at the end of a member */
+        ok = (n == 0 && ret == Z_STREAM_END);
+        break;
+      }
+      strm.next_in = in;
+      strm.avail_in = n;
+    }
+    if (ret == Z_STREAM_END) {
+      /* another member follows */
+      inflateReset(&strm);
+    }
+    size_t have = totout % GZ_WINDOW_SIZE;
+    strm.next_out = window + have;
+    strm.avail_out = GZ_WINDOW_SIZE - have;
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    ret = inflate(&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      ok = false;
+      break;
+    }
+    /* at the end of a block (which isn't the last block of the member) */
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        (totout == 0 || totout - last >= span)) {
+      gz_point_t p;
+      p.out = totout;
+      p.in = totin;
+      p.bits = strm.data_type & 7;
+      p.window_length =
+          totout < GZ_WINDOW_SIZE ? totout : (uint32_t)GZ_WINDOW_SIZE;
+      ac_buffer_append(points, &p, sizeof(p));
+      /* unwrap the circular window (the newest byte is at totout - 1) */
+      size_t pos = totout % GZ_WINDOW_SIZE;
+      char *wp = (char *)ac_buffer_append_ualloc(windows, GZ_WINDOW_SIZE);
+      memcpy(wp, window + pos, GZ_WINDOW_SIZE - pos);
+      memcpy(wp + GZ_WINDOW_SIZE - pos, window, pos);
+      if (p.window_length < GZ_WINDOW_SIZE)
+        memmove(wp, wp + GZ_WINDOW_SIZE - pos, pos);
+      last = totout;
+    }
+  }
+  inflateEnd(&strm);
+  close(fd);
+  ac_free(in);
+  ac_free(window);
+
+  if (ok) {
+    gz_index_header_t header;
+    memcpy(header.magic, GZ_INDEX_MAGIC, sizeof(header.magic));
+    header.span = span;
+    header.uncompressed_size = totout;
+    header.num_points = ac_buffer_length(points) / sizeof(gz_point_t);
+    char *index_filename = gz_index_filename(filename);
+    FILE *out = fopen(index_filename, "wb");
+    ac_free(index_filename);
+    if (!out)
+      ok = false;
+    else {
+      ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+           fwrite(ac_buffer_data(points), ac_buffer_length(points), 1, out) ==
+               1 &&
+           fwrite(ac_buffer_data(windows), ac_buffer_length(windows), 1,
+                  out) == 1;
+      if (fclose(out))
+        ok = false;
+    }
+  }
+  ac_buffer_destroy(points);
+  ac_buffer_destroy(windows);
+  return ok;
+}
+
+/* reads the last point at or before start (and its window) from the index */
+static bool read_gz_point(int fd, uint64_t start, gz_point_t *point,
+                          unsigned char *window) {
+  gz_index_header_t header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, GZ_INDEX_MAGIC, sizeof(header.magic)) ||
+      !header.num_points || start > header.uncompressed_size)
+    return false;
+
+  size_t points_length = sizeof(gz_point_t) * header.num_points;
+  gz_point_t *points = (gz_point_t *)ac_malloc(points_length);
+  bool ok = read(fd, points, points_length) == (ssize_t)points_length;
+  size_t lo = 0, hi = header.num_points;
+  while (hi - lo > 1) {
+    size_t mid = lo + ((hi - lo) >> 1);
+    if (points[mid].out <= start)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  *point = points[lo];
+  ac_free(points);
+  if (!ok || point->out > start)
+    return false;
+
+  off_t offset = sizeof(header) + points_length + (GZ_WINDOW_SIZE * lo);
+  return pread(fd, window, GZ_WINDOW_SIZE, offset) == (ssize_t)GZ_WINDOW_SIZE;
+}
+
+/* start inflating at the last checkpoint at or before start, NULL if there
+   isn't a usable index */
+static gz_range_t *gz_range_init(const char *filename, uint64_t start) {
+  char *index_filename = gz_index_filename(filename);
+  int fd = open(index_filename, O_RDONLY);
+  ac_free(index_filename);
+  if (fd == -1)
+    return NULL;
+
+  gz_point_t p;
+  unsigned char *window = (unsigned char *)ac_malloc(GZ_WINDOW_SIZE);
+  bool ok = read_gz_point(fd, start, &p, window);
+  close(fd);
+
+  gz_range_t *r = NULL;
+  if (ok) {
+    r = (gz_range_t *)ac_malloc(sizeof(gz_range_t) + GZ_CHUNK_SIZE);
+    memset(r, 0, sizeof(*r));
+    r->raw = true;
+    r->skip = start - p.out;
+    r->fd = open(filename, O_RDONLY);
+    if (r->fd == -1 || inflateInit2(&(r->strm), -15) != Z_OK) {
+      if (r->fd != -1)
+        close(r->fd);
+      ac_free(r);
+      r = NULL;
+    }
+  }
+  if (r) {
+    ok = lseek(r->fd, p.in - (p.bits ? 1 : 0), SEEK_SET) != -1;
+    if (ok && p.bits) {
+      unsigned char c;
+      ok = read(r->fd, &c, 1) == 1 &&
+           inflatePrime(&(r->strm), p.bits, c >> (8 - p.bits)) == Z_OK;
+    }
+    if (ok && p.window_length)
+      ok = inflateSetDictionary(&(r->strm), window, p.window_length) == Z_OK;
+    if (!ok) {
+      gz_range_destroy(r);
+      r = NULL;
+    }
+  }
+  ac_free(window);
+  return r;
+}
+
+static int gz_range_read(gz_range_t *r, char *buffer, size_t len) {
+  size_t n = 0;
+  while (n < len && !r->done) {
+    z_stream *s = &(r->strm);
+    if (!s->avail_in) {
+      ssize_t k = read(r->fd, r->in, GZ_CHUNK_SIZE);
+      if (k <= 0) {
+        r->done = true;
+        break;
+      }
+      s->next_in = r->in;
+      s->avail_in = k;
+    }
+    if (r->trailer) {
+      uint32_t k = r->trailer < s->avail_in ? r->trailer : s->avail_in;
+      s->next_in += k;
+      s->avail_in -= k;
+      r->trailer -= k;
+      continue;
+    }
+    s->next_out = (Bytef *)buffer + n;
+    s->avail_out = len - n;
+    int ret = inflate(s, Z_NO_FLUSH);
+    size_t produced = (len - n) - s->avail_out;
+    if (r->skip) {
+      size_t k = r->skip < produced ? r->skip : produced;
+      memmove(buffer + n, buffer + n + k, produced - k);
+      produced -= k;
+      r->skip -= k;
+    }
+    n += produced;
+    if (ret == Z_STREAM_END) {
+      /* a raw member is followed by its 8 byte trailer, another member (with
+         a gzip header) may follow */
+      if (r->raw)
+        r->trailer = 8;
+      r->raw = false;
+      inflateReset2(s, 47);
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR)
+      r->done = true;
+  }
+  return n;
+}
+
+static void gz_range_destroy(gz_range_t *r) {
+  inflateEnd(&(r->strm));
+  close(r->fd);
+  ac_free(r);
+}
+
+void ac_in_base_range(ac_in_base_t *h, uint64_t start, uint64_t end) {
+  if (h->map || h->readahead || h->uring || (end && end <= start))
+    return;
+
+  ac_in_buffer_t *b = &(h->buf);
+  if (h->fd == -1 && !h->gz) {
+    /* the input is a buffer */
+    if (end && end < b->used)
+      b->used = end;
+    b->pos = start < b->used ? start : b->used;
+    ac_in_buffer_clear_delimiters(b);
+    return;
+  }
+
+  b->pos = b->used = 0;
+  b->size = h->buffer_size;
+  b->eof = false;
+  ac_in_buffer_clear_delimiters(b);
+  if (h->gz) {
+    if (h->filename)
+      h->range = gz_range_init(h->filename, start);
+    if (h->range) {
+      gzclose(h->gz);
+      h->gz = NULL;
+    } else if (gzseek(h->gz, start, SEEK_SET) == -1)
+      b->eof = true;
+  } else if (lseek(h->fd, start, SEEK_SET) == -1)
+    b->eof = true;
+
+  h->limited = end != 0;
+  h->remaining = end - start;
+  fill_blocks(h, b);
 }
 
 const char *ac_in_base_filename(ac_in_base_t *h) { return h->filename; }
@@ -66,11 +947,12 @@ ac_in_base_t *ac_in_base_reinit(ac_in_base_t *base, size_t buffer_size) {
     return base;
 
   size_t filename_length = base->filename ? strlen(base->filename) + 1 : 0;
-  ac_in_base_t *h = (ac_in_base_t *)ac_malloc(
+  ac_in_base_t *h = (ac_in_base_t *)ac_io_buffer_alloc(
       sizeof(ac_in_base_t) + buffer_size + 1 + filename_length);
   memcpy(h, base, sizeof(*h));
   h->buf.buffer = (char *)(h + 1);
   h->buf.size = buffer_size;
+  h->buffer_size = buffer_size;
   if (filename_length) {
     h->filename = h->buf.buffer + buffer_size + 1;
     strcpy(h->filename, base->filename);
@@ -78,7 +960,7 @@ ac_in_base_t *ac_in_base_reinit(ac_in_base_t *base, size_t buffer_size) {
   if (h->buf.used)
     memcpy(h->buf.buffer, base->buf.buffer, h->buf.used);
 
-  ac_free(base);
+  ac_io_buffer_free(base);
   return h;
 }
 
@@ -98,11 +980,12 @@ ac_in_base_t *ac_in_base_init_gz(const char *filename, int fd, bool can_close,
 
   size_t filename_length = filename ? strlen(filename) + 1 : 0;
 
-  ac_in_base_t *h = (ac_in_base_t *)ac_malloc(
+  ac_in_base_t *h = (ac_in_base_t *)ac_io_buffer_alloc(
       sizeof(ac_in_base_t) + buffer_size + 1 + filename_length);
   memset(h, 0, sizeof(*h));
   h->buf.buffer = (char *)(h + 1);
   h->buf.size = buffer_size;
+  h->buffer_size = buffer_size;
   if (filename_length) {
     h->filename = h->buf.buffer + buffer_size + 1;
     strcpy(h->filename, filename);
@@ -125,11 +1008,12 @@ ac_in_base_t *ac_in_base_init(const char *filename, int fd, bool can_close,
     buffer_size = 256;
 
   size_t filename_length = filename ? strlen(filename) + 1 : 0;
-  ac_in_base_t *h = (ac_in_base_t *)ac_malloc(
+  ac_in_base_t *h = (ac_in_base_t *)ac_io_buffer_alloc(
       sizeof(ac_in_base_t) + buffer_size + 1 + filename_length);
   memset(h, 0, sizeof(*h));
   h->buf.buffer = (char *)(h + 1);
   h->buf.size = buffer_size;
+  h->buffer_size = buffer_size;
   if (filename_length) {
     h->filename = h->buf.buffer + buffer_size + 1;
     strcpy(h->filename, filename);
@@ -140,9 +1024,75 @@ ac_in_base_t *ac_in_base_init(const char *filename, int fd, bool can_close,
   return h;
 }
 
+ac_in_base_t *ac_in_base_init_mmap(const char *filename, int fd,
+                                   bool can_close) {
+  bool opened = false;
+  if (fd == -1) {
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+      return NULL;
+    opened = can_close = true;
+  }
+
+  /* the mapping starts at the current offset of fd (rounded down to a page) */
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || offset < 0 ||
+      offset >= st.st_size) {
+    if (opened)
+      close(fd);
+    return NULL;
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  off_t start = offset & ~((off_t)page_size - 1);
+  size_t length = st.st_size - start;
+
+  /* Reserve an extra zero page after the file so that a zero can always be
+     written after the last record (the mapping is private, so the zeros
+     written after records are never written to the file). */
+  size_t map_size = (length + page_size) & ~(page_size - 1);
+  char *map = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    if (opened)
+      close(fd);
+    return NULL;
+  }
+  if (mmap(map, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           start) == MAP_FAILED) {
+    munmap(map, map_size);
+    if (opened)
+      close(fd);
+    return NULL;
+  }
+  madvise(map, length, MADV_SEQUENTIAL);
+  if (can_close)
+    close(fd);
+
+  size_t filename_length = filename ? strlen(filename) + 1 : 0;
+  ac_in_base_t *h = (ac_in_base_t *)ac_io_buffer_alloc(sizeof(ac_in_base_t) +
+                                                       filename_length);
+  memset(h, 0, sizeof(*h));
+  if (filename_length) {
+    h->filename = (char *)(h + 1);
+    strcpy(h->filename, filename);
+  }
+  h->fd = -1;
+  h->map = map;
+  h->map_size = map_size;
+  h->buf.buffer = map;
+  h->buf.size = length;
+  h->buf.used = length;
+  h->buf.pos = offset - start;
+  h->buf.eof = true;
+  return h;
+}
+
 ac_in_base_t *ac_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free) {
-  ac_in_base_t *h = (ac_in_base_t *)ac_calloc(sizeof(ac_in_base_t));
+  ac_in_base_t *h =
+      (ac_in_base_t *)ac_io_buffer_alloc(sizeof(ac_in_base_t));
+  memset(h, 0, sizeof(*h));
   h->fd = -1;
   h->buf.buffer = buffer;
   h->buf.size = buffer_size;
@@ -168,6 +1118,7 @@ static inline char *end_of_block(ac_in_base_t *h, int32_t *rlen, char *p,
 char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
                                 bool required) {
   cleanup_last_read(h);
+  release_consumed(h);
 
   *rlen = 0;
 
@@ -177,21 +1128,19 @@ char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
   char *sp = p;
   // 2. search for delimiter between pos/used
   char *ep = b->buffer + b->used;
-  while (p < ep) {
-    if (*p != delim)
-      p++;
-    else {
-      *rlen = (p - sp);
-      b->pos += (*rlen) + 1;
-      if (b->pos > b->used)
-        abort();
+  p = ac_in_buffer_find_delimiter(b, delim);
+  if (p) {
+    *rlen = (p - sp);
+    b->pos += (*rlen) + 1;
+    if (b->pos > b->used)
+      abort();
 
-      h->zerop = p;
-      h->zero = *p;
-      *p = 0;
-      return sp;
-    }
+    h->zerop = p;
+    h->zero = *p;
+    *p = 0;
+    return sp;
   }
+  p = ep;
 
   // 3. if finished, there is no more data to read, return what is present
   if (b->eof) {
@@ -203,25 +1152,20 @@ char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
   //    block.  If pos was zero, nothing to do here
   if (b->pos > 0) {
     reset_block(b);
-    sp = b->buffer;
-    p = sp + b->used;
-    // b->pos = b->used;
     fill_blocks(h, b);
-    char *ep = sp + b->used;
-    while (p < ep) {
-      if (*p != delim)
-        p++;
-      else {
-        *rlen = (p - sp);
-        b->pos += (*rlen) + 1;
-        if (b->pos > b->used)
-          abort();
-        h->zerop = p;
-        h->zero = *p;
-        *p = 0;
-        return sp;
-      }
+    sp = b->buffer;
+    p = ac_in_buffer_find_delimiter(b, delim);
+    if (p) {
+      *rlen = (p - sp);
+      b->pos += (*rlen) + 1;
+      if (b->pos > b->used)
+        abort();
+      h->zerop = p;
+      h->zero = *p;
+      *p = 0;
+      return sp;
     }
+    p = sp + b->used;
     if (b->eof) {
       b->pos = b->used;
       return end_of_block(h, rlen, sp, p, required);
@@ -236,6 +1180,7 @@ char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
     ac_buffer_append(h->bh, b->buffer, b->used);
     b->used = 0;
     b->pos = 0;
+    ac_in_buffer_clear_delimiters(b);
     fill_blocks(h, b);
     p = b->buffer;
     sp = p;
@@ -272,6 +1217,7 @@ char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
 
 char *ac_in_base_readz(ac_in_base_t *h, int32_t *rlen, int32_t len) {
   cleanup_last_read(h);
+  release_consumed(h);
 
   ac_in_buffer_t *b = &(h->buf);
 
@@ -288,7 +1234,9 @@ char *ac_in_base_readz(ac_in_base_t *h, int32_t *rlen, int32_t len) {
     h->zerop = ep;
     *ep = 0;
     return p;
-  } else if (len > b->size) {
+  } else if (len > b->size || (h->readahead && len > h->buffer_size)) {
+    /* (a block swapped in from the readahead can leave the buffer larger
+       than buffer_size, but the next block may not) */
     if (b->eof) {
       *rlen = b->used - b->pos;
       b->pos = b->used;
@@ -352,6 +1300,9 @@ char *ac_in_base_read(ac_in_base_t *h, int32_t len) {
     (*h->zerop) = h->zero;
     h->zerop = NULL;
   }
+  if (h->batch.num_zeros)
+    ac_in_batch_restore(&h->batch);
+  release_consumed(h);
 
   char *p = b->buffer + b->pos;
   if (b->pos + len <= b->used) {
@@ -375,15 +1326,35 @@ char *ac_in_base_read(ac_in_base_t *h, int32_t len) {
   }
 }
 
+size_t ac_in_base_read_batch(ac_in_base_t *h, ac_buffer_t *bh,
+                             ac_io_record_t *records, size_t max, int format) {
+  cleanup_last_read(h);
+  release_consumed(h);
+  size_t n = ac_in_buffer_read_batch(&h->buf, &h->batch, bh, records, max,
+                                     format);
+  h->num_reads += n;
+  return n;
+}
+
 void ac_in_base_destroy(ac_in_base_t *h) {
+  ac_in_batch_destroy(&h->batch);
+  if (h->readahead)
+    ac_in_readahead_destroy(h->readahead);
+  if (h->uring)
+    uring_reader_destroy(h->uring);
+  if (h->range)
+    gz_range_destroy(h->range);
   if (h->bh)
     ac_buffer_destroy(h->bh);
   if (h->buf.can_free)
     ac_free(h->buf.buffer);
+  ac_in_buffer_destroy_delimiters(&h->buf);
+  if (h->map)
+    munmap(h->map, h->map_size);
   if (h->fd != -1 && h->can_close)
     close(h->fd);
   // TODO: Support can_close properly for gz files
   if (h->gz)
     gzclose(h->gz);
-  ac_free(h);
+  ac_io_buffer_free(h);
 }
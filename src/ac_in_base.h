@@ -1,7 +1,9 @@
 #ifndef _ac_in_base_H
 #define _ac_in_base_H
 
+#include "ac_buffer.h"
 #include "ac_common.h"
+#include "ac_io.h"
 
 #include <inttypes.h>
 #include <sys/types.h>
@@ -19,15 +21,91 @@ ac_in_base_t *ac_in_base_init_gz(const char *filename, int fd, bool can_close,
                                  size_t buffer_size);
 ac_in_base_t *ac_in_base_init(const char *filename, int fd, bool can_close,
                               size_t buffer_size);
+/* Map the file (from the current offset of fd if fd is not -1) instead of
+   reading it into a buffer.  NULL is returned if it can't be mapped (not a
+   regular file, empty, or mmap fails), in which case fd is left open. */
+ac_in_base_t *ac_in_base_init_mmap(const char *filename, int fd,
+                                   bool can_close);
 ac_in_base_t *ac_in_base_init_from_buffer(char *buffer, size_t buffer_size,
                                           bool can_free);
 ac_in_base_t *ac_in_base_reinit(ac_in_base_t *base, size_t buffer_size);
 
+/* Fill the buffer on a helper thread, keeping up to num_blocks blocks (each
+   the size of the buffer) read ahead of the consumer.  This does nothing if
+   the input is mapped or is a buffer. */
+void ac_in_base_readahead(ac_in_base_t *h, size_t num_blocks);
+
+/* Keep reads of the next num_blocks blocks (each the size of the buffer)
+   queued on an io_uring instead of calling read() as the buffer empties.
+   This only applies to regular files which aren't compressed with gzip (lz4
+   is read through the base, so it applies to lz4), and does nothing if
+   io_uring isn't available or the input is mapped, a buffer, or already
+   reading ahead. */
+void ac_in_base_io_uring(ac_in_base_t *h, size_t num_blocks);
+
+/* ac_in_readahead_t calls fill on a helper thread to fill a ring of
+   num_blocks blocks (each block_size bytes) ahead of the consumer.  fill
+   returns the number of bytes placed in the buffer or <= 0 at the end of the
+   input.  ac_in_readahead_read copies up to len bytes into dest and only
+   returns less than len at the end of the input.  ac_in_readahead_swap
+   instead returns the next block itself with the tail_len bytes at tail
+   copied in front of it (used is set to the bytes in the result, which has
+   room for tail_len + block_size bytes and a zero).  The block returned by
+   the previous swap is given back to the ring, so tail may point into it.
+   NULL is returned (and nothing is consumed) at the end of the input, if
+   the next block was partially read, or if tail_len is more than an eighth
+   of the block_size, in which case the input should be copied instead. */
+typedef int (*ac_in_readahead_f)(void *arg, char *buffer, size_t size);
+
+ac_in_readahead_t *ac_in_readahead_init(size_t num_blocks, size_t block_size,
+                                        ac_in_readahead_f fill, void *arg);
+size_t ac_in_readahead_read(ac_in_readahead_t *h, char *dest, size_t len);
+char *ac_in_readahead_swap(ac_in_readahead_t *h, const char *tail,
+                           size_t tail_len, size_t *used);
+void ac_in_readahead_destroy(ac_in_readahead_t *h);
+
+/* Only read the bytes in [start, end) of the (uncompressed) input.  If end is
+   0, read to the end.  This must be called before anything is read (and
+   before ac_in_base_readahead or ac_in_base_io_uring).  A gzip file is
+   inflated from the nearest checkpoint in its index (see ac_in_base_gz_index)
+   if there is one, otherwise it is inflated from the beginning. */
+void ac_in_base_range(ac_in_base_t *h, uint64_t start, uint64_t end);
+
+/* Write an index of inflate checkpoints (taken about every span bytes of
+   uncompressed output) for the gzip file to filename followed by .idx */
+bool ac_in_base_gz_index(const char *filename, size_t span);
+
 const char *ac_in_base_filename(ac_in_base_t *h);
 
 char *ac_in_base_read_delimited(ac_in_base_t *h, int32_t *rlen, char delim,
                                 bool required);
 
+/* Return the first delim at or after b->pos (before b->used) or NULL.  The
+   delimiters are indexed a block at a time (see ac_io_index_delimiters), so
+   most calls only take the next offset from the index.  The index must be
+   cleared whenever the data in the buffer is moved or replaced. */
+char *ac_in_buffer_find_delimiter(ac_in_buffer_t *b, char delim);
+void ac_in_buffer_clear_delimiters(ac_in_buffer_t *b);
+void ac_in_buffer_destroy_delimiters(ac_in_buffer_t *b);
+
+/* Parse up to max records which are complete in [b->pos, b->used) into records
+   without filling the buffer (0 is returned if the next record isn't there).
+   format is the same as ac_io_format_t.  Prefix and delimited records are left
+   in place and the byte after each is saved in z and replaced with a zero
+   (ac_in_batch_restore must be called before the buffer is read again).  Fixed
+   length records are copied into bh, since each zero would overwrite the start
+   of the following record. */
+size_t ac_in_buffer_read_batch(ac_in_buffer_t *b, ac_in_batch_t *z,
+                               ac_buffer_t *bh, ac_io_record_t *records,
+                               size_t max, int format);
+void ac_in_batch_restore(ac_in_batch_t *z);
+void ac_in_batch_destroy(ac_in_batch_t *z);
+
+/* ac_in_buffer_read_batch for the base input.  The records are valid until the
+   next read from h. */
+size_t ac_in_base_read_batch(ac_in_base_t *h, ac_buffer_t *bh,
+                             ac_io_record_t *records, size_t max, int format);
+
 /*
   returns NULL if len bytes not available
 */
@@ -22,6 +22,7 @@ limitations under the License.
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,14 +32,373 @@ limitations under the License.
 
 #include "lz4/xxhash.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define AC_IO_X86_SIMD
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define AC_IO_URING
+#endif
+#endif
+
 ac_sort_compare_arg_m(ac_io_sort_records, ac_io_record_t);
 
+typedef struct {
+  ac_io_compare_f compare;
+  void *arg;
+} prefix_compare_t;
+
+static inline int compare_prefix_records(const ac_io_prefix_record_t *a,
+                                         const ac_io_prefix_record_t *b,
+                                         void *arg) {
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  prefix_compare_t *pc = (prefix_compare_t *)arg;
+  return pc->compare(&(a->r), &(b->r), pc->arg);
+}
+
+static ac_sort_arg_m(_sort_prefix_records, ac_io_prefix_record_t,
+                     compare_prefix_records);
+
+void ac_io_sort_prefix_records(ac_io_prefix_record_t *base, size_t num_records,
+                               ac_io_compare_f compare, void *arg) {
+  prefix_compare_t pc;
+  pc.compare = compare;
+  pc.arg = arg;
+  _sort_prefix_records(base, num_records, &pc);
+}
+
+/* Merge the sorted runs base[0, n1) and base[n1, n) by copying the smaller
+   run to tmp.  Equal records keep their order. */
+static void merge_two_runs(ac_io_record_t *base, size_t n1, size_t n,
+                           ac_io_record_t *tmp, ac_io_compare_f compare,
+                           void *arg) {
+  ac_io_record_t *a = base, *b = base + n1, *end = base + n;
+  size_t n2 = n - n1;
+  if (compare(b - 1, b, arg) <= 0)
+    return;
+
+  if (n1 <= n2) {
+    memcpy(tmp, a, n1 * sizeof(ac_io_record_t));
+    ac_io_record_t *t = tmp, *te = tmp + n1, *d = a;
+    while (t < te && b < end) {
+      if (compare(b, t, arg) < 0)
+        *d++ = *b++;
+      else
+        *d++ = *t++;
+    }
+    while (t < te)
+      *d++ = *t++;
+  } else {
+    memcpy(tmp, b, n2 * sizeof(ac_io_record_t));
+    ac_io_record_t *t = tmp + n2, *ae = b, *d = end;
+    while (t > tmp && ae > a) {
+      if (compare(t - 1, ae - 1, arg) < 0)
+        *--d = *--ae;
+      else
+        *--d = *--t;
+    }
+    while (t > tmp)
+      *--d = *--t;
+  }
+}
+
+void ac_io_sort_runs(ac_io_record_t *base, size_t num_records,
+                     ac_io_compare_f compare, void *arg) {
+  if (num_records < 2)
+    return;
+
+  size_t max_runs = num_records / AC_IO_MIN_AVERAGE_RUN + 1;
+  size_t *ends = (size_t *)ac_malloc(sizeof(size_t) * (max_runs + 1));
+  size_t num_runs = 0;
+  for (size_t i = 1; i < num_records; i++) {
+    if (compare(base + i, base + i - 1, arg) < 0) {
+      if (num_runs == max_runs) {
+        ac_free(ends);
+        ac_io_sort_records(base, num_records, compare, arg);
+        return;
+      }
+      ends[num_runs++] = i;
+    }
+  }
+  ends[num_runs++] = num_records;
+  if (num_runs == 1) {
+    ac_free(ends);
+    return;
+  }
+
+  /* merge neighboring runs until one is left */
+  ac_io_record_t *tmp = (ac_io_record_t *)ac_malloc(
+      sizeof(ac_io_record_t) * (num_records / 2 + 1));
+  while (num_runs > 1) {
+    size_t start = 0, n = 0;
+    for (size_t i = 0; i < num_runs; i += 2) {
+      if (i + 1 < num_runs) {
+        merge_two_runs(base + start, ends[i] - start, ends[i + 1] - start, tmp,
+                       compare, arg);
+        ends[n++] = ends[i + 1];
+      } else
+        ends[n++] = ends[i];
+      start = ends[n - 1];
+    }
+    num_runs = n;
+  }
+  ac_free(tmp);
+  ac_free(ends);
+}
+
 bool ac_io_keep_first(ac_io_record_t *res, const ac_io_record_t *r,
                       size_t num_r, ac_buffer_t *bh, void *tag) {
   *res = *r;
   return true;
 }
 
+/* buckets smaller than this are finished with an insertion sort */
+#define RADIX_SMALL_BUCKET 32
+
+typedef struct {
+  size_t record_size;
+  size_t key_width;
+  char *tmp;
+} radix_sort_t;
+
+/* returns the offset of the byte which is digit bytes away from the least
+   significant byte of the key */
+static inline size_t radix_byte(radix_sort_t *h, size_t digit) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return h->key_width - 1 - digit;
+#else
+  return digit;
+#endif
+}
+
+static inline void radix_swap(radix_sort_t *h, char *a, char *b) {
+  size_t size = h->record_size;
+  if (size == sizeof(uint64_t)) {
+    uint64_t tmp;
+    memcpy(&tmp, a, sizeof(tmp));
+    memcpy(a, b, sizeof(tmp));
+    memcpy(b, &tmp, sizeof(tmp));
+  } else if (size == sizeof(uint32_t)) {
+    uint32_t tmp;
+    memcpy(&tmp, a, sizeof(tmp));
+    memcpy(a, b, sizeof(tmp));
+    memcpy(b, &tmp, sizeof(tmp));
+  } else {
+    memcpy(h->tmp, a, size);
+    memcpy(a, b, size);
+    memcpy(b, h->tmp, size);
+  }
+}
+
+/* compare the keys from digit down to the least significant byte, key points
+   to the start of the key in each record */
+static inline int radix_compare(radix_sort_t *h, const unsigned char *a,
+                                const unsigned char *b, ssize_t digit) {
+  for (; digit >= 0; digit--) {
+    size_t offs = radix_byte(h, digit);
+    if (a[offs] != b[offs])
+      return a[offs] < b[offs] ? -1 : 1;
+  }
+  return 0;
+}
+
+static void radix_insertion_sort(radix_sort_t *h, char *base, size_t num,
+                                 size_t key_offset, ssize_t digit) {
+  size_t size = h->record_size;
+  char *ep = base + (num * size);
+  for (char *p = base + size; p < ep; p += size) {
+    if (radix_compare(h, (unsigned char *)p - size + key_offset,
+                      (unsigned char *)p + key_offset, digit) <= 0)
+      continue;
+    memcpy(h->tmp, p, size);
+    char *q = p - size;
+    while (q >= base &&
+           radix_compare(h, (unsigned char *)q + key_offset,
+                         (unsigned char *)h->tmp + key_offset, digit) > 0)
+      q -= size;
+    q += size;
+    memmove(q + size, q, p - q);
+    memcpy(q, h->tmp, size);
+  }
+}
+
+/* American flag sort - count the records in each bucket for the given digit,
+   permute the records into their buckets in place, and recurse into each
+   bucket with the next less significant digit. */
+static void radix_sort(radix_sort_t *h, char *base, size_t num,
+                       size_t key_offset, ssize_t digit) {
+  size_t size = h->record_size;
+  while (digit >= 0) {
+    if (num < RADIX_SMALL_BUCKET) {
+      radix_insertion_sort(h, base, num, key_offset, digit);
+      return;
+    }
+
+    size_t offs = key_offset + radix_byte(h, digit);
+    size_t counts[256];
+    memset(counts, 0, sizeof(counts));
+    char *ep = base + (num * size);
+    for (char *p = base; p < ep; p += size)
+      counts[(unsigned char)p[offs]]++;
+
+    /* if all records share this digit, move on to the next one */
+    unsigned char first = (unsigned char)base[offs];
+    if (counts[first] == num) {
+      digit--;
+      continue;
+    }
+
+    char *heads[256], *tails[256];
+    char *p = base;
+    for (size_t i = 0; i < 256; i++) {
+      heads[i] = p;
+      p += counts[i] * size;
+      tails[i] = p;
+    }
+
+    for (size_t i = 0; i < 256; i++) {
+      while (heads[i] < tails[i]) {
+        unsigned char v = (unsigned char)heads[i][offs];
+        if (v == i)
+          heads[i] += size;
+        else {
+          radix_swap(h, heads[i], heads[v]);
+          heads[v] += size;
+        }
+      }
+    }
+
+    if (digit == 0)
+      return;
+
+    p = base;
+    for (size_t i = 0; i < 256; i++) {
+      if (counts[i] > 1)
+        radix_sort(h, p, counts[i], key_offset, digit - 1);
+      p += counts[i] * size;
+    }
+    return;
+  }
+}
+
+/* The delimiter index kernels compare a block of bytes with the delimiter at a
+   time and turn the resulting bit mask into offsets.  Each stops before a
+   block which might overflow offs and the rest is searched one byte at a
+   time. */
+typedef size_t (*index_delimiters_f)(uint32_t *offs, size_t max_offs,
+                                     size_t *scanned, const char *p,
+                                     size_t len, char delim);
+
+static size_t index_delimiters_tail(uint32_t *offs, size_t num,
+                                    size_t max_offs, size_t *scanned,
+                                    const char *p, size_t i, size_t len,
+                                    char delim) {
+  for (; i < len; i++) {
+    if (p[i] == delim) {
+      if (num == max_offs)
+        break;
+      offs[num++] = i;
+    }
+  }
+  *scanned = i;
+  return num;
+}
+
+static size_t index_delimiters_scalar(uint32_t *offs, size_t max_offs,
+                                      size_t *scanned, const char *p,
+                                      size_t len, char delim) {
+  return index_delimiters_tail(offs, 0, max_offs, scanned, p, 0, len, delim);
+}
+
+#ifdef AC_IO_X86_SIMD
+#define INDEX_MASK_BITS(mask, base)                                           \
+  while (mask) {                                                              \
+    offs[num++] = (base) + __builtin_ctzll(mask);                             \
+    mask &= mask - 1;                                                         \
+  }
+
+static size_t index_delimiters_sse2(uint32_t *offs, size_t max_offs,
+                                    size_t *scanned, const char *p,
+                                    size_t len, char delim) {
+  __m128i d = _mm_set1_epi8(delim);
+  size_t num = 0, i = 0;
+  for (; i + 16 <= len && num + 16 <= max_offs; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    uint64_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, d));
+    INDEX_MASK_BITS(mask, i);
+  }
+  return index_delimiters_tail(offs, num, max_offs, scanned, p, i, len, delim);
+}
+
+__attribute__((target("avx2"))) static size_t
+index_delimiters_avx2(uint32_t *offs, size_t max_offs, size_t *scanned,
+                      const char *p, size_t len, char delim) {
+  __m256i d = _mm256_set1_epi8(delim);
+  size_t num = 0, i = 0;
+  for (; i + 32 <= len && num + 32 <= max_offs; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, d));
+    INDEX_MASK_BITS(mask, i);
+  }
+  return index_delimiters_tail(offs, num, max_offs, scanned, p, i, len, delim);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static size_t
+index_delimiters_avx512(uint32_t *offs, size_t max_offs, size_t *scanned,
+                        const char *p, size_t len, char delim) {
+  __m512i d = _mm512_set1_epi8(delim);
+  size_t num = 0, i = 0;
+  for (; i + 64 <= len && num + 64 <= max_offs; i += 64) {
+    __m512i v = _mm512_loadu_si512((const void *)(p + i));
+    uint64_t mask = _mm512_cmpeq_epi8_mask(v, d);
+    INDEX_MASK_BITS(mask, i);
+  }
+  return index_delimiters_tail(offs, num, max_offs, scanned, p, i, len, delim);
+}
+#endif
+
+static index_delimiters_f index_delimiters = NULL;
+
+size_t ac_io_index_delimiters(uint32_t *offs, size_t max_offs, size_t *scanned,
+                              const char *p, size_t len, char delim) {
+  /* picking the kernel more than once (from multiple threads) is harmless */
+  if (!index_delimiters) {
+    index_delimiters_f f = index_delimiters_scalar;
+#ifdef AC_IO_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+      f = index_delimiters_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+      f = index_delimiters_avx2;
+    else
+      f = index_delimiters_sse2;
+#endif
+    index_delimiters = f;
+  }
+  return index_delimiters(offs, max_offs, scanned, p, len, delim);
+}
+
+void ac_io_radix_sort(void *base, size_t num_records, size_t record_size,
+                      size_t key_offset, size_t key_width) {
+  if (num_records < 2 || !key_width || key_offset + key_width > record_size)
+    return;
+
+  char tmp[256];
+  radix_sort_t h;
+  h.record_size = record_size;
+  h.key_width = key_width;
+  h.tmp = record_size > sizeof(tmp) ? (char *)ac_malloc(record_size) : tmp;
+  radix_sort(&h, (char *)base, num_records, key_offset, key_width - 1);
+  if (h.tmp != tmp)
+    ac_free(h.tmp);
+}
+
 size_t ac_io_hash_partition(const ac_io_record_t *r, size_t num_part,
                             void *arg) {
   size_t offs = arg ? (*(size_t *)arg) : 0;
@@ -46,7 +406,138 @@ size_t ac_io_hash_partition(const ac_io_record_t *r, size_t num_part,
   return hash % num_part;
 }
 
+uint64_t ac_io_key_prefix_string(const ac_io_record_t *r, void *arg) {
+  size_t offs = arg ? (*(size_t *)arg) : 0;
+  if (offs >= r->length)
+    return 0;
+  size_t len = r->length - offs;
+  if (len > sizeof(uint64_t))
+    len = sizeof(uint64_t);
+  /* stop at a zero so that bytes which strcmp ignores don't matter */
+  len = strnlen(r->record + offs, len);
+  unsigned char *p = (unsigned char *)r->record + offs;
+  uint64_t res = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); i++) {
+    res <<= 8;
+    if (i < len)
+      res |= p[i];
+  }
+  return res;
+}
+
+uint64_t ac_io_hash_string(const ac_io_record_t *r, void *arg) {
+  size_t offs = arg ? (*(size_t *)arg) : 0;
+  if (offs >= r->length)
+    return 0;
+  size_t len = strnlen(r->record + offs, r->length - offs);
+  return XXH64(r->record + offs, len, 0);
+}
+
+struct ac_io_range_partition_s {
+  ac_io_compare_f compare;
+  void *arg;
+
+  ac_io_record_t *sample;
+  size_t num_sample;
+  size_t sample_size;
+  size_t num_seen;
+  uint64_t seed;
+
+  ac_io_record_t *splits;
+  size_t num_splits;
+};
+
+ac_io_range_partition_t *ac_io_range_partition_init(ac_io_compare_f compare,
+                                                    void *arg,
+                                                    size_t sample_size) {
+  if (sample_size < 1)
+    sample_size = 1;
+  ac_io_range_partition_t *h = (ac_io_range_partition_t *)ac_calloc(
+      sizeof(ac_io_range_partition_t) + (sizeof(ac_io_record_t) * sample_size));
+  h->compare = compare;
+  h->arg = arg;
+  h->sample = (ac_io_record_t *)(h + 1);
+  h->sample_size = sample_size;
+  h->seed = 0x9E3779B97F4A7C15ULL;
+  return h;
+}
+
+static inline uint64_t range_random(ac_io_range_partition_t *h) {
+  /* xorshift64* */
+  h->seed ^= h->seed >> 12;
+  h->seed ^= h->seed << 25;
+  h->seed ^= h->seed >> 27;
+  return h->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static void range_copy(ac_io_record_t *dest, const ac_io_record_t *r) {
+  dest->record = (char *)ac_malloc(r->length + 1);
+  memcpy(dest->record, r->record, r->length);
+  dest->record[r->length] = 0;
+  dest->length = r->length;
+  dest->tag = r->tag;
+}
+
+void ac_io_range_partition_sample(ac_io_range_partition_t *h,
+                                  const ac_io_record_t *r) {
+  h->num_seen++;
+  if (h->num_sample < h->sample_size) {
+    range_copy(h->sample + h->num_sample, r);
+    h->num_sample++;
+    return;
+  }
+  /* keep the record with a probability of sample_size / num_seen */
+  size_t pos = range_random(h) % h->num_seen;
+  if (pos < h->sample_size) {
+    ac_free(h->sample[pos].record);
+    range_copy(h->sample + pos, r);
+  }
+}
+
+void ac_io_range_partition_split(ac_io_range_partition_t *h, size_t num_part) {
+  if (h->splits)
+    ac_free(h->splits);
+  h->splits = NULL;
+  h->num_splits = 0;
+  if (num_part < 2 || !h->num_sample)
+    return;
+
+  ac_io_sort_records(h->sample, h->num_sample, h->compare, h->arg);
+  h->num_splits = num_part - 1;
+  h->splits =
+      (ac_io_record_t *)ac_malloc(sizeof(ac_io_record_t) * h->num_splits);
+  for (size_t i = 0; i < h->num_splits; i++)
+    h->splits[i] = h->sample[((i + 1) * h->num_sample) / num_part];
+}
+
+size_t ac_io_range_partition(const ac_io_record_t *r, size_t num_part,
+                             void *tag) {
+  ac_io_range_partition_t *h = (ac_io_range_partition_t *)tag;
+  /* the first split which is greater than r */
+  size_t lo = 0, hi = h->num_splits;
+  while (lo < hi) {
+    size_t mid = (lo + hi) >> 1;
+    if (h->compare(r, h->splits + mid, h->arg) < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo >= num_part)
+    lo = num_part - 1;
+  return lo;
+}
+
+void ac_io_range_partition_destroy(ac_io_range_partition_t *h) {
+  for (size_t i = 0; i < h->num_sample; i++)
+    ac_free(h->sample[i].record);
+  if (h->splits)
+    ac_free(h->splits);
+  ac_free(h);
+}
+
 bool ac_io_extension(const char *filename, const char *extension) {
+  if (!filename)
+    return false;
   const char *r = strrchr(filename, '/');
   if (r)
     filename = r + 1;
@@ -98,6 +589,315 @@ bool ac_io_make_path_valid(char *filename) {
   return true;
 }
 
+/* Each buffer is preceded by a header which records its size class.  Buffers
+   which are too small to pool have a class of NUM_BUFFER_CLASSES. */
+typedef struct io_buffer_s {
+  size_t size_class;
+  struct io_buffer_s *next;
+} io_buffer_t;
+
+#define NUM_BUFFER_CLASSES 128
+
+static pthread_mutex_t buffer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static io_buffer_t *buffer_pool[NUM_BUFFER_CLASSES];
+static size_t buffer_pool_idle = 0;
+static size_t buffer_pool_max_idle = 32 * 1024 * 1024;
+
+static inline size_t buffer_class_size(size_t size_class) {
+  size_t shift = (size_class >> 2) + 14; /* 64KB is class 0 */
+  return ((size_t)((size_class & 3) + 4)) << shift;
+}
+
+/* the smallest class whose size is at least size */
+static inline size_t buffer_class(size_t size) {
+  size_t shift = 63 - __builtin_clzll(size);
+  size_t size_class = ((shift - 16) << 2) + ((size >> (shift - 2)) & 3);
+  if (buffer_class_size(size_class) < size)
+    size_class++;
+  return size_class;
+}
+
+#ifndef _AC_DEBUG_MEMORY_
+static const size_t MIN_POOLED_BUFFER = 64 * 1024;
+
+void *ac_io_buffer_alloc(size_t size) {
+  io_buffer_t *b;
+  if (size < MIN_POOLED_BUFFER) {
+    b = (io_buffer_t *)malloc(sizeof(io_buffer_t) + size);
+    if (!b)
+      abort();
+    b->size_class = NUM_BUFFER_CLASSES;
+    return b + 1;
+  }
+  size_t size_class = buffer_class(size);
+  if (size_class >= NUM_BUFFER_CLASSES)
+    abort();
+
+  pthread_mutex_lock(&buffer_pool_mutex);
+  b = buffer_pool[size_class];
+  if (b) {
+    buffer_pool[size_class] = b->next;
+    buffer_pool_idle -= buffer_class_size(size_class);
+  }
+  pthread_mutex_unlock(&buffer_pool_mutex);
+  if (!b) {
+    b = (io_buffer_t *)malloc(sizeof(io_buffer_t) +
+                              buffer_class_size(size_class));
+    if (!b)
+      abort();
+    b->size_class = size_class;
+  }
+  return b + 1;
+}
+
+void ac_io_buffer_free(void *p) {
+  if (!p)
+    return;
+  io_buffer_t *b = (io_buffer_t *)p - 1;
+  size_t size_class = b->size_class;
+  if (size_class < NUM_BUFFER_CLASSES) {
+    size_t size = buffer_class_size(size_class);
+    pthread_mutex_lock(&buffer_pool_mutex);
+    if (buffer_pool_idle + size <= buffer_pool_max_idle) {
+      b->next = buffer_pool[size_class];
+      buffer_pool[size_class] = b;
+      buffer_pool_idle += size;
+      b = NULL;
+    }
+    pthread_mutex_unlock(&buffer_pool_mutex);
+  }
+  if (b)
+    free(b);
+}
+#endif
+
+/* free idle buffers (the largest first) until at most max_idle bytes are idle,
+   called with the mutex held */
+static void trim_buffer_pool(size_t max_idle) {
+  for (size_t i = NUM_BUFFER_CLASSES; i > 0 && buffer_pool_idle > max_idle;) {
+    i--;
+    size_t size = buffer_class_size(i);
+    while (buffer_pool[i] && buffer_pool_idle > max_idle) {
+      io_buffer_t *b = buffer_pool[i];
+      buffer_pool[i] = b->next;
+      buffer_pool_idle -= size;
+      free(b);
+    }
+  }
+}
+
+void ac_io_buffer_pool_limit(size_t max_idle_bytes) {
+  pthread_mutex_lock(&buffer_pool_mutex);
+  buffer_pool_max_idle = max_idle_bytes;
+  trim_buffer_pool(max_idle_bytes);
+  pthread_mutex_unlock(&buffer_pool_mutex);
+}
+
+void ac_io_buffer_pool_clear() {
+  pthread_mutex_lock(&buffer_pool_mutex);
+  trim_buffer_pool(0);
+  pthread_mutex_unlock(&buffer_pool_mutex);
+}
+
+#ifdef AC_IO_URING
+/*
+  The rings are set up with the raw system calls (rather than liburing).  The
+  submission queue tail and the completion queue head are only written by
+  this side, while the kernel moves the submission head and completion tail,
+  so those are read with acquire and written with release ordering.
+*/
+struct ac_io_uring_s {
+  int fd;
+  uint32_t entries;
+  uint32_t queued;
+  uint32_t in_flight;
+
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+ac_io_uring_t *ac_io_uring_init(uint32_t entries) {
+  if (entries < 1)
+    entries = 1;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return NULL;
+  /* IORING_OP_READ and IORING_OP_WRITE arrived with this feature (5.6) */
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    return NULL;
+  }
+
+  ac_io_uring_t *h = (ac_io_uring_t *)ac_calloc(sizeof(ac_io_uring_t));
+  h->fd = fd;
+  h->entries = p.sq_entries;
+  h->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+  h->cq_ring_size =
+      p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (h->cq_ring_size > h->sq_ring_size)
+      h->sq_ring_size = h->cq_ring_size;
+    h->cq_ring_size = 0;
+  }
+  h->sq_ring = mmap(NULL, h->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  h->cq_ring = h->sq_ring;
+  if (h->sq_ring != MAP_FAILED && h->cq_ring_size)
+    h->cq_ring = mmap(NULL, h->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  h->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  h->sqes = MAP_FAILED;
+  if (h->sq_ring != MAP_FAILED && h->cq_ring != MAP_FAILED)
+    h->sqes = (struct io_uring_sqe *)mmap(
+        NULL, h->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+  if (h->sqes == MAP_FAILED) {
+    if (h->cq_ring_size && h->cq_ring != MAP_FAILED)
+      munmap(h->cq_ring, h->cq_ring_size);
+    if (h->sq_ring != MAP_FAILED)
+      munmap(h->sq_ring, h->sq_ring_size);
+    close(fd);
+    ac_free(h);
+    return NULL;
+  }
+
+  char *sq = (char *)h->sq_ring;
+  h->sq_head = (uint32_t *)(sq + p.sq_off.head);
+  h->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+  h->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+  h->sq_array = (uint32_t *)(sq + p.sq_off.array);
+  char *cq = (char *)h->cq_ring;
+  h->cq_head = (uint32_t *)(cq + p.cq_off.head);
+  h->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+  h->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+  h->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return h;
+}
+
+static bool queue_request(ac_io_uring_t *h, int op, int fd, const void *buf,
+                          uint32_t len, uint64_t offset, void *data) {
+  /* limiting the requests to the number of entries keeps the completion
+     queue (which is twice as large) from overflowing */
+  if (h->queued + h->in_flight >= h->entries)
+    return false;
+  uint32_t tail = *h->sq_tail;
+  uint32_t index = tail & h->sq_mask;
+  struct io_uring_sqe *sqe = h->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+  h->sq_array[index] = index;
+  __atomic_store_n(h->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  h->queued++;
+  return true;
+}
+
+bool ac_io_uring_read(ac_io_uring_t *h, int fd, void *buf, uint32_t len,
+                      uint64_t offset, void *data) {
+  return queue_request(h, IORING_OP_READ, fd, buf, len, offset, data);
+}
+
+bool ac_io_uring_write(ac_io_uring_t *h, int fd, const void *buf,
+                       uint32_t len, uint64_t offset, void *data) {
+  return queue_request(h, IORING_OP_WRITE, fd, buf, len, offset, data);
+}
+
+static bool enter(ac_io_uring_t *h, uint32_t min_complete) {
+  while (true) {
+    int n = syscall(__NR_io_uring_enter, h->fd, h->queued, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0) {
+      h->queued -= n;
+      h->in_flight += n;
+      return true;
+    }
+    if (errno != EINTR)
+      return false;
+  }
+}
+
+bool ac_io_uring_submit(ac_io_uring_t *h) {
+  if (!h->queued)
+    return true;
+  return enter(h, 0);
+}
+
+void *ac_io_uring_wait(ac_io_uring_t *h, int *res) {
+  while (true) {
+    uint32_t head = *h->cq_head;
+    if (head != __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = h->cqes + (head & h->cq_mask);
+      void *data = (void *)(uintptr_t)cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(h->cq_head, head + 1, __ATOMIC_RELEASE);
+      h->in_flight--;
+      return data;
+    }
+    if (!h->queued && !h->in_flight)
+      return NULL;
+    if (!enter(h, 1))
+      abort();
+  }
+}
+
+uint32_t ac_io_uring_pending(ac_io_uring_t *h) {
+  return h->queued + h->in_flight;
+}
+
+uint32_t ac_io_uring_queued(ac_io_uring_t *h) { return h->queued; }
+
+void ac_io_uring_destroy(ac_io_uring_t *h) {
+  munmap(h->sqes, h->sqes_size);
+  if (h->cq_ring_size)
+    munmap(h->cq_ring, h->cq_ring_size);
+  munmap(h->sq_ring, h->sq_ring_size);
+  close(h->fd);
+  ac_free(h);
+}
+#else
+ac_io_uring_t *ac_io_uring_init(uint32_t entries) { return NULL; }
+
+bool ac_io_uring_read(ac_io_uring_t *h, int fd, void *buf, uint32_t len,
+                      uint64_t offset, void *data) {
+  return false;
+}
+
+bool ac_io_uring_write(ac_io_uring_t *h, int fd, const void *buf,
+                       uint32_t len, uint64_t offset, void *data) {
+  return false;
+}
+
+bool ac_io_uring_submit(ac_io_uring_t *h) { return false; }
+
+void *ac_io_uring_wait(ac_io_uring_t *h, int *res) { return NULL; }
+
+uint32_t ac_io_uring_pending(ac_io_uring_t *h) { return 0; }
+
+uint32_t ac_io_uring_queued(ac_io_uring_t *h) { return 0; }
+
+void ac_io_uring_destroy(ac_io_uring_t *h) {}
+#endif
+
 bool ac_io_file_info(ac_io_file_info_t *fi) {
   if (!fi || !fi->filename)
     return false;
@@ -137,6 +937,22 @@ time_t ac_io_modified(const char *filename) {
   return sb.st_mtime;
 }
 
+bool ac_io_file_stamp(const char *filename, uint64_t *size,
+                      uint64_t *modified) {
+  struct stat sb;
+  if (!filename || stat(filename, &sb) == -1 ||
+      (sb.st_mode & S_IFMT) != S_IFREG)
+    return false;
+  *size = sb.st_size;
+#ifdef __APPLE__
+  *modified = (sb.st_mtimespec.tv_sec * 1000000000ULL) +
+              sb.st_mtimespec.tv_nsec;
+#else
+  *modified = (sb.st_mtim.tv_sec * 1000000000ULL) + sb.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
 size_t ac_io_file_size(const char *filename) {
   if (!filename)
     return 0;
@@ -184,6 +1000,170 @@ ac_io_file_info_t *ac_io_select_file_info(ac_pool_t *pool, size_t *num_res,
   return res;
 }
 
+static inline bool can_split(ac_io_file_info_t *fi, size_t split_size) {
+  return fi->size >= split_size && !fi->end &&
+         !ac_io_extension(fi->filename, "gz") &&
+         !ac_io_extension(fi->filename, "lz4");
+}
+
+ac_io_file_info_t *ac_io_split_file_info(ac_pool_t *pool, size_t *num_res,
+                                         ac_io_file_info_t *inputs,
+                                         size_t num_inputs, size_t partition,
+                                         size_t num_partitions,
+                                         size_t split_size) {
+  if (split_size < num_partitions)
+    split_size = num_partitions;
+  ac_io_file_info_t *p = inputs;
+  ac_io_file_info_t *ep = p + num_inputs;
+  size_t num_matching = 0;
+  while (p < ep) {
+    if (can_split(p, split_size) || (p->hash % num_partitions) == partition)
+      num_matching++;
+    p++;
+  }
+  *num_res = num_matching;
+  if (!num_matching)
+    return NULL;
+  p = inputs;
+  ac_io_file_info_t *res = (ac_io_file_info_t *)ac_pool_alloc(
+      pool, sizeof(ac_io_file_info_t) * num_matching);
+  ac_io_file_info_t *wp = res;
+  while (p < ep) {
+    if (can_split(p, split_size)) {
+      uint64_t range = (p->size + num_partitions - 1) / num_partitions;
+      *wp = *p;
+      wp->start = range * partition;
+      wp->end = wp->start + range;
+      if (wp->end > p->size)
+        wp->end = p->size;
+      wp->size = wp->end > wp->start ? wp->end - wp->start : 0;
+      wp++;
+    } else if ((p->hash % num_partitions) == partition) {
+      *wp = *p;
+      wp++;
+    }
+    p++;
+  }
+  return res;
+}
+
+/* The bloom filter is a header followed by num_bits bits.  The num_hashes bit
+   positions of a key come from its 64 bit hash (using double hashing). */
+#define AC_IO_BLOOM_MAGIC "acbloom2"
+
+/* size and modified are of the file when the filter was written (see
+   ac_io_file_stamp), so a filter which doesn't match the file is ignored */
+typedef struct {
+  char magic[8];
+  uint64_t num_bits;
+  uint64_t num_hashes;
+  uint64_t size;
+  uint64_t modified;
+} ac_io_bloom_header_t;
+
+static inline uint64_t bloom_bit(uint64_t hash, uint64_t i,
+                                 uint64_t num_bits) {
+  uint64_t step = ((hash * 0x9E3779B97F4A7C15ULL) >> 32) | 1;
+  return (hash + (i * step)) % num_bits;
+}
+
+static char *bloom_filename(const char *filename) {
+  char *res = (char *)ac_malloc(strlen(filename) + 7);
+  sprintf(res, "%s.bloom", filename);
+  return res;
+}
+
+bool ac_io_bloom_write(const char *filename, const uint64_t *hashes,
+                       size_t num_hashes, size_t bits_per_key) {
+  if (bits_per_key < 1)
+    bits_per_key = 1;
+  ac_io_bloom_header_t header;
+  memcpy(header.magic, AC_IO_BLOOM_MAGIC, sizeof(header.magic));
+  if (!ac_io_file_stamp(filename, &header.size, &header.modified))
+    return false;
+  header.num_bits = (((num_hashes * bits_per_key) + 63) / 64) * 64;
+  if (header.num_bits < 64)
+    header.num_bits = 64;
+  /* ln(2) * bits_per_key hashes minimizes the false positive rate */
+  header.num_hashes = (bits_per_key * 69 + 50) / 100;
+  if (header.num_hashes < 1)
+    header.num_hashes = 1;
+  if (header.num_hashes > 16)
+    header.num_hashes = 16;
+
+  uint64_t *bits = (uint64_t *)ac_calloc(header.num_bits / 8);
+  for (size_t i = 0; i < num_hashes; i++) {
+    for (uint64_t j = 0; j < header.num_hashes; j++) {
+      uint64_t bit = bloom_bit(hashes[i], j, header.num_bits);
+      bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
+  }
+
+  char *name = bloom_filename(filename);
+  bool ok = false;
+  FILE *out = fopen(name, "wb");
+  if (out) {
+    ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+         fwrite(bits, header.num_bits / 8, 1, out) == 1;
+    if (fclose(out))
+      ok = false;
+    if (!ok)
+      remove(name);
+  }
+  ac_free(name);
+  ac_free(bits);
+  return ok;
+}
+
+bool ac_io_bloom_check(const char *filename, ac_io_hash_f hash, void *arg,
+                       const ac_io_record_t *keys, size_t num_keys) {
+  char *name = bloom_filename(filename);
+  size_t len = 0;
+  char *filter = ac_io_read_file(&len, name);
+  ac_free(name);
+  if (!filter)
+    return true;
+
+  ac_io_bloom_header_t *header = (ac_io_bloom_header_t *)filter;
+  uint64_t *bits = (uint64_t *)(header + 1);
+  bool res = true;
+  uint64_t size, modified;
+  if (len >= sizeof(*header) &&
+      !memcmp(header->magic, AC_IO_BLOOM_MAGIC, sizeof(header->magic)) &&
+      header->num_bits && !(header->num_bits & 63) &&
+      len == sizeof(*header) + (header->num_bits / 8) &&
+      ac_io_file_stamp(filename, &size, &modified) &&
+      header->size == size && header->modified == modified) {
+    res = false;
+    for (size_t i = 0; i < num_keys && !res; i++) {
+      uint64_t h = hash(keys + i, arg);
+      res = true;
+      for (uint64_t j = 0; j < header->num_hashes; j++) {
+        uint64_t bit = bloom_bit(h, j, header->num_bits);
+        if (!(bits[bit >> 6] & (1ULL << (bit & 63)))) {
+          res = false;
+          break;
+        }
+      }
+    }
+  }
+  ac_free(filter);
+  return res;
+}
+
+size_t ac_io_bloom_filter_files(ac_io_file_info_t *files, size_t num_files,
+                                ac_io_hash_f hash, void *arg,
+                                const ac_io_record_t *keys, size_t num_keys) {
+  ac_io_file_info_t *wp = files;
+  for (size_t i = 0; i < num_files; i++) {
+    if (ac_io_bloom_check(files[i].filename, hash, arg, keys, num_keys)) {
+      *wp = files[i];
+      wp++;
+    }
+  }
+  return wp - files;
+}
+
 typedef struct ac_io_file_info_link_s {
   ac_io_file_info_t fi;
   struct ac_io_file_info_link_s *next;
@@ -228,6 +1208,7 @@ void _ac_io_list(ac_io_file_info_root_t *root, const char *path,
           n = (ac_io_file_info_link_t *)ac_malloc(len);
         n->fi.filename = (char *)(n + 1);
         n->fi.tag = 0;
+        n->fi.start = n->fi.end = 0;
         n->next = NULL;
         strcpy(n->fi.filename, filename);
         ac_io_file_info(&(n->fi));
@@ -42,6 +42,10 @@ typedef struct ac_io_file_info_s {
   time_t last_modified;
   uint64_t hash;
   int32_t tag;
+  /* if end is set, only the records which start in [start, end) of the file
+     are read (see ac_io_split_file_info) */
+  uint64_t start;
+  uint64_t end;
 } ac_io_file_info_t;
 
 ac_sort_compare_arg_def(ac_io_sort_records, ac_io_record_t);
@@ -61,12 +65,166 @@ typedef void (*ac_io_fixed_sort_f)(void *p, size_t total_elems);
 
 typedef int (*ac_io_fixed_compare_f)(const void *p1, const void *p2, void *tag);
 
+/* A key prefix is an 8 byte normalized form of the start of a record's key.
+   If prefix(a) < prefix(b), then a must compare less than b.  If the prefixes
+   are equal, the records may or may not be equal and the compare function is
+   used to decide.  Sorting and merging with a key prefix avoids touching the
+   record for most comparisons. */
+typedef uint64_t (*ac_io_key_prefix_f)(const ac_io_record_t *r, void *tag);
+
+typedef struct {
+  uint64_t prefix;
+  ac_io_record_t r;
+} ac_io_prefix_record_t;
+
+/* A hash of a record's key.  Records which compare as equal must have the same
+   hash. */
+typedef uint64_t (*ac_io_hash_f)(const ac_io_record_t *r, void *tag);
+
+/* sort by prefix and then by compare when the prefixes are equal */
+void ac_io_sort_prefix_records(ac_io_prefix_record_t *base, size_t num_records,
+                               ac_io_compare_f compare, void *arg);
+
+/* Sort records which are made up of a few ascending runs (such as sorted
+   inputs which were concatenated) by merging neighboring runs, which takes
+   O(n log runs) compares and is a single pass over records which are already
+   sorted.  If the runs are short (less than AC_IO_MIN_AVERAGE_RUN records on
+   average), ac_io_sort_records is used instead. */
+#define AC_IO_MIN_AVERAGE_RUN 32
+
+void ac_io_sort_runs(ac_io_record_t *base, size_t num_records,
+                     ac_io_compare_f compare, void *arg);
+
 bool ac_io_keep_first(ac_io_record_t *res, const ac_io_record_t *r,
                       size_t num_r, ac_buffer_t *bh, void *tag);
 
+/* Sort num_records fixed length records (each record_size bytes) in place by
+   an unsigned integer key which is key_width bytes long, starts key_offset
+   bytes into each record, and is stored in native byte order (so a uint32_t
+   key at the start of a record is (0, 4)).  This is an in-place MSD radix sort
+   which does not call a comparison function and needs no extra memory. */
+void ac_io_radix_sort(void *base, size_t num_records, size_t record_size,
+                      size_t key_offset, size_t key_width);
+
+/* Find the delimiters in p[0, len) and write their offsets to offs (at most
+   max_offs of them).  This returns the number of delimiters found and sets
+   *scanned to the number of bytes searched, which is len unless offs filled
+   up (the search stops after the last delimiter that fit).  The search uses
+   SSE2, AVX2 or AVX-512 on x86-64 (whichever the cpu supports) and len must
+   be less than 4GB. */
+size_t ac_io_index_delimiters(uint32_t *offs, size_t max_offs, size_t *scanned,
+                              const char *p, size_t len, char delim);
+
 size_t ac_io_hash_partition(const ac_io_record_t *r, size_t num_part,
                             void *tag);
 
+/* The first 8 bytes (as a big endian number) of the zero terminated string
+   starting at the offset pointed to by tag (or the start of the record if tag
+   is NULL).  This is a valid key prefix for strcmp style comparisons. */
+uint64_t ac_io_key_prefix_string(const ac_io_record_t *r, void *tag);
+
+/* A hash of the zero terminated string starting at the offset pointed to by tag
+   (or the start of the record if tag is NULL).  This is a valid hash for
+   strcmp style comparisons. */
+uint64_t ac_io_hash_string(const ac_io_record_t *r, void *tag);
+
+/* A range partitioner assigns each record to a partition by comparing it with
+   split points chosen from a sample of the records.  Records less than the
+   first split go to partition 0, records less than the second to partition 1,
+   and so on (equal records always go to the same partition).  If each
+   partition is sorted with the same compare function, the partitions are
+   totally ordered.
+
+   The sample is a reservoir of up to sample_size copies of the records passed
+   to ac_io_range_partition_sample (typically from a pass over the input or the
+   first records written).  ac_io_range_partition_split then picks the split
+   points for num_part partitions.  After that, ac_io_range_partition can be
+   used as an ac_io_partition_f with the range partition as its tag (it is
+   safe to share across threads).  See also ac_out_ext_options_range_partition
+   which samples the first records written to a partitioned output. */
+typedef struct ac_io_range_partition_s ac_io_range_partition_t;
+
+ac_io_range_partition_t *ac_io_range_partition_init(ac_io_compare_f compare,
+                                                    void *arg,
+                                                    size_t sample_size);
+
+void ac_io_range_partition_sample(ac_io_range_partition_t *h,
+                                  const ac_io_record_t *r);
+
+void ac_io_range_partition_split(ac_io_range_partition_t *h, size_t num_part);
+
+size_t ac_io_range_partition(const ac_io_record_t *r, size_t num_part,
+                             void *tag);
+
+void ac_io_range_partition_destroy(ac_io_range_partition_t *h);
+
+/* A process-wide pool of I/O buffers.  Buffers are grouped by size class (four
+   classes per power of two starting at 64KB) and returned buffers are kept
+   for the next request of the same class, so jobs which open and close many
+   files (such as the tmp files of a sort) reuse memory which is already
+   mapped.  Smaller requests are simply allocated.  A buffer must be returned
+   with ac_io_buffer_free.  When _AC_DEBUG_MEMORY_ is defined, the buffers
+   are allocated by the ac_allocator (without pooling) so that they are
+   tracked like any other allocation. */
+#ifdef _AC_DEBUG_MEMORY_
+#define ac_io_buffer_alloc(size)                                               \
+  _ac_malloc_d(NULL, __AC_FILE_LINE__, size, false)
+#define ac_io_buffer_free(p) _ac_free_d(NULL, __AC_FILE_LINE__, p)
+#else
+void *ac_io_buffer_alloc(size_t size);
+void ac_io_buffer_free(void *p);
+#endif
+
+/* The number of idle bytes the pool may hold (32MB by default, which is
+   enough for the tmp buffers of a sort to be reused).  Idle buffers count
+   against the memory of the process, so jobs which budget their memory
+   closely may want to lower this (or raise it to reuse more buffers).
+   Returning a buffer beyond the limit frees it, and lowering the limit frees
+   idle buffers (the largest first) until the pool is within it. */
+void ac_io_buffer_pool_limit(size_t max_idle_bytes);
+
+/* Free all of the idle buffers */
+void ac_io_buffer_pool_clear();
+
+/* A minimal io_uring for queueing reads and writes at explicit offsets, so
+   that a stream can keep several requests in flight without helper threads
+   (and requests for many files can be sent in one system call).  This is
+   used by ac_in_options_io_uring and ac_out_options_io_uring.
+   ac_io_uring_init returns NULL if io_uring isn't available (the kernel is
+   older than 5.6, io_uring is blocked, or it isn't Linux), in which case the
+   callers use read() and write() as usual.  A ring must only be used by one
+   thread at a time. */
+struct ac_io_uring_s;
+typedef struct ac_io_uring_s ac_io_uring_t;
+
+ac_io_uring_t *ac_io_uring_init(uint32_t entries);
+
+/* Queue a read or write of len bytes at offset.  data is returned when the
+   request completes.  Requests are not sent to the kernel until
+   ac_io_uring_submit or ac_io_uring_wait is called.  Returns false if
+   entries requests are already queued or in flight. */
+bool ac_io_uring_read(ac_io_uring_t *h, int fd, void *buf, uint32_t len,
+                      uint64_t offset, void *data);
+bool ac_io_uring_write(ac_io_uring_t *h, int fd, const void *buf,
+                       uint32_t len, uint64_t offset, void *data);
+
+/* Send the queued requests to the kernel */
+bool ac_io_uring_submit(ac_io_uring_t *h);
+
+/* Wait for a request to complete (after submitting any which are queued),
+   returning its data and setting res to the number of bytes read or written
+   (or -errno).  Returns NULL if there are no requests. */
+void *ac_io_uring_wait(ac_io_uring_t *h, int *res);
+
+/* The number of requests which are queued or in flight */
+uint32_t ac_io_uring_pending(ac_io_uring_t *h);
+
+/* The number of requests which are queued and haven't been submitted */
+uint32_t ac_io_uring_queued(ac_io_uring_t *h);
+
+/* All requests must be complete before the ring is destroyed */
+void ac_io_uring_destroy(ac_io_uring_t *h);
+
 bool ac_io_file_info(ac_io_file_info_t *fi);
 
 ac_io_file_info_t *
@@ -82,12 +240,52 @@ ac_io_file_info_t *ac_io_select_file_info(ac_pool_t *pool, size_t *num_res,
                                           size_t num_inputs, size_t partition,
                                           size_t num_partitions);
 
+/* Like ac_io_select_file_info, except that uncompressed files which are at
+   least split_size bytes are divided into num_partitions byte ranges and each
+   partition gets one range of each (size is set to the size of the range).
+   The ranges are aligned to records as they are read (see
+   ac_in_options_record_range), so this only works for delimited and fixed
+   length formats.  Compressed files are selected whole. */
+ac_io_file_info_t *ac_io_split_file_info(ac_pool_t *pool, size_t *num_res,
+                                         ac_io_file_info_t *inputs,
+                                         size_t num_inputs, size_t partition,
+                                         size_t num_partitions,
+                                         size_t split_size);
+
+/* Write a bloom filter of the key hashes to filename.bloom, using about
+   bits_per_key bits for each hash (10 bits gives about a 1% false positive
+   rate).  filename must already be written, since the filter records its
+   size and modified time.  ac_out_options_bloom_filter writes one for an
+   output. */
+bool ac_io_bloom_write(const char *filename, const uint64_t *hashes,
+                       size_t num_hashes, size_t bits_per_key);
+
+/* Returns false if filename has a bloom filter (filename.bloom) and none of
+   the keys are in it, so the file can be skipped.  Otherwise, the file may
+   have one or more of the keys.  A filter is ignored if the file has changed
+   since it was written.  hash must be the hash the filter was written
+   with. */
+bool ac_io_bloom_check(const char *filename, ac_io_hash_f hash, void *arg,
+                       const ac_io_record_t *keys, size_t num_keys);
+
+/* Removes the files which can't have any of the keys (see ac_io_bloom_check)
+   while keeping the order of the rest, returning the number left. */
+size_t ac_io_bloom_filter_files(ac_io_file_info_t *files, size_t num_files,
+                                ac_io_hash_f hash, void *arg,
+                                const ac_io_record_t *keys, size_t num_keys);
+
 bool ac_io_file_exists(const char *filename);
 
 size_t ac_io_file_size(const char *filename);
 
 time_t ac_io_modified(const char *filename);
 
+/* Sets the size and last modified time (in nanoseconds) of filename.
+   Sidecar files (such as filename.keys) record these, so that a sidecar left
+   from an earlier version of the file is ignored. */
+bool ac_io_file_stamp(const char *filename, uint64_t *size,
+                      uint64_t *modified);
+
 bool ac_io_directory(const char *filename);
 bool ac_io_file(const char *filename);
 
@@ -144,6 +342,16 @@ static inline int ac_io_compare_uint32_t(const ac_io_record_t *p1,
   return 0;
 }
 
+static inline uint64_t ac_io_key_prefix_uint64_t(const ac_io_record_t *r,
+                                                 void *tag) {
+  return *(uint64_t *)r->record;
+}
+
+static inline uint64_t ac_io_key_prefix_uint32_t(const ac_io_record_t *r,
+                                                 void *tag) {
+  return *(uint32_t *)r->record;
+}
+
 static inline size_t ac_io_split_by_uint64_t(const ac_io_record_t *r,
                                              size_t num_part, void *tag) {
   uint64_t *a = (uint64_t *)r->record;
@@ -176,6 +176,11 @@ int ac_lz4_decompress(ac_lz4_t *l, const void *src, uint32_t src_len,
   return r;
 }
 
+void ac_lz4_content_checksum(ac_lz4_t *l, const void *src, uint32_t src_len) {
+  if (l->content_checksum)
+    (void)XXH32_update(&l->xxh, src, src_len);
+}
+
 uint32_t ac_lz4_compress_block(ac_lz4_t *l, const void *src, uint32_t src_len,
                                void *dest, uint32_t dest_len) {
   if (l->content_checksum)
@@ -401,6 +406,8 @@ ac_lz4_t *_ac_lz4_init(int level, ac_lz4_block_size_t size, bool block_checksum,
     LZ4_initStreamHC((LZ4_streamHC_t *)r->ctx, sizeof(LZ4_streamHC_t));
     LZ4_setCompressionLevel((LZ4_streamHC_t *)r->ctx, level);
   }
+  if (content_checksum)
+    XXH32_reset(&(r->xxh), 0);
   return r;
 }
 
@@ -89,6 +89,11 @@ uint32_t ac_lz4_compress(ac_lz4_t *l, const void *src, uint32_t src_len,
 uint32_t ac_lz4_compress_block(ac_lz4_t *l, const void *src, uint32_t src_len,
                                void *dest, uint32_t dest_len);
 
+/* Add src to the content checksum (if the content checksum is used).  This is
+   for blocks compressed with ac_lz4_compress_block on other contexts, such
+   as on several threads, where src must still be added in order. */
+void ac_lz4_content_checksum(ac_lz4_t *l, const void *src, uint32_t src_len);
+
 /* this will return a negative number if crc doesn't match.  dest should point
    to location for size if compressing and just after block_size if
    decompressing.  If result is non-negative, then it succeeded and read or
@@ -23,20 +23,21 @@ limitations under the License.
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
-/* options for fixed output -- TODO */
-void ac_out_ext_options_fixed_compare(ac_out_ext_options_t *h,
-                                      ac_io_fixed_compare_f compare, void *arg);
-void ac_out_ext_options_fixed_sort(ac_out_ext_options_t *h,
-                                   ac_io_fixed_sort_f sort, void *arg);
-void ac_out_ext_options_fixed_reducer(ac_out_ext_options_t *h,
-                                      ac_io_fixed_reducer_f reducer, void *arg);
-
 typedef bool (*ac_out_write_f)(ac_out_t *h, const void *d, size_t len);
 
+struct lz4_writer_s;
+typedef struct lz4_writer_s lz4_writer_t;
+struct gz_writer_s;
+typedef struct gz_writer_s gz_writer_t;
+struct out_write_s;
+typedef struct out_write_s out_write_t;
+
 const int AC_OUT_NORMAL_TYPE = 0;
 const int AC_OUT_PARTITIONED_TYPE = 1;
 const int AC_OUT_SORTED_TYPE = 2;
@@ -60,11 +61,36 @@ struct ac_out_s {
 
   ac_out_write_f write_d;
   gzFile gz;
+  gz_writer_t *gz_writer;
 
   ac_lz4_t *lz4;
+  lz4_writer_t *lz4_writer;
 
   unsigned char delimiter;
   uint32_t fixed;
+
+  /* the key index (see ac_out_options_key_index) */
+  ac_out_write_f indexed_write_record;
+  ac_buffer_t *key_entries;
+  ac_buffer_t *keys;
+  uint64_t key_offset;
+  uint64_t next_key;
+
+  /* the bloom filter (see ac_out_options_bloom_filter) */
+  ac_out_write_f bloom_write_record;
+  ac_buffer_t *bloom_hashes;
+
+  /* writes queued on an io_uring (see ac_out_options_io_uring).  The buffer
+     which is written to the file (buffer, or buffer2 for lz4) is swapped with
+     the next of the writes' buffers when it is queued. */
+  ac_io_uring_t *uring;
+  bool uring_owner;
+  out_write_t *writes;
+  size_t num_writes;
+  size_t cur_write;
+  char *write_buffers;
+  uint64_t write_offset;
+  bool write_error;
 };
 
 static bool _write_to_gz(gzFile *fd, const char *p, size_t len) {
@@ -115,8 +141,576 @@ static bool _write_to_fd(int *fd, const char *p, size_t len) {
   return true;
 }
 
+struct out_write_s {
+  ac_out_t *out;
+  char *buffer;
+  size_t length;
+  uint64_t offset;
+  bool pending;
+};
+
+/* a shared ring is submitted once this many writes are queued */
+static const uint32_t URING_SUBMIT_BATCH = 16;
+
+static bool _pwrite_to_fd(int fd, const char *p, size_t len, uint64_t offset) {
+  ssize_t n;
+  const char *ep = p + len;
+  while (p < ep) {
+    if (ep - p > 0x7FFFFFFFU)
+      n = pwrite(fd, p, 0x7FFFFFFFU, offset);
+    else
+      n = pwrite(fd, p, ep - p, offset);
+    if (n > 0) {
+      p += n;
+      offset += n;
+    } else {
+      if (n == -1 && errno == ENOSPC) {
+        time_t cur_time = time(NULL);
+        fprintf(stderr, "%s ERROR DISK FULL %s\n", __AC_FILE_LINE__,
+                ctime(&cur_time));
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+/* the ring may be shared, so the write can belong to another output */
+static void complete_write(out_write_t *w, int res) {
+  w->pending = false;
+  if (res == (int)w->length)
+    return;
+  if (res < 0 && res != -ENOSPC) {
+    w->out->write_error = true;
+    return;
+  }
+  /* finish a short write (or report the full disk) */
+  size_t done = res > 0 ? res : 0;
+  if (!_pwrite_to_fd(w->out->fd, w->buffer + done, w->length - done,
+                     w->offset + done))
+    w->out->write_error = true;
+}
+
+static void wait_for_write(ac_out_t *h, out_write_t *w) {
+  int res;
+  while (w->pending) {
+    out_write_t *done = (out_write_t *)ac_io_uring_wait(h->uring, &res);
+    if (!done)
+      abort();
+    complete_write(done, res);
+  }
+}
+
+/* queue len bytes of *buffer and continue with the next buffer */
+static bool queue_write(ac_out_t *h, char **buffer, size_t len) {
+  if (!len)
+    return !h->write_error;
+
+  out_write_t *w = h->writes + h->cur_write;
+  w->length = len;
+  w->offset = h->write_offset;
+  h->write_offset += len;
+  int res;
+  while (!ac_io_uring_write(h->uring, h->fd, w->buffer, len, w->offset, w)) {
+    out_write_t *done = (out_write_t *)ac_io_uring_wait(h->uring, &res);
+    if (!done)
+      abort();
+    complete_write(done, res);
+  }
+  w->pending = true;
+  if (h->uring_owner || ac_io_uring_queued(h->uring) >= URING_SUBMIT_BATCH)
+    ac_io_uring_submit(h->uring);
+
+  h->cur_write++;
+  if (h->cur_write == h->num_writes)
+    h->cur_write = 0;
+  w = h->writes + h->cur_write;
+  wait_for_write(h, w);
+  *buffer = w->buffer;
+  return !h->write_error;
+}
+
+/* write len bytes of *buffer, which may be swapped for another buffer */
+static bool _write_buffer(ac_out_t *h, char **buffer, size_t len) {
+  if (h->uring)
+    return queue_write(h, buffer, len);
+  if (!_write_to_fd(&(h->fd), *buffer, len)) {
+    if (h->fd_owner)
+      close(h->fd);
+    h->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+/* write len bytes directly (without copying them into a buffer) */
+static bool _write_direct(ac_out_t *h, const char *p, size_t len) {
+  if (h->uring) {
+    if (!_pwrite_to_fd(h->fd, p, len, h->write_offset))
+      h->write_error = true;
+    h->write_offset += len;
+    return !h->write_error;
+  }
+  if (!_write_to_fd(&(h->fd), p, len)) {
+    if (h->fd_owner)
+      close(h->fd);
+    h->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+/* Writes are queued on uring if the output can use it, otherwise the output
+   is written with write().  The current buffer becomes the first of
+   num_writes + 1 buffers. */
+static void init_writes(ac_out_t *h, ac_io_uring_t *uring, size_t num_writes) {
+  if (!num_writes || h->fd == -1 || h->gz || h->gz_writer ||
+      h->lz4_writer || h->options.append_mode)
+    return;
+  char **buffer = h->lz4 ? &(h->buffer2) : &(h->buffer);
+  size_t size = h->lz4 ? h->buffer_size2 + 8 : h->buffer_size;
+  struct stat sb;
+  if (size > 0x40000000U || fstat(h->fd, &sb) == -1 ||
+      (sb.st_mode & S_IFMT) != S_IFREG)
+    return;
+  off_t offset = lseek(h->fd, 0, SEEK_CUR);
+  if (offset == -1)
+    return;
+
+  h->uring_owner = false;
+  if (!uring) {
+    uring = ac_io_uring_init(num_writes);
+    if (!uring)
+      return;
+    h->uring_owner = true;
+  }
+  h->uring = uring;
+  h->write_offset = offset;
+  h->num_writes = num_writes + 1;
+  h->cur_write = 0;
+  h->writes = (out_write_t *)ac_calloc(sizeof(out_write_t) * h->num_writes);
+  h->write_buffers = (char *)ac_io_buffer_alloc(size * num_writes);
+  for (size_t i = 0; i < h->num_writes; i++) {
+    h->writes[i].out = h;
+    h->writes[i].buffer = i ? h->write_buffers + ((i - 1) * size) : *buffer;
+  }
+}
+
+/* wait for the queued writes to finish and leave the file offset after the
+   output, as if it were written with write() */
+static void finish_writes(ac_out_t *h) {
+  if (!h->writes)
+    return;
+  for (size_t i = 0; i < h->num_writes; i++)
+    wait_for_write(h, h->writes + i);
+  if (h->write_error && h->options.abort_on_error)
+    abort();
+  if (h->fd > -1)
+    lseek(h->fd, h->write_offset, SEEK_SET);
+  if (h->uring_owner)
+    ac_io_uring_destroy(h->uring);
+  h->uring = NULL;
+  ac_io_buffer_free(h->write_buffers);
+  h->write_buffers = NULL;
+  ac_free(h->writes);
+  h->writes = NULL;
+}
+
+/*
+  lz4_writer_t compresses the blocks of an lz4 output on num_threads threads
+  while a writer thread writes the compressed blocks to the file in order.  The
+  blocks form a ring, so at most num_blocks uncompressed blocks are waiting
+  and the caller blocks until one is free.  Each compress thread has its own
+  lz4 context since the context is not thread safe.  The writer thread adds
+  each block to the content checksum of the output's context as it is
+  written, so the checksum is computed in order.
+*/
+typedef struct {
+  char *src;
+  uint32_t src_len;
+  char *dest;
+  uint32_t dest_len;
+  bool compressed;
+} lz4_block_t;
+
+typedef struct {
+  lz4_writer_t *w;
+  ac_lz4_t *lz4;
+  pthread_t thread;
+} lz4_thread_t;
+
+struct lz4_writer_s {
+  ac_out_t *out;
+  lz4_thread_t *threads;
+  size_t num_threads;
+  lz4_block_t *blocks;
+  size_t num_blocks;
+  uint32_t block_size;
+  uint32_t compressed_size;
+
+  /* sequence numbers of the next block to fill, compress and write */
+  size_t fill;
+  size_t compress;
+  size_t write;
+  bool finished;
+  bool error;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t writer;
+};
+
+static void *lz4_compress_thread(void *arg) {
+  lz4_thread_t *t = (lz4_thread_t *)arg;
+  lz4_writer_t *w = t->w;
+  pthread_mutex_lock(&w->mutex);
+  while (true) {
+    while (w->compress == w->fill && !w->finished)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->compress == w->fill)
+      break;
+    lz4_block_t *b = w->blocks + (w->compress % w->num_blocks);
+    w->compress++;
+    pthread_mutex_unlock(&w->mutex);
+    b->dest_len =
+        ac_lz4_compress_block(t->lz4, b->src, b->src_len, b->dest,
+                              w->compressed_size);
+    pthread_mutex_lock(&w->mutex);
+    b->compressed = true;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+static void *lz4_write_thread(void *arg) {
+  lz4_writer_t *w = (lz4_writer_t *)arg;
+  pthread_mutex_lock(&w->mutex);
+  while (true) {
+    lz4_block_t *b = w->blocks + (w->write % w->num_blocks);
+    while (w->write < w->fill && !b->compressed)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->write == w->fill) {
+      if (w->finished)
+        break;
+      pthread_cond_wait(&w->cond, &w->mutex);
+      continue;
+    }
+    bool error = w->error;
+    pthread_mutex_unlock(&w->mutex);
+    ac_lz4_content_checksum(w->out->lz4, b->src, b->src_len);
+    if (!error)
+      error = !_write_to_fd(&(w->out->fd), b->dest, b->dest_len);
+    pthread_mutex_lock(&w->mutex);
+    if (error)
+      w->error = true;
+    b->compressed = false;
+    w->write++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+static lz4_writer_t *lz4_writer_init(ac_out_t *out, size_t num_threads) {
+  /* the header goes out before any of the blocks */
+  if (!_write_to_fd(&(out->fd), out->buffer2, out->buffer_pos2))
+    return NULL;
+  out->buffer_pos2 = 0;
+
+  ac_out_options_t *o = &(out->options);
+  size_t num_blocks = (num_threads * 2) + 2;
+  uint32_t block_size = ac_lz4_block_size(out->lz4);
+  uint32_t compressed_size = ac_lz4_compressed_size(out->lz4) + 8;
+  lz4_writer_t *w = (lz4_writer_t *)ac_io_buffer_alloc(
+      sizeof(lz4_writer_t) + (sizeof(lz4_thread_t) * num_threads) +
+      (sizeof(lz4_block_t) * num_blocks) +
+      ((size_t)(block_size + compressed_size) * num_blocks));
+  memset(w, 0, sizeof(lz4_writer_t) + (sizeof(lz4_thread_t) * num_threads) +
+                   (sizeof(lz4_block_t) * num_blocks));
+  w->out = out;
+  w->threads = (lz4_thread_t *)(w + 1);
+  w->blocks = (lz4_block_t *)(w->threads + num_threads);
+  char *p = (char *)(w->blocks + num_blocks);
+  for (size_t i = 0; i < num_blocks; i++) {
+    w->blocks[i].src = p;
+    p += block_size;
+    w->blocks[i].dest = p;
+    p += compressed_size;
+  }
+  w->num_blocks = num_blocks;
+  w->block_size = block_size;
+  w->compressed_size = compressed_size;
+  w->num_threads = num_threads;
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    lz4_thread_t *t = w->threads + i;
+    t->w = w;
+    t->lz4 = ac_lz4_init(o->level, o->size, o->block_checksum, false);
+    pthread_create(&t->thread, NULL, lz4_compress_thread, t);
+  }
+  pthread_create(&w->writer, NULL, lz4_write_thread, w);
+  return w;
+}
+
+static bool lz4_writer_add(lz4_writer_t *w, const char *p, size_t len) {
+  pthread_mutex_lock(&w->mutex);
+  while (w->fill - w->write >= w->num_blocks && !w->error)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  bool error = w->error;
+  pthread_mutex_unlock(&w->mutex);
+  if (error)
+    return false;
+
+  lz4_block_t *b = w->blocks + (w->fill % w->num_blocks);
+  memcpy(b->src, p, len);
+  b->src_len = len;
+
+  pthread_mutex_lock(&w->mutex);
+  w->fill++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  return true;
+}
+
+/* waits for all of the blocks to be written and stops the threads */
+static bool lz4_writer_destroy(lz4_writer_t *w) {
+  pthread_mutex_lock(&w->mutex);
+  w->finished = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  for (size_t i = 0; i < w->num_threads; i++) {
+    pthread_join(w->threads[i].thread, NULL);
+    ac_lz4_destroy(w->threads[i].lz4);
+  }
+  pthread_join(w->writer, NULL);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+  bool ok = !w->error;
+  ac_io_buffer_free(w);
+  return ok;
+}
+
+/*
+  gz_writer_t compresses a gzip output on num_threads threads in the same way
+  as lz4_writer_t (and pigz).  The input is cut into GZ_BLOCK_SIZE blocks and
+  each block is compressed as raw deflate data ending in a sync flush (so it
+  ends on a byte boundary) along with the crc32 of the block.  The writer
+  thread writes the blocks in order and combines the crc32s.  When finished,
+  an empty final block and the gzip trailer end the single gzip member.
+*/
+static const uint32_t GZ_BLOCK_SIZE = 128 * 1024;
+
+typedef struct {
+  char *src;
+  uint32_t src_len;
+  char *dest;
+  uint32_t dest_len;
+  uint32_t crc;
+  bool compressed;
+} gz_block_t;
+
+typedef struct {
+  gz_writer_t *w;
+  z_stream strm;
+  pthread_t thread;
+} gz_thread_t;
+
+struct gz_writer_s {
+  ac_out_t *out;
+  gz_thread_t *threads;
+  size_t num_threads;
+  gz_block_t *blocks;
+  size_t num_blocks;
+  uint32_t compressed_size;
+
+  /* the crc32 and length (mod 2^32) of everything written */
+  uint32_t crc;
+  uint32_t total;
+
+  /* sequence numbers of the next block to fill, compress and write */
+  size_t fill;
+  size_t compress;
+  size_t write;
+  bool finished;
+  bool error;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t writer;
+};
+
+static void *gz_compress_thread(void *arg) {
+  gz_thread_t *t = (gz_thread_t *)arg;
+  gz_writer_t *w = t->w;
+  pthread_mutex_lock(&w->mutex);
+  while (true) {
+    while (w->compress == w->fill && !w->finished)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->compress == w->fill)
+      break;
+    gz_block_t *b = w->blocks + (w->compress % w->num_blocks);
+    w->compress++;
+    pthread_mutex_unlock(&w->mutex);
+    z_stream *s = &(t->strm);
+    deflateReset(s);
+    s->next_in = (Bytef *)b->src;
+    s->avail_in = b->src_len;
+    s->next_out = (Bytef *)b->dest;
+    s->avail_out = w->compressed_size;
+    bool ok = deflate(s, Z_SYNC_FLUSH) == Z_OK && s->avail_in == 0;
+    b->dest_len = w->compressed_size - s->avail_out;
+    b->crc = crc32(0, (const Bytef *)b->src, b->src_len);
+    pthread_mutex_lock(&w->mutex);
+    if (!ok)
+      w->error = true;
+    b->compressed = true;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+static void *gz_write_thread(void *arg) {
+  gz_writer_t *w = (gz_writer_t *)arg;
+  pthread_mutex_lock(&w->mutex);
+  while (true) {
+    gz_block_t *b = w->blocks + (w->write % w->num_blocks);
+    while (w->write < w->fill && !b->compressed)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->write == w->fill) {
+      if (w->finished)
+        break;
+      pthread_cond_wait(&w->cond, &w->mutex);
+      continue;
+    }
+    bool error = w->error;
+    pthread_mutex_unlock(&w->mutex);
+    w->crc = crc32_combine(w->crc, b->crc, b->src_len);
+    w->total += b->src_len;
+    if (!error)
+      error = !_write_to_fd(&(w->out->fd), b->dest, b->dest_len);
+    pthread_mutex_lock(&w->mutex);
+    if (error)
+      w->error = true;
+    b->compressed = false;
+    b->src_len = 0;
+    w->write++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+static gz_writer_t *gz_writer_init(ac_out_t *out, size_t num_threads) {
+  /* a gzip header without a name or time (like gzdopen writes) */
+  static const char header[10] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+  if (!_write_to_fd(&(out->fd), header, sizeof(header)))
+    return NULL;
+
+  size_t num_blocks = (num_threads * 2) + 2;
+  /* the sync flush adds a few bytes to the bound */
+  uint32_t compressed_size = compressBound(GZ_BLOCK_SIZE) + 64;
+  gz_writer_t *w = (gz_writer_t *)ac_io_buffer_alloc(
+      sizeof(gz_writer_t) + (sizeof(gz_thread_t) * num_threads) +
+      (sizeof(gz_block_t) * num_blocks) +
+      ((size_t)(GZ_BLOCK_SIZE + compressed_size) * num_blocks));
+  memset(w, 0, sizeof(gz_writer_t) + (sizeof(gz_thread_t) * num_threads) +
+                   (sizeof(gz_block_t) * num_blocks));
+  w->out = out;
+  w->threads = (gz_thread_t *)(w + 1);
+  w->blocks = (gz_block_t *)(w->threads + num_threads);
+  char *p = (char *)(w->blocks + num_blocks);
+  for (size_t i = 0; i < num_blocks; i++) {
+    w->blocks[i].src = p;
+    p += GZ_BLOCK_SIZE;
+    w->blocks[i].dest = p;
+    p += compressed_size;
+  }
+  w->num_blocks = num_blocks;
+  w->compressed_size = compressed_size;
+  w->num_threads = num_threads;
+  w->crc = crc32(0, NULL, 0);
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  for (size_t i = 0; i < num_threads; i++) {
+    gz_thread_t *t = w->threads + i;
+    t->w = w;
+    deflateInit2(&(t->strm), out->options.level, Z_DEFLATED, -15, 8,
+                 Z_DEFAULT_STRATEGY);
+    pthread_create(&t->thread, NULL, gz_compress_thread, t);
+  }
+  pthread_create(&w->writer, NULL, gz_write_thread, w);
+  return w;
+}
+
+/* copies p into the block being filled, passing full blocks on to be
+   compressed */
+static bool gz_writer_add(gz_writer_t *w, const char *p, size_t len) {
+  while (len) {
+    pthread_mutex_lock(&w->mutex);
+    while (w->fill - w->write >= w->num_blocks && !w->error)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    bool error = w->error;
+    pthread_mutex_unlock(&w->mutex);
+    if (error)
+      return false;
+
+    gz_block_t *b = w->blocks + (w->fill % w->num_blocks);
+    size_t n = GZ_BLOCK_SIZE - b->src_len;
+    if (n > len)
+      n = len;
+    memcpy(b->src + b->src_len, p, n);
+    b->src_len += n;
+    p += n;
+    len -= n;
+    if (b->src_len == GZ_BLOCK_SIZE) {
+      pthread_mutex_lock(&w->mutex);
+      w->fill++;
+      pthread_cond_broadcast(&w->cond);
+      pthread_mutex_unlock(&w->mutex);
+    }
+  }
+  return true;
+}
+
+/* compresses the last partial block, waits for all of the blocks to be
+   written, stops the threads, and ends the gzip member */
+static bool gz_writer_destroy(gz_writer_t *w) {
+  pthread_mutex_lock(&w->mutex);
+  if (w->fill - w->write < w->num_blocks &&
+      w->blocks[w->fill % w->num_blocks].src_len)
+    w->fill++;
+  w->finished = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  for (size_t i = 0; i < w->num_threads; i++) {
+    pthread_join(w->threads[i].thread, NULL);
+    deflateEnd(&(w->threads[i].strm));
+  }
+  pthread_join(w->writer, NULL);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+  bool ok = !w->error;
+  if (ok) {
+    /* an empty final (fixed) block, the crc32, and the length */
+    char trailer[10] = {3, 0};
+    for (int i = 0; i < 4; i++) {
+      trailer[2 + i] = (w->crc >> (i * 8)) & 0xFF;
+      trailer[6 + i] = (w->total >> (i * 8)) & 0xFF;
+    }
+    ok = _write_to_fd(&(w->out->fd), trailer, sizeof(trailer));
+  }
+  ac_io_buffer_free(w);
+  return ok;
+}
+
 static bool _write_to_lz4(ac_out_t *h, const char *p, size_t len) {
 start:;
+  if (h->lz4_writer)
+    return len ? lz4_writer_add(h->lz4_writer, p, len) : true;
+
   bool written = true;
   if (len) {
     char *wp = h->buffer2 + h->buffer_pos2;
@@ -132,12 +726,8 @@ start:;
       written = true;
     }
   }
-  if (!_write_to_fd(&(h->fd), h->buffer2, h->buffer_pos2)) {
-    if (h->fd_owner)
-      close(h->fd);
-    h->fd = -1;
+  if (!_write_buffer(h, &(h->buffer2), h->buffer_pos2))
     return false;
-  }
 
   h->buffer_pos2 = 0;
   if (!written)
@@ -154,12 +744,8 @@ static bool _ac_out_write(ac_out_t *h, const void *d, size_t len) {
     if (len)
       return true;
     else {
-      if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
-        if (h->fd_owner)
-          close(h->fd);
-        h->fd = -1;
+      if (!_write_buffer(h, &(h->buffer), h->buffer_pos))
         return false;
-      }
       h->buffer_pos = 0;
       return true;
     }
@@ -167,24 +753,15 @@ static bool _ac_out_write(ac_out_t *h, const void *d, size_t len) {
   size_t diff = h->buffer_size - h->buffer_pos;
   memcpy(h->buffer + h->buffer_pos, d, diff);
   h->buffer_pos += diff;
-  if (!_write_to_fd(&(h->fd), h->buffer, h->buffer_pos)) {
-    if (h->fd_owner)
-      close(h->fd);
-    h->fd = -1;
+  if (!_write_buffer(h, &(h->buffer), h->buffer_pos))
     return false;
-  }
   char *p = (char *)d;
   p += diff;
   len -= diff;
   h->buffer_pos = 0;
   if (len >= h->buffer_size) {
-    if (!_write_to_fd(&(h->fd), p, len)) {
-      if (h->fd_owner)
-        close(h->fd);
-      h->fd = -1;
-
+    if (!_write_direct(h, p, len))
       return false;
-    }
   } else {
     memcpy(h->buffer, p, len);
     h->buffer_pos = len;
@@ -204,6 +781,12 @@ static bool _ac_out_write_lz4(ac_out_t *h, const void *d, size_t len) {
       if (!_write_to_lz4(h, h->buffer, h->buffer_pos))
         return false;
       h->buffer_pos = 0;
+      if (h->lz4_writer) {
+        bool ok = lz4_writer_destroy(h->lz4_writer);
+        h->lz4_writer = NULL;
+        if (!ok)
+          return false;
+      }
       char *wp = h->buffer2 + h->buffer_pos2;
       uint32_t n = ac_lz4_finish(h->lz4, wp);
       h->buffer_pos2 += n;
@@ -234,6 +817,12 @@ static bool _ac_out_write_lz4(ac_out_t *h, const void *d, size_t len) {
   return true;
 }
 
+static bool _write_gz(ac_out_t *h, const char *p, size_t len) {
+  if (h->gz_writer)
+    return gz_writer_add(h->gz_writer, p, len);
+  return _write_to_gz(&(h->gz), p, len);
+}
+
 static bool _ac_out_write_gz(ac_out_t *h, const void *d, size_t len) {
   if (h->buffer_pos + len < h->buffer_size) {
     memcpy(h->buffer + h->buffer_pos, d, len);
@@ -241,23 +830,29 @@ static bool _ac_out_write_gz(ac_out_t *h, const void *d, size_t len) {
     if (len)
       return true;
     else {
-      if (!_write_to_gz(&(h->gz), h->buffer, h->buffer_pos))
+      if (!_write_gz(h, h->buffer, h->buffer_pos))
         return false;
       h->buffer_pos = 0;
+      if (h->gz_writer) {
+        bool ok = gz_writer_destroy(h->gz_writer);
+        h->gz_writer = NULL;
+        if (!ok)
+          return false;
+      }
       return true;
     }
   }
   size_t diff = h->buffer_size - h->buffer_pos;
   memcpy(h->buffer + h->buffer_pos, d, diff);
   h->buffer_pos += diff;
-  if (!_write_to_gz(&(h->gz), h->buffer, h->buffer_pos))
+  if (!_write_gz(h, h->buffer, h->buffer_pos))
     return false;
   char *p = (char *)d;
   p += diff;
   len -= diff;
   h->buffer_pos = 0;
   while (len >= h->buffer_size) {
-    if (!_write_to_gz(&(h->gz), p, h->buffer_size))
+    if (!_write_gz(h, p, h->buffer_size))
       return false;
     len -= h->buffer_size;
     p += h->buffer_size;
@@ -309,8 +904,8 @@ static ac_out_t *_ac_out_init_lz4(const char *filename, int fd, bool fd_owner,
   int extra = options->safe_mode ? (filename_length * 2) + 20 : 0;
   extra += options->write_ack_file ? 5 : 0;
 
-  ac_out_t *h = (ac_out_t *)ac_malloc(sizeof(ac_out_t) + buffer_size + 8 +
-                                      filename_length + extra);
+  ac_out_t *h = (ac_out_t *)ac_io_buffer_alloc(
+      sizeof(ac_out_t) + buffer_size + 8 + filename_length + extra);
   memset(h, 0, sizeof(*h));
   h->fd = fd;
   h->lz4 = lz4;
@@ -320,7 +915,7 @@ static ac_out_t *_ac_out_init_lz4(const char *filename, int fd, bool fd_owner,
   if (h->filename) {
     strcpy(h->filename, filename);
     if (!ac_io_make_path_valid(h->filename)) {
-      ac_free(h);
+      ac_io_buffer_free(h);
       return NULL;
     }
   }
@@ -343,6 +938,8 @@ static ac_out_t *_ac_out_init_lz4(const char *filename, int fd, bool fd_owner,
   h->buffer_pos2 = header_size;
   h->options = *options;
   h->write_d = _ac_out_write_lz4;
+  if (options->lz4_threads && h->fd != -1)
+    h->lz4_writer = lz4_writer_init(h, options->lz4_threads);
   return h;
 }
 
@@ -359,8 +956,8 @@ static ac_out_t *_ac_out_init_gz(const char *filename, int fd, bool fd_owner,
   int extra = options->safe_mode ? (filename_length * 2) + 20 : 0;
   extra += options->write_ack_file ? 5 : 0;
 
-  ac_out_t *h = (ac_out_t *)ac_malloc(sizeof(ac_out_t) + buffer_size +
-                                      filename_length + extra);
+  ac_out_t *h = (ac_out_t *)ac_io_buffer_alloc(
+      sizeof(ac_out_t) + buffer_size + filename_length + extra);
   memset(h, 0, sizeof(*h));
   h->fd = -1;
   h->buffer = (char *)(h + 1);
@@ -369,7 +966,7 @@ static ac_out_t *_ac_out_init_gz(const char *filename, int fd, bool fd_owner,
   if (h->filename) {
     strcpy(h->filename, filename);
     if (!ac_io_make_path_valid(h->filename)) {
-      ac_free(h);
+      ac_io_buffer_free(h);
       return NULL;
     }
   }
@@ -388,7 +985,18 @@ static ac_out_t *_ac_out_init_gz(const char *filename, int fd, bool fd_owner,
   mode[1] = options->level + '0';
   mode[2] = 0;
 
-  if (fd != -1)
+  if (options->gz_threads) {
+    /* the gzip member is written directly to the file (see gz_writer_t) */
+    h->fd = fd;
+    h->fd_owner = fd_owner;
+    if (h->fd == -1) {
+      h->fd = open(tmp, O_WRONLY | O_CREAT | (append_mode ? O_APPEND : O_TRUNC),
+                   0777);
+      h->fd_owner = true;
+    }
+    if (h->fd != -1)
+      h->gz_writer = gz_writer_init(h, options->gz_threads);
+  } else if (fd != -1)
     h->gz = gzdopen(fd, mode);
   else
     h->gz = gzopen(tmp, mode);
@@ -405,15 +1013,15 @@ static ac_out_t *_ac_out_init(const char *filename, int fd, bool fd_owner,
 
   int extra = options->safe_mode ? (filename_length * 2) + 20 : 0;
   extra += options->write_ack_file ? 5 : 0;
-  ac_out_t *h = (ac_out_t *)ac_malloc(sizeof(ac_out_t) + buffer_size +
-                                      filename_length + extra);
+  ac_out_t *h = (ac_out_t *)ac_io_buffer_alloc(
+      sizeof(ac_out_t) + buffer_size + filename_length + extra);
   memset(h, 0, sizeof(*h));
   h->buffer = (char *)(h + 1);
   h->filename = filename_length ? h->buffer + buffer_size : NULL;
   if (h->filename) {
     strcpy(h->filename, filename);
     if (!ac_io_make_path_valid(h->filename)) {
-      ac_free(h);
+      ac_io_buffer_free(h);
       return NULL;
     }
   }
@@ -492,10 +1100,34 @@ void ac_out_options_lz4(ac_out_options_t *h, int level,
   h->content_checksum = content_checksum;
 }
 
+void ac_out_options_lz4_threads(ac_out_options_t *h, size_t num_threads) {
+  h->lz4_threads = num_threads;
+}
+
+void ac_out_options_gz_threads(ac_out_options_t *h, size_t num_threads) {
+  h->gz_threads = num_threads;
+}
+
+void ac_out_options_key_index(ac_out_options_t *h, size_t span) {
+  h->key_index = span;
+}
+
+void ac_out_options_bloom_filter(ac_out_options_t *h, ac_io_hash_f hash,
+                                 void *arg, size_t bits_per_key) {
+  h->bloom_hash = hash;
+  h->bloom_hash_arg = arg;
+  h->bloom_bits_per_key = bits_per_key;
+}
+
+void ac_out_options_io_uring(ac_out_options_t *h, size_t num_writes) {
+  h->io_uring = num_writes;
+}
+
 void ac_out_ext_options_init(ac_out_ext_options_t *h) {
   memset(h, 0, sizeof(*h));
   // h->lz4_tmp = false;
   h->lz4_tmp = true;
+  h->skew_threshold = 2.0;
 }
 
 void ac_out_ext_options_sort_while_partitioning(ac_out_ext_options_t *h) {
@@ -507,6 +1139,44 @@ void ac_out_ext_options_num_sort_threads(ac_out_ext_options_t *h,
   h->num_sort_threads = num_sort_threads;
 }
 
+void ac_out_ext_options_num_run_sort_threads(ac_out_ext_options_t *h,
+                                             size_t num_run_sort_threads) {
+  h->num_run_sort_threads = num_run_sort_threads;
+}
+
+void ac_out_ext_options_pipeline(ac_out_ext_options_t *h, size_t num_buffers,
+                                 size_t num_sort_threads,
+                                 size_t num_compress_threads) {
+  h->pipeline_buffers = num_buffers;
+  h->pipeline_sort_threads = num_sort_threads;
+  h->pipeline_compress_threads = num_compress_threads;
+}
+
+void ac_out_ext_options_max_fan_in(ac_out_ext_options_t *h,
+                                   size_t max_fan_in) {
+  h->max_fan_in = max_fan_in;
+}
+
+void ac_out_ext_options_key_prefix(ac_out_ext_options_t *h,
+                                   ac_io_key_prefix_f key_prefix, void *arg) {
+  h->key_prefix = key_prefix;
+  h->key_prefix_arg = arg;
+}
+
+void ac_out_ext_options_replacement_selection(ac_out_ext_options_t *h) {
+  h->replacement_selection = true;
+}
+
+void ac_out_ext_options_limit(ac_out_ext_options_t *h, size_t limit) {
+  h->limit = limit;
+}
+
+void ac_out_ext_options_combine(ac_out_ext_options_t *h, ac_io_hash_f hash,
+                                void *arg) {
+  h->combine_hash = hash;
+  h->combine_hash_arg = arg;
+}
+
 void ac_out_ext_options_sort_before_partitioning(ac_out_ext_options_t *h) {
   h->sort_before_partitioning = true;
 }
@@ -526,6 +1196,19 @@ void ac_out_ext_options_partition(ac_out_ext_options_t *h,
   h->partition_arg = arg;
 }
 
+void ac_out_ext_options_range_partition(ac_out_ext_options_t *h,
+                                        size_t sample_size) {
+  h->partition = ac_io_range_partition;
+  h->partition_arg = NULL;
+  h->range_sample_size = sample_size ? sample_size : 1;
+}
+
+void ac_out_ext_options_skew(ac_out_ext_options_t *h, double threshold,
+                             size_t max_sub_partitions) {
+  h->skew_threshold = threshold;
+  h->max_sub_partitions = max_sub_partitions;
+}
+
 void ac_out_ext_options_num_partitions(ac_out_ext_options_t *h,
                                        size_t num_partitions) {
   h->num_partitions = num_partitions;
@@ -585,6 +1268,12 @@ void ac_out_ext_options_fixed_sort(ac_out_ext_options_t *h,
   h->fixed_sort_arg = arg;
 }
 
+void ac_out_ext_options_fixed_key(ac_out_ext_options_t *h, size_t offset,
+                                  size_t width) {
+  h->fixed_key_offset = offset;
+  h->fixed_key_width = width;
+}
+
 bool _ac_out_write_prefix(ac_out_t *h, const void *d, size_t len) {
   uint32_t length = len;
   if (!ac_out_write(h, &length, sizeof(length)) || !ac_out_write(h, d, length))
@@ -611,6 +1300,144 @@ static bool _ac_out_write_fixed(ac_out_t *h, const void *d, size_t len) {
   return ac_out_write(h, d, len);
 }
 
+/* keeps the first record at or after next_key (and its offset) in the key
+   index */
+static bool write_indexed_record(ac_out_t *h, const void *d, size_t len) {
+  if (h->key_offset >= h->next_key) {
+    ac_out_key_index_entry_t entry;
+    entry.offset = h->key_offset;
+    entry.block_offset = h->key_offset;
+    entry.block_pos = 0;
+    entry.length = len;
+    entry.key = ac_buffer_length(h->keys);
+    ac_buffer_append(h->key_entries, &entry, sizeof(entry));
+    ac_buffer_append(h->keys, d, len);
+    ac_buffer_appendc(h->keys, 0);
+    h->next_key = h->key_offset + h->options.key_index;
+  }
+  if (h->options.format < 0)
+    h->key_offset += len + 1;
+  else if (h->options.format > 0)
+    h->key_offset += h->fixed;
+  else
+    h->key_offset += len + sizeof(uint32_t);
+  return h->indexed_write_record(h, d, len);
+}
+
+/* Every lz4 block except the last holds block_size bytes, so the block of an
+   entry is found from its offset.  The compressed file is scanned to find
+   where each block starts. */
+static bool find_lz4_blocks(ac_out_t *h, ac_out_key_index_entry_t *entries,
+                            size_t num_entries) {
+  int fd = open(h->filename, O_RDONLY);
+  if (fd == -1)
+    return false;
+  char header[7];
+  ac_lz4_header_t lz4;
+  bool ok =
+      pread(fd, header, 7, 0) == 7 && ac_lz4_check_header(&lz4, header, 7);
+  uint64_t pos = 7;
+  uint64_t block = 0;
+  for (size_t i = 0; ok && i < num_entries; i++) {
+    ac_out_key_index_entry_t *e = entries + i;
+    while (block < e->offset / h->buffer_size) {
+      uint32_t length;
+      if (pread(fd, &length, sizeof(length), pos) != sizeof(length) ||
+          !(length & 0x7FFFFFFF)) {
+        ok = false;
+        break;
+      }
+      pos += sizeof(length) + (length & 0x7FFFFFFF);
+      if (lz4.block_checksum)
+        pos += sizeof(uint32_t);
+      block++;
+    }
+    e->block_offset = pos;
+    e->block_pos = e->offset % h->buffer_size;
+  }
+  close(fd);
+  return ok;
+}
+
+static void write_key_index(ac_out_t *h) {
+  ac_out_key_index_entry_t *entries =
+      (ac_out_key_index_entry_t *)ac_buffer_data(h->key_entries);
+  size_t num_entries = ac_buffer_length(h->key_entries) / sizeof(*entries);
+
+  char *filename = ac_malloc(strlen(h->filename) + 6);
+  sprintf(filename, "%s.keys", h->filename);
+  if (ac_io_extension(h->filename, "lz4") &&
+      !find_lz4_blocks(h, entries, num_entries)) {
+    remove(filename);
+    ac_free(filename);
+    return;
+  }
+
+  ac_out_key_index_header_t header;
+  memcpy(header.magic, AC_OUT_KEY_INDEX_MAGIC, sizeof(header.magic));
+  header.num_keys = num_entries;
+  if (!ac_io_file_stamp(h->filename, &header.size, &header.modified)) {
+    ac_free(filename);
+    return;
+  }
+  FILE *out = fopen(filename, "wb");
+  if (out) {
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    if (num_entries)
+      ok = ok && fwrite(entries, sizeof(*entries), num_entries, out) ==
+                     num_entries;
+    if (ac_buffer_length(h->keys))
+      ok = ok && fwrite(ac_buffer_data(h->keys), ac_buffer_length(h->keys),
+                        1, out) == 1;
+    if (fclose(out) || !ok)
+      remove(filename);
+  }
+  ac_free(filename);
+}
+
+static bool write_bloom_record(ac_out_t *h, const void *d, size_t len) {
+  ac_io_record_t r;
+  r.record = (char *)d;
+  r.length = len;
+  r.tag = 0;
+  uint64_t hash = h->options.bloom_hash(&r, h->options.bloom_hash_arg);
+  size_t num_hashes = ac_buffer_length(h->bloom_hashes) / sizeof(hash);
+  if (!num_hashes ||
+      ((uint64_t *)ac_buffer_data(h->bloom_hashes))[num_hashes - 1] != hash)
+    ac_buffer_append(h->bloom_hashes, &hash, sizeof(hash));
+  return h->bloom_write_record(h, d, len);
+}
+
+static void write_bloom_filter(ac_out_t *h) {
+  uint64_t *hashes = (uint64_t *)ac_buffer_data(h->bloom_hashes);
+  size_t num_hashes = ac_buffer_length(h->bloom_hashes) / sizeof(uint64_t);
+  ac_io_bloom_write(h->filename, hashes, num_hashes,
+                    h->options.bloom_bits_per_key);
+}
+
+/* sidecars from an earlier version of the file are removed when it is opened,
+   and new ones are written when the output is destroyed */
+static void remove_sidecars(const char *filename) {
+  char *name = ac_malloc(strlen(filename) + 7);
+  sprintf(name, "%s.keys", filename);
+  remove(name);
+  sprintf(name, "%s.bloom", filename);
+  remove(name);
+  ac_free(name);
+}
+
+static void destroy_sidecars(ac_out_t *h) {
+  if (h->key_entries) {
+    ac_buffer_destroy(h->key_entries);
+    ac_buffer_destroy(h->keys);
+    h->key_entries = h->keys = NULL;
+  }
+  if (h->bloom_hashes) {
+    ac_buffer_destroy(h->bloom_hashes);
+    h->bloom_hashes = NULL;
+  }
+}
+
 bool ac_out_write_delimiter(ac_out_t *h, const void *d, size_t len,
                             char delim) {
   if (h->type)
@@ -646,6 +1473,8 @@ ac_out_t *_ac_out_init_(const char *filename, int fd, bool fd_owner,
     h = _ac_out_init(filename, fd, fd_owner, options);
 
   if (h) {
+    if (h->filename)
+      remove_sidecars(h->filename);
     if (options->format < 0) {
       int delim = (-options->format) - 1;
       h->delimiter = delim;
@@ -655,6 +1484,18 @@ ac_out_t *_ac_out_init_(const char *filename, int fd, bool fd_owner,
       h->write_record = _ac_out_write_fixed;
     } else
       h->write_record = _ac_out_write_prefix;
+    if (options->key_index && h->filename && !options->append_mode) {
+      h->key_entries = ac_buffer_init(16 * sizeof(ac_out_key_index_entry_t));
+      h->keys = ac_buffer_init(1024);
+      h->indexed_write_record = h->write_record;
+      h->write_record = write_indexed_record;
+    }
+    if (options->bloom_hash && h->filename && !options->append_mode) {
+      h->bloom_hashes = ac_buffer_init(1024 * sizeof(uint64_t));
+      h->bloom_write_record = h->write_record;
+      h->write_record = write_bloom_record;
+    }
+    init_writes(h, NULL, options->io_uring);
   } else if (options->abort_on_error)
     abort();
   return h;
@@ -711,6 +1552,15 @@ static void ac_out_ext_destroy(ac_out_t *hp);
 
 void _ac_out_destroy(ac_out_t *h) {
   ac_out_flush(h);
+  finish_writes(h);
+  if (h->lz4_writer) {
+    lz4_writer_destroy(h->lz4_writer);
+    h->lz4_writer = NULL;
+  }
+  if (h->gz_writer) {
+    gz_writer_destroy(h->gz_writer);
+    h->gz_writer = NULL;
+  }
   if (h->fd > -1 && h->fd_owner) {
     close(h->fd);
     h->fd = -1;
@@ -732,7 +1582,8 @@ void remove_out(ac_out_t *h) {
   else
     remove(h->filename);
 
-  ac_free(h);
+  destroy_sidecars(h);
+  ac_io_buffer_free(h);
 }
 
 ac_in_t *ac_out_normal_in(ac_out_t *h) {
@@ -765,13 +1616,21 @@ void ac_out_destroy(ac_out_t *h) {
   if (h->options.safe_mode)
     rename(h->filename + strlen(h->filename) + 1, h->filename);
 
+  if (h->write_d) {
+    if (h->key_entries)
+      write_key_index(h);
+    if (h->bloom_hashes)
+      write_bloom_filter(h);
+  }
+  destroy_sidecars(h);
+
   if (h->options.write_ack_file) {
     strcat(h->filename, ".ack");
     FILE *out = fopen(h->filename, "wb");
     fclose(out);
   }
 
-  ac_free(h);
+  ac_io_buffer_free(h);
 }
 
 /** ac_out_ext functionality **/
@@ -804,6 +1663,28 @@ void ac_out_partition_filename(char *dest, const char *filename, size_t id) {
 }
 
 /** ac_out_partitioned_t **/
+typedef struct {
+  uint32_t id;
+  size_t size;
+} ac_out_run_t;
+
+/* a partition (or sub-partition) to sort after partitioning */
+typedef struct {
+  size_t partition;
+  size_t sub;
+  size_t size;
+} ac_out_part_task_t;
+
+static inline int compare_part_tasks(const ac_out_part_task_t *a,
+                                     const ac_out_part_task_t *b) {
+  /* largest first so that the biggest sorts don't start last */
+  if (a->size != b->size)
+    return (a->size > b->size) ? -1 : 1;
+  return 0;
+}
+
+ac_sort_m(sort_part_tasks, ac_out_part_task_t, compare_part_tasks);
+
 typedef struct {
   int type;
   ac_out_options_t options;
@@ -823,12 +1704,107 @@ typedef struct {
   ac_io_partition_f partition;
   void *partition_arg;
 
-  size_t *tasks;
-  size_t *taskp;
-  size_t *taskep;
+  /* range partitioning (see ac_out_ext_options_range_partition).  The first
+     records are held in sample_bh until the split points are chosen. */
+  ac_io_range_partition_t *range;
+  ac_buffer_t *range_bh;
+  ac_buffer_t *sample_bh;
+  size_t num_sampled;
+
+  /* per partition counts and the size of the current sub-partition */
+  ac_out_partition_stats_t *stats;
+  size_t *sub_bytes;
+  size_t total_bytes;
+  size_t min_sub_bytes;
+
+  /* the ring shared by the partitions' writes (see ac_out_options_io_uring) */
+  ac_io_uring_t *uring;
+
+  ac_out_part_task_t *tasks;
+  ac_out_part_task_t *taskp;
+  ac_out_part_task_t *taskep;
+  /* the number of sub-partitions of each partition which are still being
+     sorted (the thread which sorts the last one merges them) */
+  size_t *subs_left;
   pthread_mutex_t mutex;
 } ac_out_partitioned_t;
 
+/* The unsorted data of sub-partition 0 keeps the name of an unsorted
+   partition.  Sorted sub-partitions are merged into the partition's file. */
+static void unsorted_filename(char *dest, ac_out_partitioned_t *h,
+                              size_t partition, size_t sub) {
+  char extra[40];
+  if (sub)
+    sprintf(extra, "unsorted_%lu", sub);
+  else
+    strcpy(extra, "unsorted");
+  suffix_filename_with_id(dest, h->filename, partition, extra,
+                          h->ext_options.lz4_tmp);
+}
+
+static void sorted_sub_filename(char *dest, ac_out_partitioned_t *h,
+                                size_t partition, size_t sub) {
+  char extra[40];
+  sprintf(extra, "sorted_%lu", sub);
+  suffix_filename_with_id(dest, h->filename, partition, extra,
+                          h->ext_options.lz4_tmp);
+}
+
+static void mark_skewed_partitions(ac_out_partitioned_t *h) {
+  double limit =
+      h->ext_options.skew_threshold * h->total_bytes / h->num_partitions;
+  for (size_t i = 0; i < h->num_partitions; i++)
+    h->stats[i].skewed = h->stats[i].num_bytes > limit;
+}
+
+ac_out_partition_stats_t *ac_out_partition_stats(ac_out_t *hp,
+                                                 size_t *num_partitions) {
+  if (hp->type != AC_OUT_PARTITIONED_TYPE)
+    return NULL;
+  ac_out_partitioned_t *h = (ac_out_partitioned_t *)hp;
+  mark_skewed_partitions(h);
+  *num_partitions = h->num_partitions;
+  return h->stats;
+}
+
+/* partitions queue their writes on the shared ring, so the buffers of many
+   partitions which fill up together are submitted in one system call */
+static ac_out_t *partition_out_init(ac_out_partitioned_t *h, ac_out_t *out) {
+  if (out && h->uring && out->type == AC_OUT_NORMAL_TYPE)
+    init_writes(out, h->uring, h->options.io_uring);
+  return out;
+}
+
+/* close the current unsorted file of the partition and start another */
+static void start_sub_partition(ac_out_partitioned_t *h, size_t partition) {
+  ac_out_destroy(h->partitions[partition]);
+  size_t sub = h->stats[partition].num_sub_partitions;
+  char *tmp_name = (char *)ac_malloc(strlen(h->filename) + 60);
+  unsorted_filename(tmp_name, h, partition, sub);
+  h->partitions[partition] =
+      partition_out_init(h, ac_out_init(tmp_name, &(h->part_options)));
+  ac_free(tmp_name);
+  h->stats[partition].num_sub_partitions++;
+  h->sub_bytes[partition] = 0;
+}
+
+static void finish_range_sample(ac_out_partitioned_t *h) {
+  ac_io_range_partition_split(h->range, h->num_partitions);
+
+  ac_buffer_t *bh = h->sample_bh;
+  h->sample_bh = NULL;
+  char *p = ac_buffer_data(bh);
+  char *ep = p + ac_buffer_length(bh);
+  while (p < ep) {
+    uint32_t length = *(uint32_t *)p;
+    p += sizeof(length);
+    ac_out_t *out = (ac_out_t *)h;
+    out->write_record(out, p, length);
+    p += length + 1;
+  }
+  ac_buffer_destroy(bh);
+}
+
 bool write_partitioned_record(ac_out_t *hp, const void *d, size_t len) {
   ac_out_partitioned_t *h = (ac_out_partitioned_t *)hp;
 
@@ -837,10 +1813,41 @@ bool write_partitioned_record(ac_out_t *hp, const void *d, size_t len) {
   r.record = (char *)d;
   r.tag = 0;
 
-  size_t partition = h->partition(&r, h->num_partitions, h->partition_arg);
+  if (h->range) {
+    /* compare functions expect zero terminated records */
+    ac_buffer_set(h->range_bh, d, len);
+    r.record = ac_buffer_data(h->range_bh);
+    if (h->sample_bh) {
+      ac_io_range_partition_sample(h->range, &r);
+      uint32_t length = len;
+      ac_buffer_append(h->sample_bh, &length, sizeof(length));
+      ac_buffer_append(h->sample_bh, d, len);
+      ac_buffer_appendc(h->sample_bh, 0);
+      h->num_sampled++;
+      if (h->num_sampled >= h->ext_options.range_sample_size)
+        finish_range_sample(h);
+      return true;
+    }
+  }
+
+  size_t partition = h->partition(&r, h->num_partitions, h->partition_arg);
   if (partition >= h->num_partitions)
     return false;
 
+  ac_out_partition_stats_t *stats = h->stats + partition;
+  stats->num_records++;
+  stats->num_bytes += len;
+  h->total_bytes += len;
+  if (h->sub_bytes) {
+    size_t sub_bytes = h->sub_bytes[partition] + len;
+    h->sub_bytes[partition] = sub_bytes;
+    if (sub_bytes > h->min_sub_bytes &&
+        stats->num_sub_partitions < h->ext_options.max_sub_partitions &&
+        sub_bytes > h->ext_options.skew_threshold * h->total_bytes /
+                        h->num_partitions)
+      start_sub_partition(h, partition);
+  }
+
   ac_out_t *o = h->partitions[partition];
   return o->write_record(o, d, len);
 }
@@ -870,19 +1877,42 @@ ac_out_t *ac_out_partitioned_init(const char *filename,
     if (!filename)
       abort();
 
-    ac_out_partitioned_t *h = (ac_out_partitioned_t *)ac_malloc(
+    ac_out_partitioned_t *h = (ac_out_partitioned_t *)ac_calloc(
         sizeof(ac_out_partitioned_t) + strlen(filename) + 1 +
-        (sizeof(ac_out_t *) * ext_options->num_partitions));
+        (sizeof(ac_out_t *) * ext_options->num_partitions) +
+        (sizeof(ac_out_partition_stats_t) * ext_options->num_partitions));
     h->options = *options;
     h->part_options = *options;
     h->ext_options = *ext_options;
     h->ext_part_options = *ext_options;
     h->partitions = (ac_out_t **)(h + 1);
     h->num_partitions = ext_options->num_partitions;
-    h->filename = (char *)(h->partitions + ext_options->num_partitions);
+    h->stats = (ac_out_partition_stats_t *)(h->partitions +
+                                            ext_options->num_partitions);
+    h->filename = (char *)(h->stats + ext_options->num_partitions);
     strcpy(h->filename, filename);
+    for (size_t i = 0; i < h->num_partitions; i++)
+      h->stats[i].num_sub_partitions = 1;
     h->partition = ext_options->partition;
     h->partition_arg = ext_options->partition_arg;
+    h->range = NULL;
+    h->sample_bh = NULL;
+    if (h->partition == ac_io_range_partition && !h->partition_arg) {
+      ac_io_compare_f compare = ext_options->compare;
+      void *compare_arg = ext_options->compare_arg;
+      if (!compare) {
+        compare = ext_options->int_compare;
+        compare_arg = ext_options->int_compare_arg;
+      }
+      if (!compare)
+        abort();
+      size_t sample_size = ext_options->range_sample_size;
+      h->range = ac_io_range_partition_init(compare, compare_arg, sample_size);
+      h->partition_arg = h->range;
+      h->range_bh = ac_buffer_init(256);
+      h->sample_bh = ac_buffer_init(16 * 1024);
+      h->num_sampled = 0;
+    }
 
     h->part_options.buffer_size = options->buffer_size / h->num_partitions;
     h->ext_part_options.partition = NULL;
@@ -892,17 +1922,40 @@ ac_out_t *ac_out_partitioned_init(const char *filename,
       h->part_options.write_ack_file = false;
     }
 
+    /* unsorted partitions are sorted into the final files afterwards */
+    if (!h->ext_options.sort_while_partitioning && h->ext_options.compare) {
+      h->part_options.key_index = 0;
+      h->part_options.bloom_hash = NULL;
+    }
+
+    /* skewed partitions are only split if they are sorted afterwards */
+    if (!h->ext_options.sort_while_partitioning && h->ext_options.compare &&
+        h->ext_options.max_sub_partitions > 1) {
+      h->sub_bytes = (size_t *)ac_calloc(sizeof(size_t) * h->num_partitions);
+      h->min_sub_bytes = h->part_options.buffer_size;
+    }
+
+    /* sorted partitions write (and merge) on their own rings */
+    if (options->io_uring && !h->ext_options.sort_while_partitioning) {
+      size_t entries = h->num_partitions * options->io_uring;
+      h->uring = ac_io_uring_init(entries < 4096 ? entries : 4096);
+      if (h->uring)
+        h->part_options.io_uring = 0;
+    }
+
     char *tmp_name = (char *)ac_malloc(strlen(filename) + 40);
     for (size_t i = 0; i < h->num_partitions; i++) {
       // printf("%s\n", tmp_name);
       if (h->ext_options.sort_while_partitioning || !h->ext_options.compare) {
         suffix_filename_with_id(tmp_name, filename, i, NULL, false);
-        h->partitions[i] = ac_out_ext_init(tmp_name, &(h->part_options),
-                                           &(h->ext_part_options));
+        h->partitions[i] = partition_out_init(
+            h, ac_out_ext_init(tmp_name, &(h->part_options),
+                               &(h->ext_part_options)));
       } else {
         suffix_filename_with_id(tmp_name, filename, i, "unsorted",
                                 h->ext_options.lz4_tmp);
-        h->partitions[i] = ac_out_init(tmp_name, &(h->part_options));
+        h->partitions[i] =
+            partition_out_init(h, ac_out_init(tmp_name, &(h->part_options)));
       }
     }
     h->write_record = write_partitioned_record;
@@ -912,30 +1965,83 @@ ac_out_t *ac_out_partitioned_init(const char *filename,
   }
 }
 
+/* merge the sorted sub-partitions of a skewed partition into its file */
+static void merge_sub_partitions(ac_out_partitioned_t *h, size_t partition,
+                                 char *tmp_name) {
+  ac_out_ext_options_t *eo = &(h->ext_part_options);
+  size_t num_sub = h->stats[partition].num_sub_partitions;
+  ac_in_options_t opts;
+  ac_in_options_init(&opts);
+  ac_in_options_buffer_size(&opts, h->in_options.buffer_size / num_sub);
+  ac_in_options_format(&opts, h->options.format);
+  ac_in_options_io_uring(&opts, h->options.io_uring);
+
+  ac_in_t *in = ac_in_ext_init(eo->compare, eo->compare_arg, &opts);
+  if (eo->reducer)
+    ac_in_ext_reducer(in, eo->reducer, eo->reducer_arg);
+  for (size_t i = 0; i < num_sub; i++) {
+    sorted_sub_filename(tmp_name, h, partition, i);
+    ac_in_t *sub = ac_in_init(tmp_name, &opts);
+    if (sub)
+      ac_in_ext_add(in, sub, 0);
+  }
+
+  suffix_filename_with_id(tmp_name, h->filename, partition, NULL, false);
+  ac_out_t *out = ac_out_init(tmp_name, &(h->part_options));
+  ac_io_record_t *r;
+  while ((r = ac_in_advance(in)) != NULL)
+    ac_out_write_record(out, r->record, r->length);
+  ac_out_destroy(out);
+  ac_in_destroy(in);
+
+  for (size_t i = 0; i < num_sub; i++) {
+    sorted_sub_filename(tmp_name, h, partition, i);
+    remove(tmp_name);
+  }
+}
+
 void *sort_partitions(void *arg) {
   ac_out_partitioned_t *h = (ac_out_partitioned_t *)arg;
   char *filename = h->filename;
-  char *tmp_name = (char *)ac_malloc(strlen(h->filename) + 40);
+  char *tmp_name = (char *)ac_malloc(strlen(h->filename) + 60);
 
   while (true) {
     pthread_mutex_lock(&h->mutex);
-    size_t *tp = h->taskp;
+    ac_out_part_task_t *tp = h->taskp;
     h->taskp++;
     pthread_mutex_unlock(&h->mutex);
     if (tp >= h->taskep)
       break;
 
-    suffix_filename_with_id(tmp_name, filename, *tp, "unsorted",
-                            h->ext_options.lz4_tmp);
+    unsorted_filename(tmp_name, h, tp->partition, tp->sub);
     ac_in_t *in = ac_in_init(tmp_name, &(h->in_options));
-    suffix_filename_with_id(tmp_name, filename, *tp, NULL, false);
+    /* sub-partitions are merged afterwards, so they aren't indexed */
+    ac_out_options_t options = h->part_options;
+    if (h->stats[tp->partition].num_sub_partitions > 1) {
+      sorted_sub_filename(tmp_name, h, tp->partition, tp->sub);
+      options.key_index = 0;
+      options.bloom_hash = NULL;
+    } else
+      suffix_filename_with_id(tmp_name, filename, tp->partition, NULL, false);
     ac_out_t *out =
-        ac_out_ext_init(tmp_name, &(h->part_options), &(h->ext_part_options));
+        ac_out_ext_init(tmp_name, &options, &(h->ext_part_options));
     ac_io_record_t *r;
     while ((r = ac_in_advance(in)) != NULL)
       ac_out_write_record(out, r->record, r->length);
     ac_out_destroy(out);
     ac_in_destroy(in);
+    unsorted_filename(tmp_name, h, tp->partition, tp->sub);
+    remove(tmp_name);
+
+    /* a skewed partition is merged once all of its sub-partitions are sorted,
+       while the other threads keep sorting */
+    if (h->stats[tp->partition].num_sub_partitions > 1) {
+      pthread_mutex_lock(&h->mutex);
+      bool last = --h->subs_left[tp->partition] == 0;
+      pthread_mutex_unlock(&h->mutex);
+      if (last)
+        merge_sub_partitions(h, tp->partition, tmp_name);
+    }
   }
   ac_free(tmp_name);
   return NULL;
@@ -943,33 +2049,66 @@ void *sort_partitions(void *arg) {
 
 void _ac_out_partitioned_destroy(ac_out_t *hp) {
   ac_out_partitioned_t *h = (ac_out_partitioned_t *)hp;
+  if (h->range) {
+    if (h->sample_bh)
+      finish_range_sample(h);
+    ac_io_range_partition_destroy(h->range);
+    ac_buffer_destroy(h->range_bh);
+    h->range = NULL;
+  }
   for (size_t i = 0; i < h->num_partitions; i++) {
     ac_out_destroy(h->partitions[i]);
   }
+  if (h->uring) {
+    ac_io_uring_destroy(h->uring);
+    h->uring = NULL;
+  }
+  mark_skewed_partitions(h);
   if (!h->ext_options.sort_while_partitioning && h->ext_options.compare) {
     /*  buffer_size memory, num_threads, input, output - prefer input
        because OS will buffer output.
       */
+    size_t num_tasks = 0;
+    for (size_t i = 0; i < h->num_partitions; i++)
+      num_tasks += h->stats[i].num_sub_partitions;
+
     size_t num_threads = h->ext_options.num_sort_threads;
     if (num_threads < 1)
       num_threads = 1;
-    if (num_threads > h->num_partitions)
-      num_threads = h->num_partitions;
+    if (num_threads > num_tasks)
+      num_threads = num_tasks;
 
     size_t buffer_size = h->options.buffer_size / (num_threads * 2);
 
     ac_out_options_buffer_size(&(h->part_options), buffer_size);
     ac_out_options_format(&(h->part_options), h->options.format);
+    h->part_options.key_index = h->options.key_index;
+    h->part_options.bloom_hash = h->options.bloom_hash;
+    h->part_options.io_uring = h->options.io_uring;
     h->ext_part_options.use_extra_thread = false;
     ac_in_options_init(&(h->in_options));
     ac_in_options_buffer_size(&(h->in_options), buffer_size);
     ac_in_options_format(&(h->in_options), ac_io_prefix());
+    ac_in_options_io_uring(&(h->in_options), h->options.io_uring);
 
-    h->tasks = (size_t *)ac_malloc(sizeof(size_t) * h->num_partitions);
+    h->tasks = (ac_out_part_task_t *)ac_malloc(sizeof(ac_out_part_task_t) *
+                                               num_tasks);
     h->taskp = h->tasks;
-    h->taskep = h->tasks + h->num_partitions;
+    h->taskep = h->tasks + num_tasks;
+    for (size_t i = 0; i < h->num_partitions; i++) {
+      size_t num_sub = h->stats[i].num_sub_partitions;
+      for (size_t j = 0; j < num_sub; j++) {
+        h->taskp->partition = i;
+        h->taskp->sub = j;
+        h->taskp->size = h->stats[i].num_bytes / num_sub;
+        h->taskp++;
+      }
+    }
+    h->taskp = h->tasks;
+    sort_part_tasks(h->tasks, num_tasks);
+    h->subs_left = (size_t *)ac_malloc(sizeof(size_t) * h->num_partitions);
     for (size_t i = 0; i < h->num_partitions; i++)
-      h->tasks[i] = i;
+      h->subs_left[i] = h->stats[i].num_sub_partitions;
 
     pthread_mutex_init(&h->mutex, NULL);
     pthread_t *threads =
@@ -979,17 +2118,14 @@ void _ac_out_partitioned_destroy(ac_out_t *hp) {
     for (size_t i = 0; i < num_threads; i++)
       pthread_join(threads[i], NULL);
     pthread_mutex_destroy(&h->mutex);
+    ac_free(h->subs_left);
+    h->subs_left = NULL;
     ac_free(h->tasks);
     ac_free(threads);
-    char *filename = h->filename;
-    char *tmp_name = (char *)ac_malloc(strlen(h->filename) + 40);
-    for (size_t i = 0; i < h->num_partitions; i++) {
-      suffix_filename_with_id(tmp_name, filename, i, "unsorted",
-                              h->ext_options.lz4_tmp);
-      remove(tmp_name);
-    }
-    ac_free(tmp_name);
   }
+  if (h->sub_bytes)
+    ac_free(h->sub_bytes);
+  h->sub_bytes = NULL;
 }
 
 ac_in_t *ac_out_partitioned_in(ac_out_t *hp) {
@@ -1012,6 +2148,8 @@ typedef struct {
   char *ep;
   size_t num_records;
   size_t size;
+  /* the number of ascending runs in the records (0 if it isn't known) */
+  size_t num_runs;
 } ac_out_buffer_t;
 
 const int EXTRA_IN = 0;
@@ -1043,18 +2181,68 @@ typedef struct {
   size_t num_written;
   size_t num_group_written;
 
+  /* pipelined run generation (see ac_out_ext_options_pipeline) */
+  ac_out_buffer_t *buffers;
+  size_t num_buffers;
+  ac_out_buffer_t **free_buffers;
+  size_t num_free;
+  ac_out_buffer_t **full_buffers;
+  size_t full_head;
+  size_t num_full;
+  pthread_t *sort_threads;
+  bool pipeline_done;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /* hash aggregation (see ac_out_ext_options_combine).  Each slot holds a
+     32 bit hash and one more than the index of the record in h->b (zero is an
+     empty slot). */
+  uint64_t *combine_slots;
+  size_t combine_mask;
+  size_t num_dropped;
+  ac_buffer_t *combine_bh;
+
+  /* the records kept when a full buffer is limited (see
+     ac_out_ext_options_limit) and whether runs are written instead */
+  ac_buffer_t *limit_bh;
+  bool limit_spill;
+
+  /* replacement selection (see ac_out_ext_options_replacement_selection).
+     The buffer holds a heap of rs_item_t instead of the record array. */
+  bool replacement;
+  uint32_t rs_run;
+  ac_out_t *rs_out;
+  uint32_t rs_id;
+  ac_buffer_t *rs_last_bh;
+  ac_buffer_t *rs_pending_bh;
+  ac_buffer_t *rs_group_bh;
+  ac_buffer_t *rs_reducer_bh;
+
+  /* the tmp files which are waiting to be merged */
+  ac_out_run_t *runs;
+  size_t num_runs;
+  size_t max_runs;
+  size_t fan_in;
+
   bool thread_started;
   pthread_t thread;
   bool out_in_called;
   extra_t *extras;
 
   int tag;
+  uint32_t fixed;
+  bool packed;
 
   ac_out_ext_options_t ext_options;
   ac_out_ext_options_t partition_options;
 } ac_out_sorted_t;
 
 bool write_sorted_record(ac_out_t *hp, const void *d, size_t len);
+bool write_prefixed_sorted_record(ac_out_t *hp, const void *d, size_t len);
+bool write_fixed_sorted_record(ac_out_t *hp, const void *d, size_t len);
+bool write_combined_sorted_record(ac_out_t *hp, const void *d, size_t len);
+bool write_replacement_sorted_record(ac_out_t *hp, const void *d, size_t len);
+static void combine_finish(ac_out_sorted_t *h);
 
 static void _extra_add(ac_out_t *hp, void *p, int type) {
   ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
@@ -1095,28 +2283,275 @@ static void group_tmp_filename(char *dest, const char *filename, uint32_t n,
   sprintf(dest, "%s_%u_gtmp%s", filename, n, suffix);
 }
 
+/* tmp files for fixed length records are written without a length prefix */
+static inline ac_io_format_t tmp_format(ac_out_sorted_t *h) {
+  return h->fixed ? ac_io_fixed(h->fixed) : ac_io_prefix();
+}
+
 static inline void clear_buffer(ac_out_buffer_t *b) {
   b->bp = b->buffer;
   b->ep = b->bp + b->size;
   b->num_records = 0;
+  b->num_runs = 0;
 }
 
 static inline void init_buffer(ac_out_buffer_t *b, size_t buffer_size) {
-  b->buffer = (char *)ac_malloc(buffer_size);
+  b->buffer = (char *)ac_io_buffer_alloc(buffer_size);
   b->size = buffer_size;
   clear_buffer(b);
 }
 
+/* Each input of a merge gets at least this much of the buffer_size for reading
+   (the block size of the tmp files), small buffer sizes still allow a modest
+   fan in, and a few file descriptors are left for everything else. */
+static const size_t MIN_MERGE_BUFFER_SIZE = 64 * 1024;
+static const size_t MIN_FAN_IN = 16;
+static const size_t RESERVED_FDS = 64;
+
+/* The number of tmp files which can be merged at once is limited by the memory
+   (the buffer_size which comes from ac_worker_ram when scheduled) and by the
+   file descriptor limit. */
+static size_t merge_fan_in(ac_out_sorted_t *h) {
+  size_t min_buffer_size = MIN_MERGE_BUFFER_SIZE;
+  if (h->ext_options.lz4_tmp)
+    min_buffer_size *= 2;
+  size_t fan_in = h->options.buffer_size / min_buffer_size;
+  if (fan_in < MIN_FAN_IN)
+    fan_in = MIN_FAN_IN;
+
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY) {
+    size_t fds = rl.rlim_cur;
+    fds = fds > RESERVED_FDS * 2 ? fds - RESERVED_FDS : fds / 2;
+    if (fan_in > fds)
+      fan_in = fds;
+  }
+  if (h->ext_options.max_fan_in && fan_in > h->ext_options.max_fan_in)
+    fan_in = h->ext_options.max_fan_in;
+  if (fan_in < 2)
+    fan_in = 2;
+  return fan_in;
+}
+
+/* split the buffer_size evenly across the inputs of a merge */
+static size_t merge_buffer_size(ac_out_sorted_t *h, size_t num_inputs) {
+  size_t buffer_size = h->options.buffer_size / (num_inputs ? num_inputs : 1);
+  if (h->ext_options.lz4_tmp)
+    buffer_size /= 2;
+  if (h->options.io_uring)
+    buffer_size /= h->options.io_uring + 1;
+  if (buffer_size < MIN_MERGE_BUFFER_SIZE)
+    buffer_size = MIN_MERGE_BUFFER_SIZE;
+  return buffer_size;
+}
+
+/* a run buffer is only split across threads if each thread gets at least this
+   many records to sort */
+static const size_t MIN_RECORDS_PER_SORT_THREAD = 16384;
+
+typedef struct {
+  ac_io_record_t *r;
+  ac_io_prefix_record_t *pr;
+  size_t num_r;
+  ac_io_compare_f compare;
+  void *arg;
+} sort_piece_t;
+
+static void *sort_piece(void *arg) {
+  sort_piece_t *p = (sort_piece_t *)arg;
+  if (p->pr)
+    ac_io_sort_prefix_records(p->pr, p->num_r, p->compare, p->arg);
+  else
+    ac_io_sort_records(p->r, p->num_r, p->compare, p->arg);
+  return NULL;
+}
+
+/* The record array is written with key prefixes.  Once sorted, the prefixes
+   are dropped so the records can be used as a plain ac_io_record_t array.
+   The array shrinks, so copying from the front is safe. */
+static ac_io_record_t *strip_prefixes(ac_io_prefix_record_t *pr,
+                                      size_t num_r) {
+  ac_io_record_t *r = (ac_io_record_t *)pr;
+  for (size_t i = 0; i < num_r; i++)
+    r[i] = pr[i].r;
+  return r;
+}
+
+static ac_in_t *_merge_init(ac_out_sorted_t *h, ac_io_compare_f compare,
+                            void *compare_arg, ac_io_reducer_f reducer,
+                            void *reducer_arg, ac_in_options_t *opts) {
+  ac_in_t *in = ac_in_ext_init(compare, compare_arg, opts);
+  if (h->ext_options.key_prefix)
+    ac_in_ext_key_prefix(in, h->ext_options.key_prefix,
+                         h->ext_options.key_prefix_arg);
+  if (reducer)
+    ac_in_ext_reducer(in, reducer, reducer_arg);
+  return in;
+}
+
+/* Sort the records as num_threads pieces in parallel and return a cursor which
+   merges the sorted pieces. */
+static ac_in_t *_in_from_pieces(ac_out_sorted_t *h, void *records,
+                                size_t num_r, size_t num_threads) {
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  sort_piece_t *pieces =
+      (sort_piece_t *)ac_malloc(num_threads * sizeof(sort_piece_t));
+  pthread_t *threads =
+      (pthread_t *)ac_malloc(num_threads * sizeof(pthread_t));
+  size_t per_thread = num_r / num_threads;
+  ac_io_prefix_record_t *pr =
+      eo->key_prefix ? (ac_io_prefix_record_t *)records : NULL;
+  for (size_t i = 0; i < num_threads; i++) {
+    pieces[i].r = (ac_io_record_t *)records + (i * per_thread);
+    pieces[i].pr = pr ? pr + (i * per_thread) : NULL;
+    pieces[i].num_r = per_thread;
+    pieces[i].compare = eo->int_compare;
+    pieces[i].arg = eo->int_compare_arg;
+  }
+  pieces[num_threads - 1].num_r += num_r % num_threads;
+
+  for (size_t i = 1; i < num_threads; i++)
+    pthread_create(threads + i, NULL, sort_piece, pieces + i);
+  sort_piece(pieces);
+  for (size_t i = 1; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  if (pr)
+    strip_prefixes(pr, num_r);
+
+  ac_in_t *in = _merge_init(h, eo->int_compare, eo->int_compare_arg,
+                            eo->int_reducer, eo->int_reducer_arg,
+                            &(h->file_options));
+  for (size_t i = 0; i < num_threads; i++)
+    ac_in_ext_add(in,
+                  ac_in_records_init(pieces[i].r, pieces[i].num_r,
+                                     &(h->file_options)),
+                  h->tag);
+
+  ac_free(threads);
+  ac_free(pieces);
+  return in;
+}
+
+static inline bool fixed_equal(ac_out_sorted_t *h, char *a, char *b) {
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  if (eo->fixed_key_width)
+    return !memcmp(a + eo->fixed_key_offset, b + eo->fixed_key_offset,
+                   eo->fixed_key_width);
+  else if (eo->fixed_compare)
+    return !eo->fixed_compare(a, b, eo->fixed_compare_arg);
+
+  ac_io_record_t ra, rb;
+  ra.record = a;
+  ra.length = h->fixed;
+  ra.tag = h->tag;
+  rb = ra;
+  rb.record = b;
+  return !eo->int_compare(&ra, &rb, eo->int_compare_arg);
+}
+
+/* apply the fixed reducer to each group of equal (and adjacent) records and
+   pack the results at the front of p.  Returns the new number of records. */
+static size_t reduce_fixed(ac_out_sorted_t *h, char *p, size_t num_r) {
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  size_t fixed = h->fixed;
+  char *ep = p + (num_r * fixed);
+  char *base = p;
+  char *wp = p;
+  while (p < ep) {
+    char *gp = p + fixed;
+    while (gp < ep && fixed_equal(h, p, gp))
+      gp += fixed;
+    if (eo->fixed_reducer(p, (gp - p) / fixed, eo->fixed_reducer_arg)) {
+      if (wp != p)
+        memcpy(wp, p, fixed);
+      wp += fixed;
+    }
+    p = gp;
+  }
+  return (wp - base) / fixed;
+}
+
+/* allows the fixed reducer to be used when merging tmp files */
+static bool fixed_reducer_adapter(ac_io_record_t *res, const ac_io_record_t *r,
+                                  size_t num_r, ac_buffer_t *bh, void *arg) {
+  ac_out_sorted_t *h = (ac_out_sorted_t *)arg;
+  size_t fixed = h->fixed;
+  char *d = (char *)ac_buffer_alloc(bh, (num_r * fixed) + 1);
+  for (size_t i = 0; i < num_r; i++)
+    memcpy(d + (i * fixed), r[i].record, fixed);
+  d[num_r * fixed] = 0;
+  if (!h->ext_options.fixed_reducer(d, num_r, h->ext_options.fixed_reducer_arg))
+    return false;
+  d[fixed] = 0;
+  *res = r[0];
+  res->record = d;
+  return true;
+}
+
+static ac_in_t *_in_from_fixed_buffer(ac_out_sorted_t *h, ac_out_buffer_t *b) {
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  char *p = b->buffer;
+  size_t num_r = b->num_records;
+  clear_buffer(b);
+
+  if (eo->fixed_sort)
+    eo->fixed_sort(p, num_r);
+  else
+    ac_io_radix_sort(p, num_r, h->fixed, eo->fixed_key_offset,
+                     eo->fixed_key_width);
+
+  ac_in_options_t opts;
+  ac_in_options_init(&opts);
+  ac_in_options_format(&opts, ac_io_fixed(h->fixed));
+  ac_in_options_tag(&opts, h->tag);
+  if (eo->fixed_reducer)
+    num_r = reduce_fixed(h, p, num_r);
+  else if (eo->int_reducer)
+    ac_in_options_reducer(&opts, eo->int_compare, eo->int_compare_arg,
+                          eo->int_reducer, eo->int_reducer_arg);
+  if (!num_r)
+    return ac_in_empty();
+
+  /* the buffer always has a spare byte at the end for the zero terminator */
+  return ac_in_init_with_buffer(p, num_r * h->fixed, false, &opts);
+}
+
 static ac_in_t *_in_from_buffer(ac_out_sorted_t *h, ac_out_buffer_t *b) {
   if (!b->num_records)
     return NULL;
 
+  if (h->packed)
+    return _in_from_fixed_buffer(h, b);
+
   ac_io_record_t *r = (ac_io_record_t *)b->buffer;
   uint32_t num_r = b->num_records;
-  ac_io_sort_records(r, num_r, h->ext_options.int_compare,
-                     h->ext_options.int_compare_arg);
-
+  size_t num_runs = b->num_runs;
   clear_buffer(b);
+
+  /* the records were written in order (or in a few ordered runs) */
+  if (num_runs == 1)
+    return ac_in_records_init(r, num_r, &(h->file_options));
+  if (num_runs) {
+    ac_io_sort_runs(r, num_r, h->ext_options.int_compare,
+                    h->ext_options.int_compare_arg);
+    return ac_in_records_init(r, num_r, &(h->file_options));
+  }
+
+  size_t num_threads = h->ext_options.num_run_sort_threads;
+  if (num_threads > num_r / MIN_RECORDS_PER_SORT_THREAD)
+    num_threads = num_r / MIN_RECORDS_PER_SORT_THREAD;
+  if (num_threads > 1)
+    return _in_from_pieces(h, r, num_r, num_threads);
+
+  if (h->ext_options.key_prefix) {
+    ac_io_prefix_record_t *pr = (ac_io_prefix_record_t *)r;
+    ac_io_sort_prefix_records(pr, num_r, h->ext_options.int_compare,
+                              h->ext_options.int_compare_arg);
+    r = strip_prefixes(pr, num_r);
+  } else
+    ac_io_sort_records(r, num_r, h->ext_options.int_compare,
+                       h->ext_options.int_compare_arg);
   return ac_in_records_init(r, num_r, &(h->file_options));
 }
 
@@ -1152,6 +2587,35 @@ ac_out_t *ac_out_sorted_init(const char *filename, ac_out_options_t *options,
   h->partition_options.compare = NULL;
   h->options = *options;
 
+  /* fixed length records are packed in the buffer and sorted in place if
+     there is a way to sort them without the record array */
+  if (options->format > 0) {
+    h->fixed = options->format;
+    h->packed = ext_options->fixed_sort || ext_options->fixed_key_width;
+    if (!h->ext_options.reducer && ext_options->fixed_reducer) {
+      h->ext_options.reducer = fixed_reducer_adapter;
+      h->ext_options.reducer_arg = h;
+      if (!h->ext_options.int_reducer) {
+        h->ext_options.int_reducer = fixed_reducer_adapter;
+        h->ext_options.int_reducer_arg = h;
+      }
+    }
+  }
+  ext_options = &(h->ext_options);
+
+  /* replacement selection writes its own runs from a single buffer */
+  if (ext_options->replacement_selection && !h->packed) {
+    h->replacement = true;
+    ext_options->use_extra_thread = false;
+    ext_options->pipeline_buffers = 0;
+    ext_options->num_per_group = 0;
+    ext_options->key_prefix = NULL;
+  }
+
+  h->fan_in = merge_fan_in(h);
+  if (ext_options->num_per_group > h->fan_in)
+    ext_options->num_per_group = h->fan_in;
+
   ac_in_options_init(&(h->file_options));
   if (ext_options->int_reducer)
     ac_in_options_reducer(&(h->file_options), ext_options->int_compare,
@@ -1159,7 +2623,27 @@ ac_out_t *ac_out_sorted_init(const char *filename, ac_out_options_t *options,
                           ext_options->int_reducer,
                           ext_options->int_reducer_arg);
 
-  if (ext_options->use_extra_thread) {
+  if (ext_options->pipeline_buffers > 1) {
+    /* runs are merged by the planner, so groups are not needed */
+    ext_options->num_per_group = 0;
+    if (!ext_options->pipeline_sort_threads)
+      ext_options->pipeline_sort_threads = 1;
+    size_t num_buffers = ext_options->pipeline_buffers;
+    h->buffers = (ac_out_buffer_t *)ac_calloc(
+        (sizeof(ac_out_buffer_t) + (sizeof(ac_out_buffer_t *) * 2)) *
+        num_buffers);
+    h->free_buffers = (ac_out_buffer_t **)(h->buffers + num_buffers);
+    h->full_buffers = h->free_buffers + num_buffers;
+    h->num_buffers = num_buffers;
+    for (size_t i = 0; i < num_buffers; i++)
+      init_buffer(h->buffers + i, buffer_size / num_buffers);
+    for (size_t i = 1; i < num_buffers; i++)
+      h->free_buffers[h->num_free++] = h->buffers + i;
+    h->b = h->buffers;
+    h->b2 = h->buffers;
+    pthread_mutex_init(&h->mutex, NULL);
+    pthread_cond_init(&h->cond, NULL);
+  } else if (ext_options->use_extra_thread) {
     buffer_size /= 2;
     init_buffer(&h->buf1, buffer_size);
     init_buffer(&h->buf2, buffer_size);
@@ -1170,7 +2654,23 @@ ac_out_t *ac_out_sorted_init(const char *filename, ac_out_options_t *options,
     h->b = &(h->buf1);
     h->b2 = &(h->buf1);
   }
-  h->write_record = write_sorted_record;
+  if (ext_options->limit)
+    h->limit_bh = ac_buffer_init(1024);
+  if (h->packed)
+    h->write_record = write_fixed_sorted_record;
+  else if (h->replacement) {
+    h->rs_last_bh = ac_buffer_init(256);
+    h->rs_pending_bh = ac_buffer_init(256);
+    h->rs_group_bh = ac_buffer_init(256);
+    h->rs_reducer_bh = ac_buffer_init(256);
+    h->write_record = write_replacement_sorted_record;
+  } else if (ext_options->combine_hash && ext_options->int_reducer) {
+    h->combine_bh = ac_buffer_init(256);
+    h->write_record = write_combined_sorted_record;
+  } else if (ext_options->key_prefix)
+    h->write_record = write_prefixed_sorted_record;
+  else
+    h->write_record = write_sorted_record;
   return (ac_out_t *)h;
 }
 
@@ -1181,6 +2681,24 @@ static inline void wait_on_thread(ac_out_sorted_t *h) {
   }
 }
 
+static ac_out_t *tmp_out_init(ac_out_sorted_t *h, const char *filename) {
+  // allow output buffer to be supplied to ac_out_options...
+  // allow input buffer to be supplied as well
+  ac_out_options_t options;
+  ac_out_options_init(&options);
+  ac_out_options_format(&options, tmp_format(h));
+  /* the buffer is borrowed from the io buffer pool, so it is reused across
+     runs */
+  ac_out_options_buffer_size(&options, 10 * 1024 * 1024);
+  options.lz4_threads = h->ext_options.pipeline_compress_threads;
+  /* the queued writes share the memory of the buffer */
+  if (h->options.io_uring && !options.lz4_threads) {
+    options.io_uring = h->options.io_uring;
+    options.buffer_size /= options.io_uring + 1;
+  }
+  return ac_out_init(filename, &options);
+}
+
 ac_out_t *get_next_tmp(ac_out_sorted_t *h, bool tmp_only) {
   const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
   if (!tmp_only && h->ext_options.num_per_group) {
@@ -1191,14 +2709,101 @@ ac_out_t *get_next_tmp(ac_out_sorted_t *h, bool tmp_only) {
     tmp_filename(h->tmp_filename, h->filename, h->num_written, suffix);
     h->num_written++;
   }
-  // allow output buffer to be supplied to ac_out_options...
-  // allow input buffer to be supplied as well
-  ac_out_options_t options;
-  ac_out_options_init(&options);
-  ac_out_options_format(&options, ac_io_prefix());
-  /* reuse the same buffer? */
-  ac_out_options_buffer_size(&options, 10 * 1024 * 1024);
-  return ac_out_init(h->tmp_filename, &options);
+  return tmp_out_init(h, h->tmp_filename);
+}
+
+/* runs are kept ordered by size so that the smallest are merged first */
+static void add_run(ac_out_sorted_t *h, uint32_t id, size_t size) {
+  if (h->num_runs == h->max_runs) {
+    size_t max_runs = h->max_runs ? h->max_runs * 2 : 64;
+    ac_out_run_t *runs =
+        (ac_out_run_t *)ac_malloc(sizeof(ac_out_run_t) * max_runs);
+    if (h->num_runs)
+      memcpy(runs, h->runs, sizeof(ac_out_run_t) * h->num_runs);
+    if (h->runs)
+      ac_free(h->runs);
+    h->runs = runs;
+    h->max_runs = max_runs;
+  }
+  ac_out_run_t *p = h->runs + h->num_runs;
+  while (p > h->runs && p[-1].size > size) {
+    *p = p[-1];
+    p--;
+  }
+  p->id = id;
+  p->size = size;
+  h->num_runs++;
+}
+
+static size_t tmp_file_size(ac_out_sorted_t *h, char *dest, uint32_t id) {
+  tmp_filename(dest, h->filename, id, h->ext_options.lz4_tmp ? ".lz4" : "");
+  return ac_io_file_size(dest);
+}
+
+static void remove_runs(ac_out_sorted_t *h) {
+  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  for (size_t i = 0; i < h->num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, h->runs[i].id, suffix);
+    remove(h->tmp_filename);
+  }
+  h->num_runs = 0;
+}
+
+/* nothing after the first limit records can be part of the output, so runs
+   and merges stop reading there */
+static inline void limit_in(ac_out_sorted_t *h, ac_in_t *in) {
+  if (in && h->ext_options.limit)
+    ac_in_limit(in, h->ext_options.limit);
+}
+
+/* merge the num_runs smallest runs into a new run */
+static void merge_runs(ac_out_sorted_t *h, size_t num_runs) {
+  ac_out_t *out = get_next_tmp(h, true);
+  uint32_t id = h->num_written - 1;
+
+  ac_in_options_t opts;
+  ac_in_options_init(&opts);
+  ac_in_options_buffer_size(&opts, merge_buffer_size(h, num_runs));
+  ac_in_options_format(&opts, tmp_format(h));
+  ac_in_options_io_uring(&opts, h->options.io_uring);
+  ac_in_t *in = _merge_init(h, h->ext_options.compare,
+                            h->ext_options.compare_arg, h->ext_options.reducer,
+                            h->ext_options.reducer_arg, &opts);
+
+  const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
+  for (size_t i = 0; i < num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, h->runs[i].id, suffix);
+    ac_in_ext_add(in, ac_in_init(h->tmp_filename, &opts), i);
+  }
+  limit_in(h, in);
+  ac_io_record_t *r;
+  while ((r = ac_in_advance(in)) != NULL)
+    ac_out_write_record(out, r->record, r->length);
+
+  ac_out_destroy(out);
+  ac_in_destroy(in);
+
+  for (size_t i = 0; i < num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, h->runs[i].id, suffix);
+    remove(h->tmp_filename);
+  }
+  h->num_runs -= num_runs;
+  memmove(h->runs, h->runs + num_runs, sizeof(ac_out_run_t) * h->num_runs);
+  add_run(h, id, tmp_file_size(h, h->tmp_filename, id));
+}
+
+/* Merge the smallest runs until at most fan_in remain for the final merge.
+   The first merge takes just enough runs so that every later merge (including
+   the final one) has exactly fan_in inputs, which minimizes the number of
+   bytes rewritten (as with building a Huffman tree). */
+static void plan_merges(ac_out_sorted_t *h) {
+  size_t fan_in = h->fan_in;
+  if (h->num_runs <= fan_in)
+    return;
+
+  merge_runs(h, ((h->num_runs - 2) % (fan_in - 1)) + 2);
+  while (h->num_runs > fan_in)
+    merge_runs(h, fan_in);
 }
 
 void check_for_merge(ac_out_sorted_t *h) {
@@ -1207,20 +2812,24 @@ void check_for_merge(ac_out_sorted_t *h) {
     return;
 
   ac_out_t *out = get_next_tmp(h, true);
+  uint32_t id = h->num_written - 1;
 
   ac_in_options_t opts;
   ac_in_options_init(&opts);
-  ac_in_options_format(&opts, ac_io_prefix());
-  ac_in_t *in =
-      ac_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
-  if (h->ext_options.reducer)
-    ac_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
+  ac_in_options_buffer_size(&opts,
+                            merge_buffer_size(h, h->num_group_written));
+  ac_in_options_format(&opts, tmp_format(h));
+  ac_in_options_io_uring(&opts, h->options.io_uring);
+  ac_in_t *in = _merge_init(h, h->ext_options.compare,
+                            h->ext_options.compare_arg, h->ext_options.reducer,
+                            h->ext_options.reducer_arg, &opts);
 
   const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
   for (size_t i = 0; i < h->num_group_written; i++) {
     group_tmp_filename(h->tmp_filename, h->filename, i, suffix);
     ac_in_ext_add(in, ac_in_init(h->tmp_filename, &opts), 0);
   }
+  limit_in(h, in);
   ac_io_record_t *r;
   while ((r = ac_in_advance(in)) != NULL)
     ac_out_write_record(out, r->record, r->length);
@@ -1228,11 +2837,13 @@ void check_for_merge(ac_out_sorted_t *h) {
   ac_out_destroy(out);
   ac_in_destroy(in);
   h->num_group_written = 0;
+  add_run(h, id, tmp_file_size(h, h->tmp_filename, id));
 }
 
 void *write_sorted_thread(void *arg) {
   ac_out_sorted_t *h = (ac_out_sorted_t *)arg;
   ac_in_t *in = _in_from_buffer(h, h->b2);
+  limit_in(h, in);
   ac_out_t *out = get_next_tmp(h, false);
   ac_io_record_t *r;
   while ((r = ac_in_advance(in)) != NULL)
@@ -1242,12 +2853,428 @@ void *write_sorted_thread(void *arg) {
 
   if (h->ext_options.num_per_group)
     check_for_merge(h);
+  else
+    add_run(h, h->num_written - 1,
+            tmp_file_size(h, h->tmp_filename, h->num_written - 1));
+  return NULL;
+}
+
+/* Replacement selection keeps a heap of the buffered records ordered by run
+   and then by record.  When the buffer fills, the smallest records are
+   written to the current run until a quarter of the buffer is free (and the
+   remaining records are moved together).  A new record which is less than
+   the last record written belongs to the next run.  On random input, runs
+   are about 1.5 times as long as a sorted buffer (not the 2x of spilling one
+   record at a time, which would move the records together far more often),
+   and sorted input produces a single run. */
+typedef struct {
+  char *record;
+  uint32_t length;
+  uint32_t run;
+} rs_item_t;
+
+#define RS_SPILL_FRACTION 4
+
+static inline void rs_record(ac_out_sorted_t *h, ac_io_record_t *r,
+                             rs_item_t *item) {
+  r->record = item->record;
+  r->length = item->length;
+  r->tag = h->tag;
+}
+
+static inline int rs_compare(ac_out_sorted_t *h, rs_item_t *a, rs_item_t *b) {
+  if (a->run != b->run)
+    return (a->run < b->run) ? -1 : 1;
+  ac_io_record_t ra, rb;
+  rs_record(h, &ra, a);
+  rs_record(h, &rb, b);
+  return h->ext_options.int_compare(&ra, &rb, h->ext_options.int_compare_arg);
+}
+
+static void rs_sift_up(ac_out_sorted_t *h, rs_item_t *heap, size_t i) {
+  rs_item_t tmp = heap[i];
+  while (i) {
+    size_t parent = (i - 1) >> 1;
+    if (rs_compare(h, &tmp, heap + parent) >= 0)
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = tmp;
+}
+
+/* remove the top of the heap (num is the size after removal).  The hole is
+   moved to the bottom before the last item is placed, since the last item
+   almost always belongs near the bottom (this roughly halves the compares). */
+static void rs_pop(ac_out_sorted_t *h, rs_item_t *heap, size_t num) {
+  size_t i = 0;
+  while (true) {
+    size_t child = (i << 1) + 1;
+    if (child >= num)
+      break;
+    if (child + 1 < num && rs_compare(h, heap + child + 1, heap + child) < 0)
+      child++;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = heap[num];
+  rs_sift_up(h, heap, i);
+}
+
+/* Each record's data is followed by a 4 byte trailer which is the length of
+   the record, with the high bit set once the record has been written.  During
+   compaction the trailer of a remaining record is its index in the heap. */
+#define RS_TRAILER_SIZE sizeof(uint32_t)
+#define RS_WRITTEN 0x80000000U
+
+static inline void rs_set_trailer(rs_item_t *item, uint32_t v) {
+  memcpy(item->record + item->length + 1, &v, sizeof(v));
+}
+
+/* move the data of the remaining records to the end of the buffer.  The
+   records stay in the order they were written, so the heap is unchanged. */
+static void rs_compact(ac_out_sorted_t *h) {
+  ac_out_buffer_t *b = h->b;
+  rs_item_t *items = (rs_item_t *)b->buffer;
+  size_t num = b->num_records;
+  for (size_t i = 0; i < num; i++)
+    rs_set_trailer(items + i, i);
+
+  char *p = b->buffer + b->size;
+  char *dest = p;
+  while (p > b->ep) {
+    uint32_t v;
+    memcpy(&v, p - RS_TRAILER_SIZE, sizeof(v));
+    if (v & RS_WRITTEN) {
+      p -= (v & ~RS_WRITTEN) + 1 + RS_TRAILER_SIZE;
+      continue;
+    }
+    rs_item_t *item = items + v;
+    size_t size = item->length + 1 + RS_TRAILER_SIZE;
+    p -= size;
+    dest -= size;
+    if (dest != p)
+      memmove(dest, p, size);
+    item->record = dest;
+    rs_set_trailer(item, item->length);
+  }
+  b->ep = dest;
+  b->bp = (char *)(items + num);
+}
+
+static void rs_close_run(ac_out_sorted_t *h) {
+  if (!h->rs_out)
+    return;
+  ac_out_destroy(h->rs_out);
+  h->rs_out = NULL;
+  add_run(h, h->rs_id, tmp_file_size(h, h->tmp_filename, h->rs_id));
+}
+
+/* write (and reduce) the group of equal records */
+static void rs_write_group(ac_out_sorted_t *h) {
+  ac_io_record_t *group = (ac_io_record_t *)ac_buffer_data(h->rs_group_bh);
+  size_t num = ac_buffer_length(h->rs_group_bh) / sizeof(ac_io_record_t);
+  if (!num)
+    return;
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  if (eo->int_reducer) {
+    ac_io_record_t res;
+    ac_buffer_clear(h->rs_reducer_bh);
+    if (eo->int_reducer(&res, group, num, h->rs_reducer_bh,
+                        eo->int_reducer_arg))
+      ac_out_write_record(h->rs_out, res.record, res.length);
+  } else {
+    for (size_t i = 0; i < num; i++)
+      ac_out_write_record(h->rs_out, group[i].record, group[i].length);
+  }
+  ac_buffer_clear(h->rs_group_bh);
+}
+
+/* The reduced group is kept (in rs_last_bh) instead of being written at the
+   end of a spill, so that equal records written later are reduced with it. */
+static void rs_hold_group(ac_out_sorted_t *h) {
+  ac_io_record_t *group = (ac_io_record_t *)ac_buffer_data(h->rs_group_bh);
+  size_t num = ac_buffer_length(h->rs_group_bh) / sizeof(ac_io_record_t);
+  if (!num || (num == 1 && group->record == ac_buffer_data(h->rs_last_bh)))
+    return;
+
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  ac_io_record_t res = group[0];
+  ac_buffer_clear(h->rs_reducer_bh);
+  if (num > 1 && !eo->int_reducer(&res, group, num, h->rs_reducer_bh,
+                                   eo->int_reducer_arg)) {
+    ac_buffer_clear(h->rs_group_bh);
+    return;
+  }
+  ac_buffer_set(h->rs_pending_bh, res.record, res.length);
+  ac_buffer_t *tmp = h->rs_last_bh;
+  h->rs_last_bh = h->rs_pending_bh;
+  h->rs_pending_bh = tmp;
+
+  res.record = ac_buffer_data(h->rs_last_bh);
+  ac_buffer_set(h->rs_group_bh, &res, sizeof(res));
+}
+
+/* write the smallest records until a fraction of the buffer is free (or all
+   of them) */
+static void rs_spill(ac_out_sorted_t *h, bool all) {
+  ac_out_buffer_t *b = h->b;
+  rs_item_t *heap = (rs_item_t *)b->buffer;
+  size_t target = all ? (size_t)-1 : b->size / RS_SPILL_FRACTION;
+  size_t freed = 0;
+  ac_io_record_t r, last;
+  while (b->num_records) {
+    rs_item_t *top = heap;
+    rs_record(h, &r, top);
+    bool same_group = false;
+    if (h->rs_out && top->run == h->rs_run &&
+        ac_buffer_length(h->rs_group_bh)) {
+      last.record = ac_buffer_data(h->rs_last_bh);
+      last.length = ac_buffer_length(h->rs_last_bh);
+      last.tag = h->tag;
+      same_group = !h->ext_options.int_compare(&r, &last,
+                                               h->ext_options.int_compare_arg);
+    }
+    /* equal records must all be written before the data is moved */
+    if (freed >= target && !same_group)
+      break;
+    if (!same_group)
+      rs_write_group(h);
+    if (!h->rs_out || top->run != h->rs_run) {
+      rs_close_run(h);
+      h->rs_out = get_next_tmp(h, true);
+      h->rs_id = h->num_written - 1;
+      h->rs_run = top->run;
+    }
+    if (!same_group)
+      ac_buffer_set(h->rs_last_bh, r.record, r.length);
+    ac_buffer_append(h->rs_group_bh, &r, sizeof(r));
+    rs_set_trailer(top, top->length | RS_WRITTEN);
+    freed += r.length + 1 + RS_TRAILER_SIZE + sizeof(rs_item_t);
+
+    b->num_records--;
+    rs_pop(h, heap, b->num_records);
+  }
+  if (!all && h->ext_options.int_reducer)
+    rs_hold_group(h);
+  else
+    rs_write_group(h);
+  rs_compact(h);
+}
+
+static void rs_finish(ac_out_sorted_t *h) {
+  ac_out_buffer_t *b = h->b;
+  if (!h->num_written) {
+    /* nothing was written, so the buffer is sorted as usual (the records are
+       the same size as the items, so they can be converted in place) */
+    rs_item_t *items = (rs_item_t *)b->buffer;
+    ac_io_record_t *records = (ac_io_record_t *)b->buffer;
+    for (size_t i = 0; i < b->num_records; i++)
+      rs_record(h, records + i, items + i);
+    b->bp = (char *)(records + b->num_records);
+    return;
+  }
+  rs_spill(h, true);
+  rs_close_run(h);
+  clear_buffer(b);
+}
+
+/* a record which doesn't fit in the empty buffer is written as a run of its
+   own (the heap is empty, since everything was spilled) */
+static void rs_write_alone(ac_out_sorted_t *h, const void *d, size_t len) {
+  rs_close_run(h);
+  ac_out_t *out = get_next_tmp(h, true);
+  uint32_t id = h->num_written - 1;
+  ac_out_write_record(out, d, len);
+  ac_out_destroy(out);
+  add_run(h, id, tmp_file_size(h, h->tmp_filename, id));
+}
+
+bool write_replacement_sorted_record(ac_out_t *hp, const void *d, size_t len) {
+  if (len >= RS_WRITTEN)
+    return false;
+  ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
+  ac_out_buffer_t *b = h->b;
+
+  /* a partial spill frees a fraction of the buffer, which may not be enough
+     for a large record */
+  size_t length = len + 1 + RS_TRAILER_SIZE;
+  if (b->bp + length + sizeof(rs_item_t) > b->ep)
+    rs_spill(h, false);
+  if (b->bp + length + sizeof(rs_item_t) > b->ep)
+    rs_spill(h, true);
+  if (b->bp + length + sizeof(rs_item_t) > b->ep) {
+    rs_write_alone(h, d, len);
+    return true;
+  }
+
+  char *ep = b->ep - length;
+  memcpy(ep, d, len);
+  ep[len] = 0;
+  b->ep = ep;
+
+  rs_item_t *item = (rs_item_t *)b->bp;
+  item->record = ep;
+  item->length = len;
+  item->run = h->rs_run;
+  rs_set_trailer(item, len);
+  if (h->rs_out) {
+    ac_io_record_t r, last;
+    rs_record(h, &r, item);
+    last.record = ac_buffer_data(h->rs_last_bh);
+    last.length = ac_buffer_length(h->rs_last_bh);
+    last.tag = h->tag;
+    if (h->ext_options.int_compare(&r, &last,
+                                   h->ext_options.int_compare_arg) < 0)
+      item->run++;
+  }
+  b->bp += sizeof(*item);
+  b->num_records++;
+  rs_sift_up(h, (rs_item_t *)b->buffer, b->num_records - 1);
+  return true;
+}
+
+/* Each pipeline sort thread takes the next full buffer, sorts it and writes it
+   to a tmp file (which is compressed on pipeline_compress_threads threads and
+   written by another).  The buffer is returned as soon as its records have
+   been copied to the tmp file. */
+static void write_pipeline_run(ac_out_sorted_t *h, ac_out_buffer_t *b,
+                               uint32_t id, char *filename) {
+  ac_in_t *in = _in_from_buffer(h, b);
+  limit_in(h, in);
+  tmp_filename(filename, h->filename, id, h->ext_options.lz4_tmp ? ".lz4" : "");
+  ac_out_t *out = tmp_out_init(h, filename);
+  ac_io_record_t *r;
+  while ((r = ac_in_advance(in)) != NULL)
+    ac_out_write_record(out, r->record, r->length);
+  ac_in_destroy(in);
+
+  pthread_mutex_lock(&h->mutex);
+  clear_buffer(b);
+  h->free_buffers[h->num_free++] = b;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+
+  ac_out_destroy(out);
+  size_t size = ac_io_file_size(filename);
+
+  pthread_mutex_lock(&h->mutex);
+  add_run(h, id, size);
+  pthread_mutex_unlock(&h->mutex);
+}
+
+static void *pipeline_sort_thread(void *arg) {
+  ac_out_sorted_t *h = (ac_out_sorted_t *)arg;
+  char *filename = (char *)ac_malloc(strlen(h->filename) + 40);
+  pthread_mutex_lock(&h->mutex);
+  while (true) {
+    while (!h->num_full && !h->pipeline_done)
+      pthread_cond_wait(&h->cond, &h->mutex);
+    if (!h->num_full)
+      break;
+    ac_out_buffer_t *b = h->full_buffers[h->full_head];
+    h->full_head = (h->full_head + 1) % h->num_buffers;
+    h->num_full--;
+    uint32_t id = h->num_written++;
+    pthread_mutex_unlock(&h->mutex);
+    write_pipeline_run(h, b, id, filename);
+    pthread_mutex_lock(&h->mutex);
+  }
+  pthread_mutex_unlock(&h->mutex);
+  ac_free(filename);
   return NULL;
 }
 
+/* queue the current buffer for sorting and wait for a free one */
+static void pipeline_write_sorted(ac_out_sorted_t *h) {
+  if (!h->sort_threads) {
+    h->sort_threads = (pthread_t *)ac_malloc(
+        sizeof(pthread_t) * h->ext_options.pipeline_sort_threads);
+    for (size_t i = 0; i < h->ext_options.pipeline_sort_threads; i++)
+      pthread_create(h->sort_threads + i, NULL, pipeline_sort_thread, h);
+  }
+  pthread_mutex_lock(&h->mutex);
+  h->full_buffers[(h->full_head + h->num_full) % h->num_buffers] = h->b;
+  h->num_full++;
+  pthread_cond_broadcast(&h->cond);
+  while (!h->num_free)
+    pthread_cond_wait(&h->cond, &h->mutex);
+  h->b = h->free_buffers[--h->num_free];
+  pthread_mutex_unlock(&h->mutex);
+}
+
+/* wait for the queued buffers to be written and stop the sort threads */
+static void pipeline_finish(ac_out_sorted_t *h) {
+  if (!h->sort_threads)
+    return;
+  pthread_mutex_lock(&h->mutex);
+  h->pipeline_done = true;
+  pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+  for (size_t i = 0; i < h->ext_options.pipeline_sort_threads; i++)
+    pthread_join(h->sort_threads[i], NULL);
+  ac_free(h->sort_threads);
+  h->sort_threads = NULL;
+}
+
+/* free all of the pipeline buffers except keep (if not NULL) */
+static void pipeline_free_buffers(ac_out_sorted_t *h, ac_out_buffer_t *keep) {
+  for (size_t i = 0; i < h->num_buffers; i++) {
+    ac_out_buffer_t *b = h->buffers + i;
+    if (b != keep && b->buffer) {
+      ac_io_buffer_free(b->buffer);
+      b->buffer = NULL;
+    }
+  }
+}
+
+/* Sort the full buffer and keep only the first limit records in it instead
+   of writing a run.  Returns false if the kept records still use more than
+   half of the buffer, in which case they are written as a run (and so are
+   the later buffers). */
+static bool limit_buffer(ac_out_sorted_t *h) {
+  ac_out_buffer_t *b = h->b;
+  size_t limit = h->ext_options.limit;
+  size_t used = 0;
+  ac_buffer_t *bh = h->limit_bh;
+  ac_buffer_clear(bh);
+  ac_in_t *in = _in_from_buffer(h, b);
+  ac_io_record_t *r;
+  for (size_t i = 0; i < limit && (r = ac_in_advance(in)) != NULL; i++) {
+    ac_buffer_append(bh, &(r->length), sizeof(r->length));
+    ac_buffer_append(bh, r->record, r->length);
+    used += r->length + sizeof(ac_io_prefix_record_t) + 5;
+  }
+  ac_in_destroy(in);
+
+  /* the records fit as they were part of the full buffer */
+  char *p = ac_buffer_data(bh);
+  char *ep = p + ac_buffer_length(bh);
+  while (p < ep) {
+    uint32_t length = *(uint32_t *)p;
+    p += sizeof(length);
+    h->write_record((ac_out_t *)h, p, length);
+    p += length;
+  }
+  return used <= b->size / 2;
+}
+
 void write_sorted(ac_out_sorted_t *h) {
+  if (h->combine_bh)
+    combine_finish(h);
   if (h->b->bp == h->b->buffer)
     return;
+  if (h->limit_bh && !h->limit_spill) {
+    if (limit_buffer(h))
+      return;
+    h->limit_spill = true;
+    if (h->combine_bh)
+      combine_finish(h);
+  }
+  if (h->buffers) {
+    pipeline_write_sorted(h);
+    return;
+  }
   wait_on_thread(h);
   if (h->ext_options.use_extra_thread) {
     ac_out_buffer_t *tmp = h->b;
@@ -1268,32 +3295,44 @@ void ac_out_tag(ac_out_t *hp, int tag) {
   h->tag = tag;
 }
 
-ac_in_t *_ac_out_sorted_in(ac_out_t *hp) {
+static ac_in_t *sorted_in(ac_out_t *hp) {
   ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
-  if (h->type != AC_OUT_SORTED_TYPE)
-    return NULL;
 
   if (h->out_in_called)
     return NULL;
 
   h->out_in_called = true;
-
-  if (!h->num_written && !h->num_group_written) {
+  wait_on_thread(h);
+  if (h->combine_bh)
+    combine_finish(h);
+  if (h->replacement)
+    rs_finish(h);
+
+  if (!h->num_written && !h->num_group_written && !h->sort_threads) {
+    if (h->buffers) {
+      pipeline_free_buffers(h, h->b);
+      return _in_from_buffer(h, h->b);
+    }
     if (&(h->buf1) == h->b) {
       if (h->buf2.buffer) {
-        ac_free(h->buf2.buffer);
+        ac_io_buffer_free(h->buf2.buffer);
         h->buf2.buffer = NULL;
       }
     } else {
       if (h->buf1.buffer) {
-        ac_free(h->buf1.buffer);
+        ac_io_buffer_free(h->buf1.buffer);
         h->buf1.buffer = NULL;
       }
     }
     return _in_from_buffer(h, h->b);
   }
 
-  if (h->b->num_records) {
+  if (h->buffers) {
+    if (h->b->num_records)
+      pipeline_write_sorted(h);
+    pipeline_finish(h);
+    pipeline_free_buffers(h, NULL);
+  } else if (h->b->num_records) {
     wait_on_thread(h);
     if (h->ext_options.use_extra_thread) {
       ac_out_buffer_t *tmp = h->b;
@@ -1305,34 +3344,50 @@ ac_in_t *_ac_out_sorted_in(ac_out_t *hp) {
           h->num_group_written ? h->num_group_written : 1;
     write_sorted_thread(h);
   }
+  wait_on_thread(h);
+  if (h->num_group_written) {
+    h->ext_options.num_per_group = h->num_group_written;
+    check_for_merge(h);
+  }
 
   if (h->buf1.buffer) {
-    ac_free(h->buf1.buffer);
+    ac_io_buffer_free(h->buf1.buffer);
     h->buf1.buffer = NULL;
   }
   if (h->buf2.buffer) {
-    ac_free(h->buf2.buffer);
+    ac_io_buffer_free(h->buf2.buffer);
     h->buf2.buffer = NULL;
   }
 
+  plan_merges(h);
+
   ac_in_options_t opts;
   ac_in_options_init(&opts);
-  ac_in_options_buffer_size(&opts, h->buf1.size / 10);
-  ac_in_options_format(&opts, ac_io_prefix());
-  ac_in_t *in =
-      ac_in_ext_init(h->ext_options.compare, h->ext_options.compare_arg, &opts);
-  if (h->ext_options.reducer)
-    ac_in_ext_reducer(in, h->ext_options.reducer, h->ext_options.reducer_arg);
+  ac_in_options_buffer_size(&opts, merge_buffer_size(h, h->num_runs));
+  ac_in_options_format(&opts, tmp_format(h));
+  ac_in_options_io_uring(&opts, h->options.io_uring);
+  ac_in_t *in = _merge_init(h, h->ext_options.compare,
+                            h->ext_options.compare_arg, h->ext_options.reducer,
+                            h->ext_options.reducer_arg, &opts);
 
   const char *suffix = h->ext_options.lz4_tmp ? ".lz4" : "";
-  // printf("%s num_written: %lu\n", h->filename, h->num_written);
-  for (size_t i = 0; i < h->num_written; i++) {
-    tmp_filename(h->tmp_filename, h->filename, i, suffix);
+  for (size_t i = 0; i < h->num_runs; i++) {
+    tmp_filename(h->tmp_filename, h->filename, h->runs[i].id, suffix);
     ac_in_ext_add(in, ac_in_init(h->tmp_filename, &opts), i);
   }
   return in;
 }
 
+ac_in_t *_ac_out_sorted_in(ac_out_t *hp) {
+  ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
+  if (h->type != AC_OUT_SORTED_TYPE)
+    return NULL;
+
+  ac_in_t *in = sorted_in(hp);
+  limit_in(h, in);
+  return in;
+}
+
 ac_in_t *ac_out_in(ac_out_t *hp) {
   ac_in_t *in = NULL;
   if (hp->type == AC_OUT_SORTED_TYPE) {
@@ -1346,17 +3401,16 @@ ac_in_t *ac_out_in(ac_out_t *hp) {
   return in;
 }
 
-/*
-TODO: Add support for fixed length records.  These records don't need the
-ac_io_record_t record array and can simply be sorted in place.
-
+/* Fixed length records don't need the ac_io_record_t record array and are
+   simply packed into the buffer (leaving one byte at the end so the last
+   record can be zero terminated when it is read back). */
 bool write_fixed_sorted_record(ac_out_t *hp, const void *d, size_t len) {
   ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
   if (len != h->fixed)
     abort();
 
   char *bp = h->b->bp;
-  if (bp + len > h->b->ep) {
+  if (bp + len >= h->b->ep) {
     write_sorted(h);
     bp = h->b->bp;
   }
@@ -1367,7 +3421,6 @@ bool write_fixed_sorted_record(ac_out_t *hp, const void *d, size_t len) {
   h->b->num_records++;
   return true;
 }
-*/
 
 bool write_sorted_record(ac_out_t *hp, const void *d, size_t len) {
   if (len > 0xffffffffU)
@@ -1402,6 +3455,54 @@ bool write_sorted_record(ac_out_t *hp, const void *d, size_t len) {
   r->tag = h->tag;
   bp += sizeof(*r);
 
+  /* count the ascending runs so that ordered input isn't sorted again.  Once
+     the runs are too short for ac_io_sort_runs, the count is dropped (0) and
+     the rest of the records aren't compared. */
+  if (!h->b->num_records)
+    h->b->num_runs = 1;
+  else if (h->b->num_runs &&
+           h->ext_options.int_compare(r, r - 1,
+                                      h->ext_options.int_compare_arg) < 0 &&
+           ++h->b->num_runs > h->b->num_records / AC_IO_MIN_AVERAGE_RUN + 1)
+    h->b->num_runs = 0;
+
+  h->b->bp = bp;
+  h->b->ep = ep;
+  h->b->num_records++;
+
+  return true;
+}
+
+/* same as write_sorted_record, except the key prefix is stored in front of
+   each record in the record array.  The runs aren't counted, since the
+   prefixed records are sorted by ac_io_sort_prefix_records, so ordered input
+   is sorted like any other. */
+bool write_prefixed_sorted_record(ac_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
+
+  size_t length = len + sizeof(ac_io_prefix_record_t) + 5;
+  char *bp = h->b->bp;
+  if (bp + length > h->b->ep) {
+    write_sorted(h);
+    bp = h->b->bp;
+  }
+
+  char *ep = h->b->ep;
+  ep--;
+  *ep = 0;
+  ep -= len;
+  memcpy(ep, d, len);
+
+  ac_io_prefix_record_t *r = (ac_io_prefix_record_t *)bp;
+  r->r.record = ep;
+  r->r.length = len;
+  r->r.tag = h->tag;
+  r->prefix =
+      h->ext_options.key_prefix(&(r->r), h->ext_options.key_prefix_arg);
+  bp += sizeof(*r);
+
   h->b->bp = bp;
   h->b->ep = ep;
   h->b->num_records++;
@@ -1409,6 +3510,188 @@ bool write_sorted_record(ac_out_t *hp, const void *d, size_t len) {
   return true;
 }
 
+static inline ac_io_record_t *sorted_record(ac_out_sorted_t *h, size_t i) {
+  if (h->ext_options.key_prefix)
+    return &(((ac_io_prefix_record_t *)h->b->buffer)[i].r);
+  return ((ac_io_record_t *)h->b->buffer) + i;
+}
+
+static inline size_t combine_home(ac_out_sorted_t *h, uint64_t slot) {
+  return (slot >> 32) & h->combine_mask;
+}
+
+/* double the table (or create it) and reinsert the slots */
+static void combine_grow(ac_out_sorted_t *h) {
+  size_t old_size = h->combine_slots ? h->combine_mask + 1 : 0;
+  size_t size = old_size ? old_size * 2 : 1024;
+  uint64_t *old_slots = h->combine_slots;
+  h->combine_slots = (uint64_t *)ac_calloc(sizeof(uint64_t) * size);
+  h->combine_mask = size - 1;
+  for (size_t i = 0; i < old_size; i++) {
+    if (!old_slots[i])
+      continue;
+    size_t pos = combine_home(h, old_slots[i]);
+    while (h->combine_slots[pos])
+      pos = (pos + 1) & h->combine_mask;
+    h->combine_slots[pos] = old_slots[i];
+  }
+  if (old_slots)
+    ac_free(old_slots);
+}
+
+/* find the slot of the record equal to r or the empty slot where it belongs */
+static uint64_t *combine_find(ac_out_sorted_t *h, uint32_t hash,
+                              ac_io_record_t *r) {
+  ac_out_ext_options_t *eo = &(h->ext_options);
+  size_t pos = hash & h->combine_mask;
+  uint64_t *slots = h->combine_slots;
+  while (slots[pos]) {
+    if ((slots[pos] >> 32) == hash &&
+        !eo->int_compare(sorted_record(h, (uint32_t)slots[pos] - 1), r,
+                         eo->int_compare_arg))
+      return slots + pos;
+    pos = (pos + 1) & h->combine_mask;
+  }
+  return slots + pos;
+}
+
+/* remove a slot by shifting back the slots which follow it */
+static void combine_remove(ac_out_sorted_t *h, uint64_t *slot) {
+  uint64_t *slots = h->combine_slots;
+  size_t mask = h->combine_mask;
+  size_t i = slot - slots;
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask;
+    if (!slots[j])
+      break;
+    size_t k = combine_home(h, slots[j]);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i] = 0;
+}
+
+/* remove the dropped records from the buffer and empty the table */
+static void combine_finish(ac_out_sorted_t *h) {
+  if (h->combine_slots)
+    memset(h->combine_slots, 0, sizeof(uint64_t) * (h->combine_mask + 1));
+  if (!h->num_dropped)
+    return;
+
+  size_t record_size = h->ext_options.key_prefix
+                           ? sizeof(ac_io_prefix_record_t)
+                           : sizeof(ac_io_record_t);
+  char *rp = h->b->buffer;
+  char *wp = rp;
+  char *ep = h->b->bp;
+  while (rp < ep) {
+    ac_io_record_t *r = h->ext_options.key_prefix
+                            ? &(((ac_io_prefix_record_t *)rp)->r)
+                            : (ac_io_record_t *)rp;
+    if (r->record) {
+      if (wp != rp)
+        memcpy(wp, rp, record_size);
+      wp += record_size;
+    }
+    rp += record_size;
+  }
+  h->b->bp = wp;
+  h->b->num_records = (wp - h->b->buffer) / record_size;
+  h->num_dropped = 0;
+}
+
+/* Like write_sorted_record, but the record is reduced with an equal record
+   already in the buffer if one exists.  Records which reduce to nothing are
+   marked by a NULL record and removed before the buffer is sorted. */
+bool write_combined_sorted_record(ac_out_t *hp, const void *d, size_t len) {
+  if (len > 0xffffffffU)
+    return false;
+  ac_out_sorted_t *h = (ac_out_sorted_t *)hp;
+  ac_out_ext_options_t *eo = &(h->ext_options);
+
+  size_t record_size = eo->key_prefix ? sizeof(ac_io_prefix_record_t)
+                                      : sizeof(ac_io_record_t);
+  if (h->b->bp + len + record_size + 5 > h->b->ep)
+    write_sorted(h);
+  if ((h->b->num_records + 1) * 2 > h->combine_mask + 1)
+    combine_grow(h);
+
+  /* copy the record to the end of the buffer, but only keep it if it is new
+     or it becomes the reduced record */
+  char *ep = h->b->ep - (len + 1);
+  memcpy(ep, d, len);
+  ep[len] = 0;
+
+  ac_io_record_t r;
+  r.record = ep;
+  r.length = len;
+  r.tag = h->tag;
+  uint32_t hash = eo->combine_hash(&r, eo->combine_hash_arg);
+  uint64_t *slot = combine_find(h, hash, &r);
+  if (!*slot) {
+    *slot = (((uint64_t)hash) << 32) | (h->b->num_records + 1);
+    if (eo->key_prefix) {
+      ac_io_prefix_record_t *pr = (ac_io_prefix_record_t *)h->b->bp;
+      pr->r = r;
+      pr->prefix = eo->key_prefix(&r, eo->key_prefix_arg);
+      h->b->bp += sizeof(*pr);
+    } else {
+      *(ac_io_record_t *)h->b->bp = r;
+      h->b->bp += sizeof(r);
+    }
+    h->b->ep = ep;
+    h->b->num_records++;
+    return true;
+  }
+
+  ac_io_record_t *er = sorted_record(h, (uint32_t)*slot - 1);
+  ac_io_record_t group[2];
+  group[0] = *er;
+  group[1] = r;
+  ac_io_record_t res;
+  ac_buffer_clear(h->combine_bh);
+  if (!eo->int_reducer(&res, group, 2, h->combine_bh, eo->int_reducer_arg)) {
+    combine_remove(h, slot);
+    er->record = NULL;
+    h->num_dropped++;
+    return true;
+  }
+
+  if (res.record == r.record) {
+    er->record = ep;
+    h->b->ep = ep;
+  } else if (res.length <= er->length) {
+    if (res.record != er->record)
+      memmove(er->record, res.record, res.length);
+  } else if (res.length <= len) {
+    memmove(ep, res.record, res.length);
+    er->record = ep;
+    h->b->ep = ep;
+  } else if (h->b->bp + res.length + 1 <= h->b->ep) {
+    ep = h->b->ep - (res.length + 1);
+    memcpy(ep, res.record, res.length);
+    er->record = ep;
+    h->b->ep = ep;
+  } else {
+    /* the reduced record doesn't fit, so it starts the next buffer */
+    char *tmp = (char *)ac_malloc(res.length + 1);
+    memcpy(tmp, res.record, res.length);
+    combine_remove(h, slot);
+    er->record = NULL;
+    h->num_dropped++;
+    write_sorted(h);
+    bool ok = write_combined_sorted_record(hp, tmp, res.length);
+    ac_free(tmp);
+    return ok;
+  }
+  er->length = res.length;
+  er->record[res.length] = 0;
+  return true;
+}
+
 void ac_out_ext_remove_tmp_files(char *tmp, const char *filename,
                                  bool lz4_tmp) {
   const char *suffix = lz4_tmp ? ".lz4" : "";
@@ -1477,9 +3760,31 @@ void ac_out_sorted_destroy(ac_out_t *hp) {
     ac_in_destroy(in);
   }
   if (h->buf1.buffer)
-    ac_free(h->buf1.buffer);
+    ac_io_buffer_free(h->buf1.buffer);
   if (h->buf2.buffer)
-    ac_free(h->buf2.buffer);
+    ac_io_buffer_free(h->buf2.buffer);
+  if (h->buffers) {
+    pipeline_free_buffers(h, NULL);
+    ac_free(h->buffers);
+    pthread_mutex_destroy(&h->mutex);
+    pthread_cond_destroy(&h->cond);
+  }
+  if (h->combine_bh) {
+    if (h->combine_slots)
+      ac_free(h->combine_slots);
+    ac_buffer_destroy(h->combine_bh);
+  }
+  if (h->limit_bh)
+    ac_buffer_destroy(h->limit_bh);
+  if (h->replacement) {
+    ac_buffer_destroy(h->rs_last_bh);
+    ac_buffer_destroy(h->rs_pending_bh);
+    ac_buffer_destroy(h->rs_group_bh);
+    ac_buffer_destroy(h->rs_reducer_bh);
+  }
+  remove_runs(h);
+  if (h->runs)
+    ac_free(h->runs);
   ac_out_ext_remove_tmp_files(h->tmp_filename, h->filename,
                               h->ext_options.lz4_tmp);
   destroy_extra_ins(h);
@@ -1521,6 +3826,10 @@ ac_out_t *ac_out_ext_init(const char *filename, ac_out_options_t *options,
     eopts.int_reducer = eopts.reducer;
     eopts.int_reducer_arg = eopts.reducer_arg;
   }
+  /* the sample would only see the smallest records if the records were
+     sorted first */
+  if (eopts.range_sample_size)
+    eopts.sort_before_partitioning = false;
 
   ext_options = &eopts;
 
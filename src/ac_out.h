@@ -107,6 +107,49 @@ void ac_out_options_lz4(ac_out_options_t *h, int level,
                         ac_lz4_block_size_t size, bool block_checksum,
                         bool content_checksum);
 
+/* Compress lz4 blocks on num_threads threads.  The blocks are still written
+   in order (and the content checksum is still computed in order) by a
+   writer thread.  This is most useful for higher (lz4hc) levels. */
+void ac_out_options_lz4_threads(ac_out_options_t *h, size_t num_threads);
+
+/* Compress gzip output on num_threads threads (like pigz).  The output is cut
+   into 128KB blocks which are compressed independently and written in order
+   as a single gzip member, so any gzip reader can read it.  Compression is
+   slightly worse since a block can't refer to data in the previous block. */
+void ac_out_options_gz_threads(ac_out_options_t *h, size_t num_threads);
+
+/* Write a sparse index of the output to filename.keys, keeping the first
+   record written after about every span bytes of uncompressed content along
+   with where it starts (including the lz4 block).  The records must be
+   written in sorted order (such as the output of ac_out_ext_init with a
+   compare), so that a reader can seek to a key (see
+   ac_in_options_key_range).  The index is not written in append mode or if
+   the output has no filename.  Partitioned output writes an index for each
+   sorted partition. */
+void ac_out_options_key_index(ac_out_options_t *h, size_t span);
+
+/* Write a bloom filter of the keys in the output to filename.bloom, where
+   hash is the hash of a record's key (see ac_io_bloom_write for
+   bits_per_key).  Readers can then skip the file if it can't have the keys
+   which they want (see ac_in_options_bloom_keys).  The hashes are held until
+   the output is destroyed (equal neighboring hashes are only kept once, so
+   sorted output holds one per distinct key).  Like the key index, the filter
+   is not written in append mode or if the output has no filename, and each
+   final partition of partitioned output gets its own. */
+void ac_out_options_bloom_filter(ac_out_options_t *h, ac_io_hash_f hash,
+                                 void *arg, size_t bits_per_key);
+
+/* Queue up to num_writes writes of the output buffer on an io_uring instead
+   of blocking in write() each time it fills (num_writes more buffers are
+   allocated, so the next buffer can be filled while the others are written).
+   This applies to uncompressed and lz4 (without lz4_threads) output to a
+   regular file which isn't in append mode.  Partitioned output shares one
+   ring between its partitions, so the buffers of many partitions are sent to
+   the kernel in one system call, and sorted output also reads its tmp files
+   back with ac_in_options_io_uring.  If io_uring isn't available, the output
+   is written with write() as usual. */
+void ac_out_options_io_uring(ac_out_options_t *h, size_t num_writes);
+
 /* extended options are for partitioned output, sorted output, or both */
 void ac_out_ext_options_init(ac_out_ext_options_t *h);
 
@@ -126,6 +169,24 @@ void ac_out_ext_options_sort_while_partitioning(ac_out_ext_options_t *h);
 void ac_out_ext_options_num_sort_threads(ac_out_ext_options_t *h,
                                          size_t num_sort_threads);
 
+/* Sort each full buffer of a sorted output using num_run_sort_threads threads.
+   The buffer is split into pieces which are sorted in parallel and then merged
+   as the run is written.  Small buffers are still sorted on a single thread. */
+void ac_out_ext_options_num_run_sort_threads(ac_out_ext_options_t *h,
+                                             size_t num_run_sort_threads);
+
+/* Generate runs with a pipeline instead of one buffer (or two with
+   use_extra_thread).  The buffer_size is split into num_buffers buffers.  Full
+   buffers are queued for num_sort_threads threads which sort each one and
+   write it to a tmp file.  The blocks of each tmp file are compressed on
+   num_compress_threads threads and written in order by another thread.  A
+   buffer is reused as soon as its records are copied out, so filling,
+   sorting, compressing and writing all overlap.  The num_per_group is not used
+   with a pipeline. */
+void ac_out_ext_options_pipeline(ac_out_ext_options_t *h, size_t num_buffers,
+                                 size_t num_sort_threads,
+                                 size_t num_compress_threads);
+
 /* options for creating a partitioned output */
 void ac_out_ext_options_partition(ac_out_ext_options_t *h,
                                   ac_io_partition_f part, void *arg);
@@ -133,12 +194,42 @@ void ac_out_ext_options_partition(ac_out_ext_options_t *h,
 void ac_out_ext_options_num_partitions(ac_out_ext_options_t *h,
                                        size_t num_partitions);
 
+/* Flag a partition as skewed when it holds more than threshold times the
+   average partition (2.0 by default).  When partitions are sorted after they
+   are written, the unsorted data of a partition is split into another
+   sub-partition each time it grows past the threshold (up to
+   max_sub_partitions, and never smaller than the partition's buffer).  The
+   sub-partitions are sorted in parallel like any other partition, and the
+   thread which sorts the last of them merges them into the partition's file
+   (while the other threads keep sorting), so readers of the partition see no
+   difference.  A max_sub_partitions of 0 or 1 only flags skew. */
+void ac_out_ext_options_skew(ac_out_ext_options_t *h, double threshold,
+                             size_t max_sub_partitions);
+
+/* Partition by ranges of the compare function (instead of a partition
+   function) so that the partitions are totally ordered and can each be sorted
+   independently.  The first sample_size records written are held in memory
+   and a reservoir sample of them (see ac_io_range_partition_t) picks the
+   split points before any record is written to a partition.  The first
+   records should be representative of the rest.  If they are not, sample the
+   input in a pass of its own and use ac_io_range_partition as the partition
+   function.  sort_before_partitioning is ignored with this option. */
+void ac_out_ext_options_range_partition(ac_out_ext_options_t *h,
+                                        size_t sample_size);
+
 /* By default, tmp files are written every time the buffer fills and all of the
    tmp files are merged at the end.  This causes the tmp files to be merged
    once the number of tmp files reaches the num_per_group. */
 void ac_out_ext_options_intermediate_group_size(ac_out_ext_options_t *h,
                                                 size_t num_per_group);
 
+/* Before the final merge, the smallest tmp files are merged together until
+   no more than the fan in remain.  The fan in is limited by the buffer_size
+   (each input needs a read buffer) and the open file limit.  This sets a
+   further limit (including for the num_per_group above). */
+void ac_out_ext_options_max_fan_in(ac_out_ext_options_t *h,
+                                   size_t max_fan_in);
+
 /* options for comparing output */
 void ac_out_ext_options_compare(ac_out_ext_options_t *h,
                                 ac_io_compare_f compare, void *arg);
@@ -147,6 +238,15 @@ void ac_out_ext_options_intermediate_compare(ac_out_ext_options_t *h,
                                              ac_io_compare_f compare,
                                              void *arg);
 
+/* Store a key prefix (see ac_io_key_prefix_f) next to each record when
+   sorting and use it while sorting and merging so that most comparisons don't
+   need to touch the record.  The prefix must be consistent with both the
+   compare and the intermediate compare functions.  Buffers are always sorted
+   when a key prefix is used (without it, a buffer whose records arrive in
+   order, or in a few long ascending runs, is passed on or merged instead). */
+void ac_out_ext_options_key_prefix(ac_out_ext_options_t *h,
+                                   ac_io_key_prefix_f key_prefix, void *arg);
+
 /* set the reducers */
 void ac_out_ext_options_reducer(ac_out_ext_options_t *h,
                                 ac_io_reducer_f reducer, void *arg);
@@ -157,12 +257,95 @@ void ac_out_ext_options_intermediate_reducer(ac_out_ext_options_t *h,
                                              ac_io_reducer_f reducer,
                                              void *arg);
 
+/* Generate runs with replacement selection instead of sorting and writing
+   full buffers.  The buffered records are kept in a heap and the smallest
+   are written to the current run as space is needed.  A record less than the
+   last one written waits for the next run.  On random input, runs are about
+   1.5 times as long as a sorted buffer (a quarter of the buffer is spilled
+   at a time, and the heap shares the buffer with the records), and input
+   which is already nearly sorted produces a single run (reverse sorted input
+   is the worst case, with runs a little shorter than the buffer).  Keeping
+   the heap costs more CPU than sorting the buffer, so this pays off when the
+   merge is expensive.  This uses a single buffer, so use_extra_thread, the
+   pipeline, the key prefix, combining and num_per_group are not used with it
+   (and the limit is only applied to the output).  Packed fixed length
+   records are sorted as usual. */
+void ac_out_ext_options_replacement_selection(ac_out_ext_options_t *h);
+
+/* Only the first limit records (after reducing) of the sorted output are
+   needed.  When the buffer fills, it is sorted and only the first limit
+   records are kept in it, so no tmp files are written while they use at most
+   half of the buffer.  Otherwise, each run and merge is cut short after limit
+   records.  A reducer which removes records should not be used with a limit
+   since the records it removes may leave fewer than limit records.  If the
+   output is partitioned, each partition is limited. */
+void ac_out_ext_options_limit(ac_out_ext_options_t *h, size_t limit);
+
+/* Combine records with equal keys as they are written instead of buffering
+   every record.  Each new record is looked up by its hash in a table of the
+   records in the buffer and, if an equal record (by the intermediate compare)
+   is found, the two are reduced with the intermediate reducer.  Only the
+   distinct records are sorted and written when the buffer fills, which
+   greatly reduces the number of runs when keys repeat often.  The reducer
+   must be safe to apply to partial groups (as it already is when tmp files
+   are merged).  The hash table needs about 16 bytes per distinct record in
+   addition to the buffer.  This has no effect without a reducer or when fixed
+   length records are packed. */
+void ac_out_ext_options_combine(ac_out_ext_options_t *h, ac_io_hash_f hash,
+                                void *arg);
+
+/* Options for sorting fixed length records (ac_out_options_format is set to
+   ac_io_fixed(size)).  If a key or a sort function is given, records are
+   packed into the sort buffer without a record header and sorted in place.
+
+   ac_out_ext_options_fixed_key declares an unsigned integer key which is width
+   bytes long (stored in native byte order) starting offset bytes into each
+   record.  Records are radix sorted by the key, so the key must produce the
+   same order as the compare function (which is still used for merging).  For
+   example, records that start with a uint64_t and are compared with
+   ac_io_compare_uint64_t would use (0, 8).
+
+   ac_out_ext_options_fixed_sort replaces the radix sort with a custom sort.
+
+   ac_out_ext_options_fixed_compare determines which records are equal when
+   there is no key and ac_out_ext_options_fixed_reducer reduces num_r equal
+   records (which are adjacent in d) into the first record in place.  The
+   fixed reducer is also used when merging tmp files if no other reducer is
+   set. */
+void ac_out_ext_options_fixed_key(ac_out_ext_options_t *h, size_t offset,
+                                  size_t width);
+
+void ac_out_ext_options_fixed_sort(ac_out_ext_options_t *h,
+                                   ac_io_fixed_sort_f sort, void *arg);
+
+void ac_out_ext_options_fixed_compare(ac_out_ext_options_t *h,
+                                      ac_io_fixed_compare_f compare, void *arg);
+
+void ac_out_ext_options_fixed_reducer(ac_out_ext_options_t *h,
+                                      ac_io_fixed_reducer_f reducer, void *arg);
+
 /* Use an extra thread when sorting output. */
 void ac_out_ext_options_use_extra_thread(ac_out_ext_options_t *h);
 
 /* Default tmp files are stored in lz4 format.  Disable this behavior. */
 void ac_out_ext_options_dont_compress_tmp(ac_out_ext_options_t *h);
 
+/* The counts of a partitioned output.  A partition is skewed if it holds more
+   than the skew threshold times the average partition (see
+   ac_out_ext_options_skew). */
+typedef struct {
+  size_t num_records;
+  size_t num_bytes;
+  size_t num_sub_partitions;
+  bool skewed;
+} ac_out_partition_stats_t;
+
+/* Returns the counts of each partition of a partitioned output (and sets
+   num_partitions) or NULL if hp is not partitioned.  This must be called
+   before the output is destroyed. */
+ac_out_partition_stats_t *ac_out_partition_stats(ac_out_t *hp,
+                                                 size_t *num_partitions);
+
 /* used to create a partitioned filename */
 void ac_out_partition_filename(char *dest, const char *filename, size_t id);
 
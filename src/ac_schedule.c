@@ -414,19 +414,15 @@ ac_in_t *ac_worker_in(ac_worker_t *w, size_t n) {
     if (inp->reducer)
       ac_in_ext_reducer(in, inp->reducer, inp->reducer_arg);
     for (size_t i = 0; i < inp->num_files; i++)
-      ac_in_ext_add(in, ac_in_init(inp->files[i].filename, &(inp->options)),
+      ac_in_ext_add(in,
+                    ac_in_init_from_file_info(inp->files + i, &(inp->options)),
                     inp->files[i].tag);
   } else {
     ac_in_options_buffer_size(&(inp->options), ac_worker_ram(w, inp->ram_pct));
     if (inp->num_files > 1)
       in = ac_in_init_from_list(inp->files, inp->num_files, &(inp->options));
-    else {
-      ac_in_options_t opts = inp->options;
-      if (opts.buffer_size > inp->files[0].size)
-        opts.buffer_size = inp->files[0].size;
-      opts.tag = inp->files[0].tag;
-      in = ac_in_init(inp->files[0].filename, &opts);
-    }
+    else
+      in = ac_in_init_from_file_info(inp->files, &(inp->options));
   }
   if (inp->limit)
     ac_in_limit(in, inp->limit);
@@ -933,6 +929,40 @@ void ac_task_output_partition(ac_task_t *task, ac_io_partition_f part,
   ac_out_ext_options_partition(&(task->current_output->ext_options), part, arg);
 }
 
+void ac_task_output_range_partition(ac_task_t *task, size_t sample_size) {
+  if (!task->current_output)
+    return;
+
+  /* each task partition would sample its own split points, so destination
+     partition p would cover different keys from each of them */
+  if (task->num_partitions > 1) {
+    printf("%s is partitioned, so its output can't be range partitioned from\n"
+           "  a sample of each partition!  Exiting early!\n",
+           task->task_name);
+    abort();
+  }
+
+  ac_out_ext_options_range_partition(&(task->current_output->ext_options),
+                                     sample_size);
+}
+
+void ac_task_output_skew(ac_task_t *task, double threshold,
+                         size_t max_sub_partitions) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_skew(&(task->current_output->ext_options), threshold,
+                          max_sub_partitions);
+}
+
+void ac_task_output_replacement_selection(ac_task_t *task) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_replacement_selection(
+      &(task->current_output->ext_options));
+}
+
 void ac_task_dump_text(ac_worker_t *w, ac_io_record_t *r, ac_buffer_t *bh,
                        void *arg) {
   ac_buffer_appends(bh, r->record);
@@ -1004,6 +1034,22 @@ void ac_task_output_group_size(ac_task_t *task, size_t num_per_group,
       &(task->current_output->ext_options), num_per_group);
 }
 
+void ac_task_output_key_prefix(ac_task_t *task, ac_io_key_prefix_f key_prefix,
+                               void *arg) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_key_prefix(&(task->current_output->ext_options),
+                                key_prefix, arg);
+}
+
+void ac_task_output_combine(ac_task_t *task, ac_io_hash_f hash, void *arg) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_combine(&(task->current_output->ext_options), hash, arg);
+}
+
 void ac_task_output_use_extra_thread(ac_task_t *task) {
   if (!task->current_output)
     return;
@@ -1042,6 +1088,34 @@ void ac_task_output_num_sort_threads(ac_task_t *task, size_t num_sort_threads) {
                                       num_sort_threads);
 }
 
+void ac_task_output_num_run_sort_threads(ac_task_t *task,
+                                         size_t num_run_sort_threads) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_num_run_sort_threads(&(task->current_output->ext_options),
+                                          num_run_sort_threads);
+}
+
+void ac_task_output_max_fan_in(ac_task_t *task, size_t max_fan_in) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_max_fan_in(&(task->current_output->ext_options),
+                                max_fan_in);
+}
+
+void ac_task_output_pipeline(ac_task_t *task, size_t num_buffers,
+                             size_t num_sort_threads,
+                             size_t num_compress_threads) {
+  if (!task->current_output)
+    return;
+
+  ac_out_ext_options_pipeline(&(task->current_output->ext_options),
+                              num_buffers, num_sort_threads,
+                              num_compress_threads);
+}
+
 void ac_task_output_format(ac_task_t *task, ac_io_format_t format) {
   if (!task->current_output)
     return;
@@ -1080,6 +1154,34 @@ void ac_task_output_lz4(ac_task_t *task, int level, ac_lz4_block_size_t size,
                      block_checksum, content_checksum);
 }
 
+void ac_task_output_lz4_threads(ac_task_t *task, size_t num_threads) {
+  if (!task->current_output)
+    return;
+
+  ac_out_options_lz4_threads(&(task->current_output->options), num_threads);
+}
+
+void ac_task_output_gz_threads(ac_task_t *task, size_t num_threads) {
+  if (!task->current_output)
+    return;
+
+  ac_out_options_gz_threads(&(task->current_output->options), num_threads);
+}
+
+void ac_task_output_key_index(ac_task_t *task, size_t span) {
+  if (!task->current_output)
+    return;
+
+  ac_out_options_key_index(&(task->current_output->options), span);
+}
+
+void ac_task_output_io_uring(ac_task_t *task, size_t num_writes) {
+  if (!task->current_output)
+    return;
+
+  ac_out_options_io_uring(&(task->current_output->options), num_writes);
+}
+
 /* The ac_task_input... methods apply to the previous ac_task_input_files or
    ac_task_output call.  If the previous ac_task_output call doesn't specify
    one or more destinations, the calls are silently ignored. */
@@ -1140,6 +1242,24 @@ void ac_task_input_limit(ac_task_t *task, size_t limit) {
   }
 }
 
+void ac_task_input_bloom_keys(ac_task_t *task, ac_io_hash_f hash, void *arg,
+                              const ac_io_record_t *keys, size_t num_keys) {
+  ac_task_input_link_t *inp = task->current_input;
+  while (inp) {
+    ac_in_options_bloom_keys(&(inp->input->options), hash, arg, keys,
+                             num_keys);
+    inp = inp->next;
+  }
+}
+
+void ac_task_input_io_uring(ac_task_t *task, size_t num_blocks) {
+  ac_task_input_link_t *inp = task->current_input;
+  while (inp) {
+    ac_in_options_io_uring(&(inp->input->options), num_blocks);
+    inp = inp->next;
+  }
+}
+
 static bool in_out_runner(ac_worker_t *w);
 
 static void get_ack_time_for_task(ac_task_t *task) {
@@ -1589,6 +1709,12 @@ static void fill_inputs(ac_worker_t *w) {
     while (n) {
       n->num_files = 0;
       n->files = n->file_info(w, &(n->num_files), n);
+      /* files which can't have the keys aren't opened at all */
+      ac_in_options_t *o = &(n->options);
+      if (o->bloom_hash && n->files)
+        n->num_files = ac_io_bloom_filter_files(
+            n->files, n->num_files, o->bloom_hash, o->bloom_hash_arg,
+            o->bloom_keys, o->num_bloom_keys);
       n = n->next;
     }
   }
@@ -1952,6 +2078,9 @@ void dump_selected_tasks(void *arg) {
     mark_as_done(t->scheduler);
 }
 
+/* the number of records in_out_runner advances at once */
+#define IN_OUT_BATCH_SIZE 64
+
 static bool in_out_runner(ac_worker_t *w) {
   ac_transform_t *transforms = (ac_transform_t *)w->data;
   ac_in_t *in = NULL;
@@ -1985,7 +2114,18 @@ static bool in_out_runner(ac_worker_t *w) {
 
     ac_io_record_t *r;
     if (num_ins == 1) {
-      if (transforms->runner) {
+      if (transforms->runner && ac_in_advance_batch_in_place(ins[0])) {
+        ac_io_record_t records[IN_OUT_BATCH_SIZE];
+        size_t num_records;
+        while ((num_records = ac_in_advance_batch(ins[0], records,
+                                                  IN_OUT_BATCH_SIZE)) > 0) {
+          for (size_t i = 0; i < num_records; i++) {
+            ac_pool_clear(w->pool);
+            transforms->runner(w, records + i, outs);
+          }
+        }
+      } else if (transforms->runner) {
+        /* merged or reduced input would be copied into each batch */
         while ((r = ac_in_advance(ins[0])) != NULL) {
           ac_pool_clear(w->pool);
           transforms->runner(w, r, outs);
@@ -2020,6 +2160,17 @@ static bool in_out_runner(ac_worker_t *w) {
               ac_out_write_record(outs[i], r->record, r->length);
           }
           ac_buffer_destroy(bh);
+        } else if (ac_in_advance_batch_in_place(ins[0])) {
+          ac_io_record_t records[IN_OUT_BATCH_SIZE];
+          size_t num_records;
+          while ((num_records = ac_in_advance_batch(ins[0], records,
+                                                    IN_OUT_BATCH_SIZE)) > 0) {
+            for (size_t j = 0; j < num_records; j++) {
+              r = records + j;
+              for (size_t i = 0; i < num_outs; i++)
+                ac_out_write_record(outs[i], r->record, r->length);
+            }
+          }
         } else {
           while ((r = ac_in_advance(ins[0])) != NULL) {
             for (size_t i = 0; i < num_outs; i++)
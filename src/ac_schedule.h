@@ -175,6 +175,20 @@ void ac_task_output_dump(ac_task_t *task, ac_task_dump_f dump, void *arg);
 void ac_task_output_partition(ac_task_t *task, ac_io_partition_f part,
                               void *arg);
 
+/* Partition the output by ranges of the compare function with split points
+   sampled from the first sample_size records (see
+   ac_out_ext_options_range_partition).  The task must not be partitioned
+   (this aborts if it is), since each task partition would pick its own split
+   points and the destination partitions wouldn't be totally ordered.  For a
+   partitioned task, build an ac_io_range_partition_t in a pre-pass and pass
+   it to ac_task_output_partition with ac_io_range_partition. */
+void ac_task_output_range_partition(ac_task_t *task, size_t sample_size);
+
+void ac_task_output_skew(ac_task_t *task, double threshold,
+                         size_t max_sub_partitions);
+
+void ac_task_output_replacement_selection(ac_task_t *task);
+
 void ac_task_output_compare(ac_task_t *task, ac_io_compare_f compare,
                             void *compare_tag);
 
@@ -194,6 +208,11 @@ void ac_task_output_intermediate_reducer(ac_task_t *task,
 void ac_task_output_group_size(ac_task_t *task, size_t num_per_group,
                                size_t start);
 
+void ac_task_output_key_prefix(ac_task_t *task, ac_io_key_prefix_f key_prefix,
+                               void *arg);
+
+void ac_task_output_combine(ac_task_t *task, ac_io_hash_f hash, void *arg);
+
 void ac_task_output_use_extra_thread(ac_task_t *task);
 
 void ac_task_output_dont_compress_tmp(ac_task_t *task);
@@ -204,6 +223,15 @@ void ac_task_output_sort_while_partitioning(ac_task_t *task);
 
 void ac_task_output_num_sort_threads(ac_task_t *task, size_t num_sort_threads);
 
+void ac_task_output_num_run_sort_threads(ac_task_t *task,
+                                         size_t num_run_sort_threads);
+
+void ac_task_output_max_fan_in(ac_task_t *task, size_t max_fan_in);
+
+void ac_task_output_pipeline(ac_task_t *task, size_t num_buffers,
+                             size_t num_sort_threads,
+                             size_t num_compress_threads);
+
 void ac_task_output_format(ac_task_t *task, ac_io_format_t format);
 
 void ac_task_output_safe_mode(ac_task_t *task);
@@ -215,6 +243,14 @@ void ac_task_output_gz(ac_task_t *task, int level);
 void ac_task_output_lz4(ac_task_t *task, int level, ac_lz4_block_size_t size,
                         bool block_checksum, bool content_checksum);
 
+void ac_task_output_lz4_threads(ac_task_t *task, size_t num_threads);
+
+void ac_task_output_gz_threads(ac_task_t *task, size_t num_threads);
+
+void ac_task_output_key_index(ac_task_t *task, size_t span);
+
+void ac_task_output_io_uring(ac_task_t *task, size_t num_writes);
+
 /* The ac_task_input... methods apply to the previous ac_task_input_files or
    ac_task_output call.  If the previous ac_task_output call doesn't specify
    one or more destinations, the calls are silently ignored. */
@@ -234,6 +270,15 @@ void ac_task_input_compressed_buffer_size(ac_task_t *task, size_t buffer_size);
 
 void ac_task_input_limit(ac_task_t *task, size_t limit);
 
+/* Only read the input files which may have one of the keys, according to the
+   bloom filters written with them (see ac_out_options_bloom_filter).  Files
+   without a filter are always read.  The keys must remain valid while the
+   task runs. */
+void ac_task_input_bloom_keys(ac_task_t *task, ac_io_hash_f hash, void *arg,
+                              const ac_io_record_t *keys, size_t num_keys);
+
+void ac_task_input_io_uring(ac_task_t *task, size_t num_blocks);
+
 /* Use this if the dependency must finish completely prior to task running.
    Vertical bars can seperate dependencies.
 */
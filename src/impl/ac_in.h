@@ -32,6 +32,23 @@ typedef struct {
 
   bool gz;
   bool lz4;
+  bool mmap;
+  size_t readahead;
+  size_t lz4_threads;
+  size_t io_uring;
+  uint64_t range_start;
+  uint64_t range_end;
+  bool record_range;
+
+  ac_io_compare_f key_compare;
+  void *key_compare_arg;
+  const ac_io_record_t *key_start;
+  const ac_io_record_t *key_end;
+
+  ac_io_hash_f bloom_hash;
+  void *bloom_hash_arg;
+  const ac_io_record_t *bloom_keys;
+  size_t num_bloom_keys;
 
   bool full_record_required;
 
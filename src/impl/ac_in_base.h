@@ -16,6 +16,8 @@ limitations under the License.
 
 struct ac_in_base_s;
 typedef struct ac_in_base_s ac_in_base_t;
+struct ac_in_readahead_s;
+typedef struct ac_in_readahead_s ac_in_readahead_t;
 
 typedef struct {
   char *buffer;
@@ -24,4 +26,25 @@ typedef struct {
   size_t pos;
   bool eof;
   bool can_free;
+
+  /* delimiters found in [delims_start, delims_end) as offsets from
+     delims_start (see ac_in_buffer_find_delimiter) */
+  uint32_t *delims;
+  uint32_t num_delims;
+  uint32_t next_delim;
+  size_t delims_start;
+  size_t delims_end;
 } ac_in_buffer_t;
+
+/* the bytes which were replaced by the zero after each record of a batch (see
+   ac_in_buffer_read_batch) */
+typedef struct {
+  char *p;
+  char c;
+} ac_in_zero_t;
+
+typedef struct {
+  ac_in_zero_t *zeros;
+  size_t num_zeros;
+  size_t size;
+} ac_in_batch_t;
@@ -29,8 +29,40 @@ typedef struct {
 
   bool gz;
   bool lz4;
+  size_t lz4_threads;
+  size_t gz_threads;
+  size_t key_index;
+  ac_io_hash_f bloom_hash;
+  void *bloom_hash_arg;
+  size_t bloom_bits_per_key;
+  size_t io_uring;
 } ac_out_options_t;
 
+/* The key index (see ac_out_options_key_index) is written to filename.keys as
+   a header, num_keys entries and then the keys one after another.  The header
+   has the size and modified time of filename (see ac_io_file_stamp) when the
+   index was written, so an index which doesn't match the file is ignored. */
+#define AC_OUT_KEY_INDEX_MAGIC "ackeys02"
+
+typedef struct {
+  char magic[8];
+  uint64_t num_keys;
+  uint64_t size;
+  uint64_t modified;
+} ac_out_key_index_header_t;
+
+typedef struct {
+  /* offset of the record within the uncompressed content */
+  uint64_t offset;
+  /* file offset of the lz4 block holding the record and the record's offset
+     within the block (the offset and 0 for other files) */
+  uint64_t block_offset;
+  uint32_t block_pos;
+  uint32_t length;
+  /* offset of the key after the entries */
+  uint64_t key;
+} ac_out_key_index_entry_t;
+
 typedef struct {
   /* need to set first block */
   bool use_extra_thread;
@@ -39,24 +71,40 @@ typedef struct {
   bool sort_before_partitioning;
   bool sort_while_partitioning;
   size_t num_sort_threads;
+  size_t num_run_sort_threads;
+  size_t pipeline_buffers;
+  size_t pipeline_sort_threads;
+  size_t pipeline_compress_threads;
 
   ac_io_partition_f partition;
   void *partition_arg;
   size_t num_partitions;
+  size_t range_sample_size;
+  double skew_threshold;
+  size_t max_sub_partitions;
 
   ac_io_compare_f compare;
   void *compare_arg;
 
   size_t num_per_group;
+  size_t max_fan_in;
+  size_t limit;
+  bool replacement_selection;
   ac_io_compare_f int_compare;
   void *int_compare_arg;
 
+  ac_io_key_prefix_f key_prefix;
+  void *key_prefix_arg;
+
   ac_io_reducer_f reducer;
   void *reducer_arg;
 
   ac_io_reducer_f int_reducer;
   void *int_reducer_arg;
 
+  ac_io_hash_f combine_hash;
+  void *combine_hash_arg;
+
   ac_io_fixed_reducer_f fixed_reducer;
   void *fixed_reducer_arg;
 
@@ -65,4 +113,7 @@ typedef struct {
 
   ac_io_fixed_sort_f fixed_sort;
   void *fixed_sort_arg;
+
+  size_t fixed_key_offset;
+  size_t fixed_key_width;
 } ac_out_ext_options_t;